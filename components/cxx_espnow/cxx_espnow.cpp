@@ -2,9 +2,15 @@
 #include "util_task.hpp"
 #include "util_misc.hpp"
 #include "util_time.hpp"
+#include "core_http.hpp"
 
 #include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
 
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
 #include <utility>
 
 #define TAG "espnow"
@@ -15,6 +21,26 @@ std::unique_ptr<ESPNow> espnow;
 
 static constexpr TickType_t MAX_DELAY = 512;
 
+static const char *send_error_str(esp_err_t err)
+{
+	switch (err) {
+		case ESP_ERR_ESPNOW_NOT_INIT:
+			return "Not initialized";
+		case ESP_ERR_ESPNOW_ARG:
+			return "Invalid argument";
+		case ESP_ERR_ESPNOW_INTERNAL:
+			return "Internal error";
+		case ESP_ERR_ESPNOW_NO_MEM:
+			return "Out of memory";
+		case ESP_ERR_ESPNOW_NOT_FOUND:
+			return "Peer is not found";
+		case ESP_ERR_ESPNOW_IF:
+			return "current WiFi interface doesn’t match that of peer";
+		default:
+			return "Unknown error";
+	}
+}
+
 void espnow_send_cb(const uint8_t *mac_addr, esp_now_send_status_t status)
 {
 	if (!espnow)
@@ -22,11 +48,39 @@ void espnow_send_cb(const uint8_t *mac_addr, esp_now_send_status_t status)
 
 	ESP_LOGD(TAG, "send_cb, status %d", status);
 
-	if (!espnow->events.send({ESPNow::EventSend(mac_addr, status)}, MAX_DELAY)) {
+	if (!espnow->post(ESPNow::Lane::Control, {ESPNow::EventSend(mac_addr, status)}, MAX_DELAY)) {
 		ESP_LOGW(TAG, "Failed to enqueue EventSend");
 	}
 }
 
+/**
+ * ESP-NOW receive callback doesn't report RSSI, so it is picked from the
+ * promiscuous callback, which the Wi-Fi task runs just before it for the same
+ * frame. Both run in the Wi-Fi task, so no locking is needed.
+ */
+static struct {
+	uint8_t mac[ESP_NOW_ETH_ALEN];
+	int8_t rssi;
+} last_rx_signal;
+
+static void espnow_promisc_cb(void *buf, wifi_promiscuous_pkt_type_t type)
+{
+	static constexpr uint8_t FC_ACTION = 0xd0;
+	static constexpr uint8_t CATEGORY_VENDOR = 127;
+	static constexpr size_t ADDR2_OFFSET = 10;
+	static constexpr size_t CATEGORY_OFFSET = 24;
+
+	if (type != WIFI_PKT_MGMT)
+		return;
+	const auto *pkt = static_cast<const wifi_promiscuous_pkt_t *>(buf);
+	if ((pkt->rx_ctrl.sig_len <= CATEGORY_OFFSET) ||
+			(pkt->payload[0] != FC_ACTION) ||
+			(pkt->payload[CATEGORY_OFFSET] != CATEGORY_VENDOR))
+		return;
+	memcpy(last_rx_signal.mac, pkt->payload + ADDR2_OFFSET, ESP_NOW_ETH_ALEN);
+	last_rx_signal.rssi = pkt->rx_ctrl.rssi;
+}
+
 void espnow_recv_cb(const uint8_t *mac_addr, const uint8_t *data, int data_len)
 {
 	if (!espnow)
@@ -34,8 +88,28 @@ void espnow_recv_cb(const uint8_t *mac_addr, const uint8_t *data, int data_len)
 
 	ESP_LOGD(TAG, "recv_cb, data_len %d", data_len);
 
-	if (!espnow->events.send({ESPNow::EventRecv(mac_addr, data, data_len)}, MAX_DELAY)) {
+	const auto lane = espnow->classify(data, data_len);
+	if ((lane != ESPNow::Lane::Control) &&
+			(espnow->frames.available() <= ESPNow::CONTROL_RESERVED_FRAMES)) {
+		ESP_LOGD(TAG, "Free frame slots reserved for control, dropping");
+		espnow->event_lane(lane).dropped++;
+		return;
+	}
+
+	const int8_t rssi = (memcmp(last_rx_signal.mac, mac_addr, ESP_NOW_ETH_ALEN) == 0)
+		? last_rx_signal.rssi
+		: 0;
+	auto *frame = espnow->frames.take(mac_addr, data, data_len, rssi);
+	if (!frame) {
+		ESP_LOGD(TAG, "No free frame slot, dropping");
+		return;
+	}
+
+	// Only control may hold up the Wi-Fi task waiting for room
+	const TickType_t timeout = (lane == ESPNow::Lane::Control) ? MAX_DELAY : 0;
+	if (!espnow->post(lane, {ESPNow::EventRecv(frame)}, timeout)) {
 		ESP_LOGW(TAG, "Failed to enqueue EventRecv");
+		espnow->frames.release(frame);
 	}
 }
 
@@ -44,21 +118,9 @@ ESPNow::EventSend::EventSend(const uint8_t *_mac_addr, esp_now_send_status_t _st
 	status(_status)
 {}
 
-ESPNow::EventRecv::EventRecv(const uint8_t *_mac_addr, const uint8_t *_data, size_t _data_len) :
-	peer(_mac_addr),
-	data(static_cast<uint8_t *>(malloc(_data_len))),
-	data_len(_data_len)
-{
-	if (!data)
-		throw std::runtime_error("Failed to allocate memory for message");
-	memcpy(data, _data, data_len);
-}
-
-void ESPNow::EventRecv::release()
-{
-	free(const_cast<void *>(static_cast<const void *>(data)));
-	data = nullptr;
-}
+ESPNow::EventRecv::EventRecv(Frame *_frame) :
+	frame(_frame)
+{}
 
 ESPNow::Event::Event() :
 	id(EventID::None),
@@ -75,15 +137,60 @@ ESPNow::Event::Event(EventRecv&& recv) :
 	info{.recv = recv}
 {}
 
+ESPNow::EventLane::EventLane(size_t size) :
+	queue(size),
+	events(0),
+	dropped(0),
+	depth_max(0)
+{}
+
 ESPNow::ESPNow() :
-	Task(TAG, 4*1024, 15),
+	Task(TAG, TASK_STACK_SIZE, 15),
 	Lockable(TAG),
-	send_seq(0),
-	events(16)
+	handlers(),
+	rx_unhandled(0),
+	rx_bad_length(0),
+	rx_invalid(0),
+	rx_filtered(0),
+	frames(),
+	last_expire_check_us(0),
+	stack_free_min(TASK_STACK_SIZE),
+	ping_interval(DEFAULT_PING_INTERVAL),
+	clock_reference(),
+	phy_rate(WIFI_PHY_RATE_1M_L),
+	pump_requested(false),
+	reliable_epoch(esp_random()),
+	reliable_types(),
+	groups(),
+	foreign_groups(),
+	announce_interval(DEFAULT_ANNOUNCE_INTERVAL),
+	announce_burst(0),
+	last_announce_us(0),
+	learn_peers(false),
+	peer_store(),
+	peer_store_saved(),
+	peer_store_dirty(false),
+	peer_store_dirty_us(0),
+	link_up(),
+	control_seen(false),
+	lanes(),
+	event_lanes{{{LANE_QUEUE_SIZE}, {LANE_QUEUE_SIZE}}},
+	event_set(LANE_COUNT * LANE_QUEUE_SIZE)
 {
 	uint32_t version;
 	esp_err_t ret;
 
+	link_up.init_us = esp_timer_get_time();
+	for (auto& lane : event_lanes)
+		event_set.add(lane.queue);
+	for (auto& lane : lanes)
+		lane = Lane::Bulk;
+	// Round trips and acknowledgements measure and drive the control path
+	lanes[MessageId::Ping] = Lane::Control;
+	lanes[MessageId::Pong] = Lane::Control;
+	lanes[MessageId::Ack] = Lane::Control;
+	lanes[MessageId::StreamAck] = Lane::Control;
+
 	wifi_mode_t mode;
 	esp_wifi_get_mode(&mode);
 	//iface = (mode == WIFI_MODE_STA || mode == WIFI_MODE_APSTA) ? WIFI_IF_STA : WIFI_IF_AP;
@@ -106,11 +213,26 @@ ESPNow::ESPNow() :
 	ret = esp_wifi_set_protocol(iface, WIFI_PROTOCOL_11B|WIFI_PROTOCOL_11G|WIFI_PROTOCOL_11N|WIFI_PROTOCOL_LR);
 	if (ret != ESP_OK)
 		throw std::runtime_error("ESP-Now set wifi protocol failed");
-	ret = esp_wifi_config_espnow_rate(iface, WIFI_PHY_RATE_1M_L);
+	ret = esp_wifi_config_espnow_rate(iface, phy_rate);
 	if (ret != ESP_OK)
 		throw std::runtime_error("ESP-Now set rate failed");
 
+	const wifi_promiscuous_filter_t filter = {
+		.filter_mask = WIFI_PROMIS_FILTER_MASK_MGMT,
+	};
+	esp_wifi_set_promiscuous_filter(&filter);
+	esp_wifi_set_promiscuous_rx_cb(espnow_promisc_cb);
+	ret = esp_wifi_set_promiscuous(true);
+	if (ret != ESP_OK)
+		ESP_LOGW(TAG, "Failed to enable promiscuous mode, no RSSI for rate control");
+
+	add_peer(PeerBroadcast, std::nullopt, DEFAULT_WIFI_CHANNEL);
+	restore_peers();
+
 	Task::start();
+	register_console_cmd();
+	if (Core::http)
+		register_http_handlers();
 }
 
 ESPNow::~ESPNow()
@@ -128,13 +250,32 @@ void ESPNow::set_led(std::shared_ptr<Core::StatusLed> _led)
 void ESPNow::add_peer(
 		const PeerAddress& address,
 		const std::optional<PeerKey>& key,
-		uint8_t channel
+		uint8_t channel,
+		size_t tx_window
 		)
 {
 	const auto lock = take_unique_lock();
 	const auto& found = peers.find(address);
-	if (found != peers.end())
+	if (found != peers.end()) {
+		// Restored from the peer table, the application's settings win
+		found->second.learned = false;
+		found->second.tx_window = std::clamp<size_t>(tx_window, 1, TX_QUEUE_SIZE);
+		if (found->second.channel != channel) {
+			found->second.channel = channel;
+			peers_changed(lock);
+		}
+		if (key) {
+			esp_now_peer_info_t info = {};
+			memcpy(info.peer_addr, address.bytes(), ESP_NOW_ETH_ALEN);
+			memcpy(info.lmk, key->data(), ESP_NOW_KEY_LEN);
+			info.encrypt = true;
+			info.channel = 0;
+			info.ifidx = iface;
+			if (esp_now_mod_peer(&info) != ESP_OK)
+				throw std::runtime_error("esp_now_mod_peer failed");
+		}
 		return;
+	}
 
 	esp_now_peer_info_t info;
 	memcpy(info.peer_addr, address.bytes(), ESP_NOW_ETH_ALEN);
@@ -149,9 +290,19 @@ void ESPNow::add_peer(
 	info.ifidx = iface;
 
 	auto [peer, is_new] = peers.try_emplace(address);
+	peer->second.tx_window = std::clamp<size_t>(tx_window, 1, TX_QUEUE_SIZE);
+	peer->second.channel = channel;
+	// Broadcast frames are not acknowledged, there's nothing to adapt to
+	peer->second.rate_control = !(address == PeerBroadcast);
+	if (address == PeerBroadcast) {
+		peer->second.wire_version = WIRE_VERSION_MAX;
+		peer->second.max_wire_version = WIRE_VERSION_1;
+	}
 	info.priv = &peer;
 
 	auto ret = esp_now_add_peer(&info);
+	if (ret != ESP_OK)
+		peers.erase(peer);
 	switch (ret) {
 		case ESP_ERR_ESPNOW_NOT_INIT:
 			throw std::runtime_error("esp_now_add_peer: Not initialized");
@@ -164,73 +315,1472 @@ void ESPNow::add_peer(
 		case ESP_ERR_ESPNOW_EXIST:
 			throw std::runtime_error("esp_now_add_peer: Peer already exists");
 	}
+	if (!(address == PeerBroadcast))
+		peers_changed(lock);
+}
+
+void ESPNow::set_tx_window(const PeerAddress& address, size_t tx_window)
+{
+	const auto lock = take_unique_lock();
+	auto& peer = peers.at(address);
+	peer.tx_window = std::clamp<size_t>(tx_window, 1, TX_QUEUE_SIZE);
+	tx_pump(lock, address, peer);
+}
+
+void ESPNow::send(const MessageInterface& msg, SendCallback&& cb)
+{
+	ESP_LOGD(TAG, "send: %s", msg.to_string().c_str());
+	const auto& hdr = msg.header();
+	send(msg.peer(), hdr.type, msg.payload(), hdr.length, std::move(cb));
+}
+
+void ESPNow::send(const MessageBuilder& msg, SendCallback&& cb)
+{
+	send(msg.peer(), msg.type(), msg.payload(), msg.payload_length(), std::move(cb));
 }
 
-std::shared_future<SendResult> ESPNow::send(const MessageInterface& msg)
+void ESPNow::send(const PeerAddress& addr, MessageType type, const void *payload, size_t length,
+		SendCallback&& cb)
 {
+	if (length > MAX_PAYLOAD_LENGTH)
+		throw std::invalid_argument("esp_now_send: Payload too long");
+
 	const auto lock = take_unique_lock();
-	const auto& addr = msg.peer();
 	auto& peer = peers.at(addr);
-	if (peer.send_result) {
-		auto future = peer.send_result->future;
-		auto status = future.wait_for(1s);
-		if (status != std::future_status::ready)
-			throw std::runtime_error("esp_now_send: Timed out waiting for previous transmission");
+	if (reliable_types[type] && !(addr == PeerBroadcast))
+		reliable_send(lock, addr, peer, type, payload, length, std::move(cb));
+	else
+		enqueue(lock, addr, peer, type, payload, length, std::move(cb));
+	request_pump();
+}
+
+void ESPNow::set_reliable(MessageType type, bool enable)
+{
+	const auto lock = take_unique_lock();
+	reliable_types[type] = enable;
+}
+
+void ESPNow::set_aggregation(const PeerAddress& address, bool enable)
+{
+	const auto lock = take_unique_lock();
+	peers.at(address).aggregate = enable;
+}
+
+void ESPNow::set_rate_control(const PeerAddress& address, bool enable)
+{
+	const auto lock = take_unique_lock();
+	peers.at(address).rate_control = enable && !(address == PeerBroadcast);
+}
+
+void ESPNow::set_max_wire_version(const PeerAddress& address, uint8_t version)
+{
+	const auto lock = take_unique_lock();
+	peers.at(address).max_wire_version = std::clamp(version, WIRE_VERSION_1, WIRE_VERSION_MAX);
+}
+
+static void groups_to_bitmap(const std::bitset<256>& groups, uint8_t *bitmap)
+{
+	for (size_t i = 0; i < groups.size(); i++) {
+		if (groups[i])
+			bitmap[i / 8] |= (1 << (i % 8));
 	}
+}
 
-	const auto& data = msg.prepare(send_seq++);
-	ESP_LOGD(TAG, "send: %s", msg.to_string().c_str());
-	auto ret = esp_now_send(addr.bytes(), data.data(), data.size());
-	switch (ret) {
-		case ESP_ERR_ESPNOW_NOT_INIT:
-			throw std::runtime_error("esp_now_send: Not initialized");
-		case ESP_ERR_ESPNOW_ARG:
-			throw std::runtime_error("esp_now_send: Invalid argument");
-		case ESP_ERR_ESPNOW_INTERNAL:
-			throw std::runtime_error("esp_now_send: Internal error");
-		case ESP_ERR_ESPNOW_NO_MEM:
-			throw std::runtime_error("esp_now_send: Out of memory");
-		case ESP_ERR_ESPNOW_NOT_FOUND:
-			throw std::runtime_error("esp_now_send: Peer is not found");
-		case ESP_ERR_ESPNOW_IF:
-			throw std::runtime_error("esp_now_send: current WiFi interface doesn’t match that of peer");
+static std::bitset<256> groups_from_bitmap(const uint8_t *bitmap)
+{
+	std::bitset<256> groups;
+	for (size_t i = 0; i < groups.size(); i++) {
+		groups[i] = bitmap[i / 8] & (1 << (i % 8));
 	}
-	peer.last_tx_seq = send_seq;
-	peer.last_tx_time = time_now();
-	peer.send_result = std::make_unique<Peer::ResultPromise>();
-	peer.send_result->future = peer.send_result->promise.get_future().share();
-	return peer.send_result->future;
+	return groups;
+}
+
+void ESPNow::announce()
+{
+	AnnouncePayload payload = {};
+	payload.version = WIRE_VERSION_MAX;
+	{
+		const auto lock = take_shared_lock();
+		groups_to_bitmap(groups, payload.groups);
+	}
+	send(PeerBroadcast, MessageId::Announce, &payload, sizeof(payload));
+}
+
+void ESPNow::set_announce_interval(milliseconds interval)
+{
+	const auto lock = take_unique_lock();
+	announce_interval = interval;
+}
+
+void ESPNow::set_learn_peers(bool enable)
+{
+	const auto lock = take_unique_lock();
+	learn_peers = enable;
+}
+
+milliseconds ESPNow::service_announce(int64_t now_us)
+{
+	int64_t due;
+	{
+		const auto lock = take_shared_lock();
+		if (announce_interval == 0ms)
+			return milliseconds::max();
+		if (announce_burst < std::size(ANNOUNCE_BURST_MS))
+			due = link_up.init_us + ANNOUNCE_BURST_MS[announce_burst] * 1000;
+		else
+			due = last_announce_us + std::chrono::duration_cast<std::chrono::microseconds>(announce_interval).count();
+	}
+	if (now_us < due)
+		return std::chrono::duration_cast<milliseconds>(std::chrono::microseconds(due - now_us));
+
+	try {
+		announce();
+	}
+	catch (const std::exception& e) {
+		ESP_LOGD(TAG, "announce: %s", e.what());
+	}
+	const auto lock = take_unique_lock();
+	if (announce_burst < std::size(ANNOUNCE_BURST_MS))
+		announce_burst++;
+	last_announce_us = now_us;
+	return 0ms;
+}
+
+void ESPNow::learn_peer(const PeerAddress& address)
+{
+	uint8_t channel = DEFAULT_WIFI_CHANNEL;
+	wifi_second_chan_t second;
+	esp_wifi_get_channel(&channel, &second);
+	{
+		const auto lock = take_unique_lock();
+		const auto now = time_now();
+		size_t learned = 0;
+		auto oldest = peers.end();
+		for (auto it = peers.begin(); it != peers.end(); it++) {
+			const auto& peer = it->second;
+			if (!peer.learned)
+				continue;
+			learned++;
+			// Peers with traffic pending or serving as the clock reference stay
+			const bool idle = peer.tx_queue.empty() && !peer.rtx.size() &&
+				!(it->first == clock_reference) &&
+				(now - peer.last_rx_time >= LEARNED_PEER_IDLE);
+			if (idle && ((oldest == peers.end()) || (peer.last_rx_time < oldest->second.last_rx_time)))
+				oldest = it;
+		}
+		if (learned >= MAX_LEARNED_PEERS) {
+			if (oldest == peers.end()) {
+				ESP_LOGW(TAG, "learn peer %s: %zu learned peers, none idle",
+						::to_string(address).c_str(), learned);
+				return;
+			}
+			ESP_LOGI(TAG, "Forgetting peer %s", ::to_string(oldest->first).c_str());
+			esp_now_del_peer(oldest->first.bytes());
+			peers.erase(oldest);
+			peers_changed(lock);
+		}
+	}
+	try {
+		add_peer(address, std::nullopt, channel);
+	}
+	catch (const std::exception& e) {
+		ESP_LOGW(TAG, "learn peer %s: %s", ::to_string(address).c_str(), e.what());
+		return;
+	}
+	const auto lock = take_unique_lock();
+	auto& peer = peers.at(address);
+	peer.learned = true;
+	// Its Announce was accounted before it had an entry
+	peer.last_rx_time = time_now();
+	ESP_LOGI(TAG, "Learned peer %s", ::to_string(address).c_str());
+}
+
+void ESPNow::restore_peers()
+{
+	const auto stored = peer_store.load();
+	for (const auto& p : stored) {
+		const PeerAddress addr(p.mac);
+		if (addr == PeerBroadcast)
+			continue;
+		try {
+			add_peer(addr, std::nullopt, p.channel);
+		}
+		catch (const std::exception& e) {
+			ESP_LOGW(TAG, "restore peer %s: %s", ::to_string(addr).c_str(), e.what());
+			continue;
+		}
+		const auto lock = take_unique_lock();
+		auto& peer = peers.at(addr);
+		// Until the application adds it again
+		peer.learned = true;
+		peer.wire_version = std::clamp(p.wire_version, WIRE_VERSION_1, WIRE_VERSION_MAX);
+		peer.groups = groups_from_bitmap(p.groups);
+		link_up.restored_peers++;
+	}
+	const auto lock = take_unique_lock();
+	// Restoring isn't a change worth writing back
+	peer_store_saved = stored;
+	peer_store_dirty = false;
+	ESP_LOGI(TAG, "Restored %zu peers", link_up.restored_peers);
 }
 
-void ESPNow::on_recv(MessageType type, ESPNow::MessageHandler&& handler)
+void ESPNow::peers_changed(const unique_lock&)
 {
+	if (!peer_store_dirty)
+		peer_store_dirty_us = esp_timer_get_time();
+	peer_store_dirty = true;
+}
+
+std::vector<StoredPeer> ESPNow::stored_peers(const shared_lock&) const
+{
+	// The application's peers come first, then learned ones heard most recently
+	std::vector<std::pair<const PeerAddress *, const Peer *>> keep;
+	for (const auto& [addr, peer] : peers) {
+		if (!(addr == PeerBroadcast))
+			keep.emplace_back(&addr, &peer);
+	}
+	std::sort(keep.begin(), keep.end(), [](const auto& a, const auto& b) {
+		if (a.second->learned != b.second->learned)
+			return !a.second->learned;
+		if (a.second->last_rx_time != b.second->last_rx_time)
+			return a.second->last_rx_time > b.second->last_rx_time;
+		return memcmp(a.first->bytes(), b.first->bytes(), ESP_NOW_ETH_ALEN) < 0;
+	});
+	keep.resize(std::min(keep.size(), PeerStore::MAX_PEERS));
+
+	std::vector<StoredPeer> stored;
+	for (const auto& [addr_ptr, peer_ptr] : keep) {
+		const auto& addr = *addr_ptr;
+		const auto& peer = *peer_ptr;
+		StoredPeer p = {};
+		memcpy(p.mac, addr.bytes(), sizeof(p.mac));
+		p.channel = peer.channel;
+		p.wire_version = peer.wire_version;
+		groups_to_bitmap(peer.groups, p.groups);
+		stored.push_back(p);
+	}
+	// Map order is arbitrary, keep the stored table comparable
+	std::sort(stored.begin(), stored.end(), [](const StoredPeer& a, const StoredPeer& b) {
+		return memcmp(a.mac, b.mac, sizeof(a.mac)) < 0;
+	});
+	return stored;
+}
+
+void ESPNow::service_peer_store(int64_t now_us)
+{
+	std::vector<StoredPeer> stored;
+	{
+		const auto lock = take_shared_lock();
+		if (!peer_store_dirty || (now_us - peer_store_dirty_us < PEER_STORE_DELAY_US))
+			return;
+		stored = stored_peers(lock);
+	}
+	{
+		const auto lock = take_unique_lock();
+		peer_store_dirty = false;
+		// Spare the flash when nothing that is stored changed
+		if ((stored.size() == peer_store_saved.size()) &&
+				!memcmp(stored.data(), peer_store_saved.data(), stored.size() * sizeof(StoredPeer)))
+			return;
+	}
+	try {
+		peer_store.save(stored);
+	}
+	catch (const std::exception& e) {
+		ESP_LOGW(TAG, "%s", e.what());
+		const auto lock = take_unique_lock();
+		peers_changed(lock);
+		return;
+	}
+	const auto lock = take_unique_lock();
+	peer_store_saved = std::move(stored);
+	ESP_LOGI(TAG, "Saved %zu peers", peer_store_saved.size());
+}
+
+void ESPNow::note_first_control(const MessageView& msg)
+{
+	const auto now = esp_timer_get_time();
+	const auto lock = take_unique_lock();
+	if (link_up.first_control_us)
+		return;
+	link_up.first_control_us = now;
+	link_up.first_control_peer = msg.peer();
+	link_up.first_control_type = msg.header().type;
+	control_seen = true;
+	ESP_LOGI(TAG, "Link up: first control message 0x%02x from %s at %lld ms after boot",
+			msg.header().type, ::to_string(msg.peer()).c_str(), now / 1000);
+}
+
+ESPNow::LinkUpStats ESPNow::link_up_stats() const
+{
+	const auto lock = take_shared_lock();
+	return link_up;
+}
+
+void ESPNow::join_group(GroupId group)
+{
+	if (group == GROUP_NONE)
+		throw std::invalid_argument("join_group: Invalid group");
+	const auto lock = take_unique_lock();
+	groups[group] = true;
+}
+
+void ESPNow::leave_group(GroupId group)
+{
+	const auto lock = take_unique_lock();
+	groups[group] = false;
+}
+
+bool ESPNow::in_group(GroupId group) const
+{
+	const auto lock = take_shared_lock();
+	return groups[group];
+}
+
+std::pair<const PeerAddress, ESPNow::Peer>& ESPNow::group_route(const unique_lock& lock, GroupId group)
+{
+	auto member = peers.end();
+	size_t members = 0;
+	if (!foreign_groups[group]) {
+		for (auto it = peers.begin(); it != peers.end(); it++) {
+			if (!(it->first == PeerBroadcast) && it->second.groups[group]) {
+				member = it;
+				members++;
+			}
+		}
+	}
+	// A single member gets link-level acks and rate control
+	if ((members == 1) && (member->second.wire_version >= WIRE_VERSION_2))
+		return *member;
+
+	const auto& broadcast = peers.find(PeerBroadcast);
+	if (broadcast == peers.end())
+		throw std::runtime_error("send_group: Broadcast peer not added");
+	return *broadcast;
+}
+
+void ESPNow::send_group(GroupId group, MessageType type, const void *payload, size_t length,
+		SendCallback&& cb)
+{
+	if (group == GROUP_NONE)
+		throw std::invalid_argument("send_group: Invalid group");
+	if (length > MAX_PAYLOAD_LENGTH)
+		throw std::invalid_argument("esp_now_send: Payload too long");
+
+	const auto lock = take_unique_lock();
+	auto& [addr, peer] = group_route(lock, group);
+	enqueue(lock, addr, peer, type, payload, length, std::move(cb), group);
+	request_pump();
+}
+
+void ESPNow::send_group(GroupId group, const MessageBuilder& msg, SendCallback&& cb)
+{
+	send_group(group, msg.type(), msg.payload(), msg.payload_length(), std::move(cb));
+}
+
+void ESPNow::enqueue(const unique_lock& lock, const PeerAddress& addr, Peer& peer,
+		MessageType type, const void *payload, size_t length, SendCallback&& cb,
+		GroupId group)
+{
+	if (peer.tx_queue.full()) {
+		peer.tx_stats.dropped++;
+		throw std::runtime_error("esp_now_send: TX queue full");
+	}
+
+	auto& entry = peer.tx_queue.emplace_back();
+	entry.type = type;
+	entry.length = length;
+	memcpy(entry.payload.data(), payload, length);
+	entry.callback = std::move(cb);
+	entry.queued_us = esp_timer_get_time();
+	entry.group = group;
+
+	auto& stats = peer.tx_stats;
+	stats.queued++;
+	stats.depth = peer.tx_queue.size();
+	stats.depth_max = std::max(stats.depth_max, stats.depth);
+}
+
+void ESPNow::request_pump()
+{
+	// Pumping is deferred to the ESP-NOW task, so that messages queued in a
+	// burst can be aggregated into a single frame
+	if (!pump_requested.exchange(true) && (Task::task.get_id() != std::this_thread::get_id()))
+		wake();
+}
+
+/**
+ * Set transmit time of Pings and Pongs in a frame about to be sent. Time
+ * spent in the transmit queue would otherwise count as link delay one way
+ * and skew the clock offset estimate.
+ */
+static void stamp_tx_time(uint8_t *payload, size_t length, MessageType type, int64_t tx_us)
+{
+	switch (type) {
+		case MessageId::Ping:
+			if (length >= sizeof(PingPayload))
+				memcpy(payload + offsetof(PingPayload, timestamp_us), &tx_us, sizeof(tx_us));
+			return;
+		case MessageId::Pong:
+			if (length >= sizeof(PongPayload))
+				memcpy(payload + offsetof(PongPayload, tx_us), &tx_us, sizeof(tx_us));
+			return;
+		case MessageId::Aggregate:
+			break;
+		default:
+			return;
+	}
+	size_t i = 0;
+	while (i + sizeof(AggregateRecord) <= length) {
+		const auto& rec = *reinterpret_cast<const AggregateRecord *>(payload + i);
+		i += sizeof(AggregateRecord);
+		if (rec.type != MessageId::Aggregate)
+			stamp_tx_time(payload + i, std::min<size_t>(rec.length, length - i), rec.type, tx_us);
+		i += rec.length;
+	}
+}
+
+bool ESPNow::tx_aggregates(const PeerAddress& addr, const Peer& peer, GroupId group) const
+{
+	// v1 firmware drops Aggregate frames, everyone a frame reaches must be on v2
+	if (!peer.aggregate)
+		return false;
+	if (!(addr == PeerBroadcast))
+		return std::min(peer.wire_version, peer.max_wire_version) >= WIRE_VERSION_2;
+
+	// Plain broadcasts reach nodes nobody knows the version of, so do groups
+	// with members missing from the peer table or none known at all
+	if ((group == GROUP_NONE) || foreign_groups[group])
+		return false;
+	size_t members = 0;
+	for (const auto& [member_addr, member] : peers) {
+		if ((member_addr == PeerBroadcast) || !member.groups[group])
+			continue;
+		if (std::min(member.wire_version, member.max_wire_version) < WIRE_VERSION_2)
+			return false;
+		members++;
+	}
+	return members > 0;
+}
+
+size_t ESPNow::tx_batch(const PeerAddress& addr, const Peer& peer) const
+{
+	const auto group = peer.tx_queue[peer.tx_in_flight].group;
+	if (!tx_aggregates(addr, peer, group))
+		return 1;
+
+	size_t length = 0;
+	size_t count = 0;
+	for (size_t i = peer.tx_in_flight; i < peer.tx_queue.size(); i++) {
+		// Only messages to the same destination share a frame
+		if (peer.tx_queue[i].group != group)
+			break;
+		length += sizeof(AggregateRecord) + peer.tx_queue[i].length;
+		if (length > MAX_PAYLOAD_LENGTH)
+			break;
+		count++;
+	}
+	return std::max<size_t>(count, 1);
+}
+
+void ESPNow::tx_pump(const unique_lock& lock, const PeerAddress& addr, Peer& peer)
+{
+	while ((peer.tx_frames_in_flight < peer.tx_window) &&
+			(peer.tx_in_flight < peer.tx_queue.size())) {
+		auto& entry = peer.tx_queue[peer.tx_in_flight];
+		const size_t batch = tx_batch(addr, peer);
+
+		const uint8_t version = (entry.group != GROUP_NONE)
+			? WIRE_VERSION_2
+			: std::min(peer.wire_version, peer.max_wire_version);
+		auto *payload = tx_frame.data() + header_length(version, entry.group);
+		MessageType type;
+		size_t length = 0;
+		if (batch == 1) {
+			type = entry.type;
+			length = entry.length;
+			memcpy(payload, entry.payload.data(), entry.length);
+		}
+		else {
+			for (size_t i = 0; i < batch; i++) {
+				const auto& e = peer.tx_queue[peer.tx_in_flight + i];
+				auto& rec = *reinterpret_cast<AggregateRecord *>(payload + length);
+				rec.type = e.type;
+				rec.length = e.length;
+				length += sizeof(AggregateRecord);
+				memcpy(payload + length, e.payload.data(), e.length);
+				length += e.length;
+			}
+			type = MessageId::Aggregate;
+		}
+		const size_t rate = peer.rate_control
+			? peer.rate.select(esp_timer_get_time())
+			: RateControl::DEFAULT_RATE;
+		const auto phy = RateControl::RATES[rate].phy;
+		if (phy != phy_rate) {
+			auto err = esp_wifi_config_espnow_rate(iface, phy);
+			if (err == ESP_OK)
+				phy_rate = phy;
+			else
+				ESP_LOGW(TAG, "Failed to set rate %s", RateControl::RATES[rate].name);
+		}
+
+		// Last thing before the header, its CRC covers the payload
+		stamp_tx_time(payload, length, type, esp_timer_get_time());
+		const uint8_t flags = (addr == PeerBroadcast) ? HeaderFlagBroadcast : 0;
+		const auto frame_length = encode_header(tx_frame.data(), version,
+				peer.tx_seq, flags, type, length, entry.group);
+
+		auto ret = esp_now_send(addr.bytes(), tx_frame.data(), frame_length);
+		if (ret == ESP_ERR_ESPNOW_NO_MEM) {
+			// Driver queue is full, try again on the next send completion
+			break;
+		}
+		if (ret != ESP_OK) {
+			ESP_LOGE(TAG, "esp_now_send %s: %s", ::to_string(addr).c_str(), send_error_str(ret));
+			for (size_t i = 0; i < batch; i++) {
+				peer.tx_stats.failed++;
+				complete(lock, std::move(peer.tx_queue[peer.tx_in_flight].callback), false);
+				peer.tx_queue.erase(peer.tx_in_flight);
+			}
+			peer.tx_stats.depth = peer.tx_queue.size();
+			continue;
+		}
+
+		const auto now = esp_timer_get_time();
+		entry.batch = batch;
+		entry.rate = rate;
+		for (size_t i = 0; i < batch; i++) {
+			auto& e = peer.tx_queue[peer.tx_in_flight + i];
+			e.sent_us = now;
+			peer.tx_stats.queue_wait_max_us = std::max(peer.tx_stats.queue_wait_max_us,
+					static_cast<uint32_t>(e.sent_us - e.queued_us));
+		}
+		peer.tx_in_flight += batch;
+		peer.tx_frames_in_flight++;
+		peer.tx_stats.sent++;
+		if (batch > 1)
+			peer.tx_stats.aggregated += batch;
+		peer.last_tx_seq = peer.tx_seq;
+		peer.tx_seq = (peer.tx_seq + 1) & ~BROADCAST_SEQ_FLAG;
+		peer.last_tx_time = time_now();
+	}
+}
+
+void ESPNow::tx_pump_all(const unique_lock& lock)
+{
+	for (auto& [addr, peer] : peers) {
+		tx_pump(lock, addr, peer);
+	}
+}
+
+void ESPNow::tx_complete(const unique_lock& lock, Peer& peer, SendResult result)
+{
+	auto& stats = peer.tx_stats;
+	const auto now = esp_timer_get_time();
+	const size_t batch = peer.tx_queue.front().batch;
+	if (peer.rate_control)
+		peer.rate.report(peer.tx_queue.front().rate, result, now);
+	for (size_t i = 0; i < batch; i++) {
+		auto& entry = peer.tx_queue.front();
+		const auto latency = static_cast<uint32_t>(now - entry.queued_us);
+		stats.latency_last_us = latency;
+		stats.latency_max_us = std::max(stats.latency_max_us, latency);
+		stats.latency_avg_us = stats.latency_avg_us
+			? stats.latency_avg_us + (static_cast<int32_t>(latency - stats.latency_avg_us) / 8)
+			: latency;
+		if (result)
+			stats.ok++;
+		else
+			stats.failed++;
+
+		complete(lock, std::move(entry.callback), result);
+		peer.tx_queue.pop_front();
+		peer.tx_in_flight--;
+	}
+	peer.tx_frames_in_flight--;
+	stats.depth = peer.tx_queue.size();
+}
+
+void ESPNow::tx_expire(const unique_lock& lock)
+{
+	const auto now = esp_timer_get_time();
+	const auto timeout_us = std::chrono::duration_cast<std::chrono::microseconds>(TX_TIMEOUT).count();
+	for (auto& [addr, peer] : peers) {
+		// The driver never reported on those, don't wait for it forever
+		if (peer.tx_frames_expired && (now - peer.tx_expired_us > timeout_us))
+			peer.tx_frames_expired = 0;
+		while (peer.tx_frames_in_flight && (now - peer.tx_queue.front().sent_us > timeout_us)) {
+			ESP_LOGW(TAG, "send %s: timed out", ::to_string(addr).c_str());
+			peer.tx_stats.timeouts++;
+			peer.tx_frames_expired++;
+			peer.tx_expired_us = now;
+			tx_complete(lock, peer, false);
+		}
+		// Also retries frames the driver refused earlier with nothing in flight
+		tx_pump(lock, addr, peer);
+	}
+}
+
+void ESPNow::complete(const unique_lock& lock, SendCallback&& cb, SendResult result)
+{
+	(void)lock;
+
+	if (!cb)
+		return;
+	if (completions.full()) {
+		ESP_LOGW(TAG, "Completion queue full, dropping callback");
+		return;
+	}
+	completions.push_back({std::move(cb), result});
+	if (Task::task.get_id() != std::this_thread::get_id())
+		wake();
+}
+
+void ESPNow::reliable_send(const unique_lock& lock, const PeerAddress& addr, Peer& peer,
+		MessageType type, const void *payload, size_t length, SendCallback&& cb)
+{
+	if (length > MAX_RELIABLE_PAYLOAD_LENGTH)
+		throw std::invalid_argument("esp_now_send: Payload too long for reliable delivery");
+	if (peer.rtx.full()) {
+		peer.tx_stats.dropped++;
+		throw std::runtime_error("esp_now_send: Reliable window full");
+	}
+
+	auto& entry = peer.rtx.push(type, payload, length, std::move(cb));
+	entry.first_sent_us = entry.last_sent_us = esp_timer_get_time();
+	// If the queue is full now, the retransmit timer takes care of it
+	reliable_transmit(lock, addr, peer, entry);
+}
+
+bool ESPNow::reliable_transmit(const unique_lock& lock, const PeerAddress& addr, Peer& peer,
+		const ReliableTx::Entry& entry)
+{
+	if (peer.tx_queue.full())
+		return false;
+
+	std::array<uint8_t, MAX_PAYLOAD_LENGTH> buf;
+	const ReliableHeader hdr = {
+		.epoch = reliable_epoch,
+		.rseq = entry.rseq,
+		.base = peer.rtx.base(),
+		.type = entry.type,
+	};
+	memcpy(buf.data(), &hdr, sizeof(hdr));
+	memcpy(buf.data() + sizeof(hdr), entry.payload.data(), entry.length);
+	enqueue(lock, addr, peer, MessageId::Reliable, buf.data(), sizeof(hdr) + entry.length, nullptr);
+	return true;
+}
+
+milliseconds ESPNow::reliable_service()
+{
+	const auto lock = take_unique_lock();
+	const auto now = esp_timer_get_time();
+	int64_t next = INT64_MAX;
+	for (auto& [addr, peer] : peers) {
+		next = std::min(next, peer.rtx.poll(now,
+				[&](const ReliableTx::Entry& e) {
+					if (!reliable_transmit(lock, addr, peer, e))
+						return false;
+					pump_requested = true;
+					return true;
+				},
+				[&](ReliableTx::Entry& e) {
+					ESP_LOGW(TAG, "send %s: message 0x%02x not acknowledged",
+							::to_string(addr).c_str(), e.type);
+					complete(lock, std::move(e.callback), false);
+				}));
+
+		auto& rrx = peer.rrx;
+		if (!rrx.ack_pending)
+			continue;
+		// Acks ride along with queued traffic in an Aggregate frame if there is any
+		const bool piggyback = tx_aggregates(addr, peer, GROUP_NONE) &&
+			(peer.tx_in_flight < peer.tx_queue.size());
+		if (!piggyback && (now < rrx.ack_deadline_us)) {
+			next = std::min(next, rrx.ack_deadline_us);
+			continue;
+		}
+		if (peer.tx_queue.full()) {
+			next = std::min(next, now + ACK_DELAY_US);
+			continue;
+		}
+		const auto ack = rrx.ack();
+		enqueue(lock, addr, peer, MessageId::Ack, &ack, sizeof(ack), nullptr);
+		rrx.ack_pending = false;
+		rrx.st.acks_sent++;
+		pump_requested = true;
+	}
+
+	if (next == INT64_MAX)
+		return milliseconds::max();
+	return std::chrono::duration_cast<milliseconds>(
+			std::chrono::microseconds(std::max<int64_t>(0, next - now)));
+}
+
+void ESPNow::wake()
+{
+	// Already awake if the lane is full
+	event_lane(Lane::Control).queue.send(Event(), 0);
+}
+
+void ESPNow::set_lane(MessageType type, Lane lane)
+{
+	lanes[type] = lane;
+}
+
+ESPNow::Lane ESPNow::message_lane(MessageType type, const uint8_t *payload, size_t length) const
+{
+	if ((type == MessageId::Reliable) && (length >= sizeof(ReliableHeader)))
+		return lanes[reinterpret_cast<const ReliableHeader *>(payload)->type];
+	return lanes[type];
+}
+
+ESPNow::Lane ESPNow::classify(const uint8_t *frame, size_t length) const
+{
+	MessageType type;
+	const uint8_t *payload;
+	size_t payload_length;
+	if (!peek_header(frame, length, type, payload, payload_length))
+		return Lane::Bulk;
+	if (type != MessageId::Aggregate)
+		return message_lane(type, payload, payload_length);
+
+	// The most urgent message in an aggregate decides for the whole frame
+	auto lane = Lane::Bulk;
+	while (payload_length >= sizeof(AggregateRecord)) {
+		const auto& rec = *reinterpret_cast<const AggregateRecord *>(payload);
+		payload += sizeof(AggregateRecord);
+		payload_length -= sizeof(AggregateRecord);
+		if (rec.length > payload_length)
+			break;
+		lane = std::min(lane, message_lane(rec.type, payload, rec.length));
+		payload += rec.length;
+		payload_length -= rec.length;
+	}
+	return lane;
+}
+
+bool ESPNow::post(Lane lane, Event&& event, TickType_t timeout)
+{
+	auto& l = event_lane(lane);
+	if (!l.queue.send(std::move(event), timeout)) {
+		l.dropped++;
+		return false;
+	}
+	const auto depth = l.queue.size();
+	auto max = l.depth_max.load();
+	while (depth > max && !l.depth_max.compare_exchange_weak(max, depth));
+	return true;
+}
+
+bool ESPNow::next_event(Event& event)
+{
+	// Whichever lane woke the task up, the most urgent one is served first
+	for (auto& lane : event_lanes) {
+		if (lane.queue.receive(event)) {
+			lane.events++;
+			return true;
+		}
+	}
+	return false;
+}
+
+ESPNow::LaneStats ESPNow::lane_stats(Lane lane) const
+{
+	const auto& l = event_lane(lane);
+	return LaneStats {
+		.events = l.events,
+		.dropped = l.dropped,
+		.depth = l.queue.size(),
+		.depth_max = l.depth_max,
+	};
+}
+
+void ESPNow::add_state_channel(std::unique_ptr<StateChannelBase>&& channel)
+{
+	{
+		const auto lock = take_shared_lock();
+		if (peers.find(channel->peer()) == peers.end())
+			throw std::invalid_argument("state_channel: Unknown peer");
+	}
+
+	std::lock_guard<std::mutex> lock(state_channels_lock);
+	for (const auto& ch : state_channels) {
+		if ((ch->peer() == channel->peer()) && (ch->type() == channel->type()))
+			throw std::runtime_error("state_channel: Channel already exists");
+	}
+	state_channels.push_back(std::move(channel));
+	wake();
+}
+
+Stream& ESPNow::stream(const PeerAddress& peer, StreamId id)
+{
+	{
+		const auto lock = take_shared_lock();
+		if (peers.find(peer) == peers.end())
+			throw std::invalid_argument("stream: Unknown peer");
+	}
+
+	std::lock_guard<std::mutex> lock(streams_lock);
+	for (const auto& s : streams) {
+		if ((s->peer() == peer) && (s->id() == id))
+			throw std::runtime_error("stream: Stream already exists");
+	}
+	streams.push_back(std::make_unique<Stream>(*this, peer, id, reliable_epoch));
+	return *streams.back();
+}
+
+Stream *ESPNow::find_stream(const PeerAddress& peer, StreamId id) const
+{
+	std::lock_guard<std::mutex> lock(streams_lock);
+	for (const auto& s : streams) {
+		if ((s->peer() == peer) && (s->id() == id))
+			return s.get();
+	}
+	return nullptr;
+}
+
+size_t ESPNow::tx_queue_room(const PeerAddress& address) const
+{
+	const auto lock = take_shared_lock();
+	const auto& found = peers.find(address);
+	if (found == peers.end())
+		return 0;
+	const auto& queue = found->second.tx_queue;
+	return queue.capacity - queue.size();
+}
+
+milliseconds ESPNow::service_streams()
+{
+	std::lock_guard<std::mutex> lock(streams_lock);
+	const auto now = esp_timer_get_time();
+	auto next = milliseconds::max();
+	for (auto& s : streams) {
+		next = std::min(next, s->service(now));
+	}
+	return next;
+}
+
+void ESPNow::handle_stream_data(const MessageView& msg)
+{
+	if (msg.payload_length() < sizeof(StreamDataHeader))
+		throw std::runtime_error("truncated stream header");
+
+	const auto& header = msg.payload_as<StreamDataHeader>();
+	// Streams are never removed, the pointer stays valid
+	auto *stream = find_stream(msg.peer(), header.stream);
+	if (!stream) {
+		rx_unhandled++;
+		return;
+	}
+	stream->handle_data(header,
+			static_cast<const uint8_t *>(msg.payload()) + sizeof(header),
+			msg.payload_length() - sizeof(header));
+}
+
+void ESPNow::handle_stream_ack(const MessageView& msg)
+{
+	if (msg.payload_length() != sizeof(StreamAckPayload))
+		throw std::runtime_error("bad stream ack length");
+
+	const auto& ack = msg.payload_as<StreamAckPayload>();
+	auto *stream = find_stream(msg.peer(), ack.stream);
+	if (!stream) {
+		rx_unhandled++;
+		return;
+	}
+	stream->handle_ack(ack);
+}
+
+milliseconds ESPNow::service_state_channels()
+{
+	std::lock_guard<std::mutex> lock(state_channels_lock);
+	const auto now = time_now();
+	auto next = milliseconds::max();
+	for (auto& ch : state_channels) {
+		next = std::min(next, ch->service(now));
+	}
+	return next;
+}
+
+void ESPNow::run_completions()
+{
+	while (1) {
+		Completion c;
+		{
+			const auto lock = take_unique_lock();
+			if (completions.empty())
+				return;
+			c = std::move(completions.front());
+			completions.pop_front();
+		}
+		c.callback(c.result);
+	}
+}
+
+std::optional<LinkMetrics::Stats> ESPNow::link_stats(const PeerAddress& address) const
+{
+	const auto lock = take_shared_lock();
+	const auto& found = peers.find(address);
+	if (found == peers.end())
+		return std::nullopt;
+	return found->second.link.stats();
+}
+
+void ESPNow::set_ping_interval(milliseconds interval)
+{
+	const auto lock = take_unique_lock();
+	ping_interval = interval;
+}
+
+void ESPNow::ping_peers()
+{
+	const auto lock = take_unique_lock();
+	if (ping_interval == 0ms)
+		return;
+
+	const auto now = esp_timer_get_time();
+	const auto interval_us = std::chrono::duration_cast<std::chrono::microseconds>(ping_interval).count();
+	const auto acquire_us = std::chrono::duration_cast<std::chrono::microseconds>(CLOCK_ACQUIRE_INTERVAL).count();
+	for (auto& [addr, peer] : peers) {
+		if (addr == PeerBroadcast)
+			continue;
+		// Fill the clock filter of a new or restarted reference quickly
+		const bool acquire = (addr == clock_reference) && peer.clock.acquiring();
+		if (now - peer.last_ping_us < (acquire ? std::min(acquire_us, interval_us) : interval_us))
+			continue;
+
+		peer.last_ping_us = now;
+		const PingPayload ping = {
+			.id = peer.ping_id++,
+			// Stamped again by tx_pump() when the frame goes out
+			.timestamp_us = now,
+		};
+		try {
+			enqueue(lock, addr, peer, MessageId::Ping, &ping, sizeof(ping), nullptr);
+			peer.link.ping_sent();
+			pump_requested = true;
+		}
+		catch (const std::exception& e) {
+			ESP_LOGD(TAG, "ping %s: %s", ::to_string(addr).c_str(), e.what());
+		}
+	}
+}
+
+void ESPNow::handle_ping(const MessageView& msg)
+{
+	const auto rx_us = esp_timer_get_time();
+	if (msg.payload_length() != sizeof(PingPayload))
+		return;
+
+	const auto lock = take_unique_lock();
+	const auto& found = peers.find(msg.peer());
+	if (found == peers.end()) {
+		ESP_LOGD(TAG, "ping from unknown peer %s", ::to_string(msg.peer()).c_str());
+		return;
+	}
+	const PongPayload pong = {
+		.ping = msg.payload_as<PingPayload>(),
+		.rx_us = rx_us,
+		// Stamped again by tx_pump() when the frame goes out
+		.tx_us = rx_us,
+	};
+	enqueue(lock, found->first, found->second,
+			MessageId::Pong, &pong, sizeof(pong), nullptr);
+	pump_requested = true;
+}
+
+void ESPNow::handle_pong(const MessageView& msg)
+{
+	const auto now = esp_timer_get_time();
+	if (msg.payload_length() < sizeof(PingPayload))
+		return;
+
+	const auto& pong = msg.payload_as<PingPayload>();
+	const auto rtt = now - pong.timestamp_us;
+	const auto lock = take_unique_lock();
+	const auto& found = peers.find(msg.peer());
+	if ((found == peers.end()) || (rtt < 0))
+		return;
+	auto& peer = found->second;
+	peer.link.pong(rtt);
+	// Gives retransmit timer a sensible RTO before the first reliable message
+	peer.rtx.rtt_sample(rtt);
+	// Older firmware doesn't timestamp its side
+	if (msg.payload_length() >= sizeof(PongPayload)) {
+		const auto& p = msg.payload_as<PongPayload>();
+		peer.clock.sample(p.ping.timestamp_us, p.rx_us, p.tx_us, now);
+	}
+}
+
+void ESPNow::set_clock_reference(std::optional<PeerAddress> peer)
+{
+	const auto lock = take_unique_lock();
+	clock_reference = peer;
+}
+
+const ClockSync *ESPNow::reference_clock(const shared_lock&) const
+{
+	if (!clock_reference)
+		return nullptr;
+	const auto& found = peers.find(*clock_reference);
+	if (found == peers.end())
+		return nullptr;
+	return &found->second.clock;
+}
+
+int64_t ESPNow::sync_now() const
+{
+	return to_sync_time(esp_timer_get_time());
+}
+
+int64_t ESPNow::to_sync_time(int64_t local_us) const
+{
+	const auto lock = take_shared_lock();
+	const auto clock = reference_clock(lock);
+	return clock ? clock->to_peer(local_us) : local_us;
+}
+
+int64_t ESPNow::to_local_time(int64_t sync_us) const
+{
+	const auto lock = take_shared_lock();
+	const auto clock = reference_clock(lock);
+	return clock ? clock->to_local(sync_us) : sync_us;
+}
+
+bool ESPNow::clock_synced() const
+{
+	const auto lock = take_shared_lock();
+	if (!clock_reference)
+		return true;
+	const auto clock = reference_clock(lock);
+	return clock && clock->synced();
+}
+
+std::optional<ClockSync::Stats> ESPNow::clock_stats(const PeerAddress& address) const
+{
+	const auto lock = take_shared_lock();
+	const auto& found = peers.find(address);
+	if (found == peers.end())
+		return std::nullopt;
+	return found->second.clock.stats();
+}
+
+void ESPNow::handle_aggregate(const MessageView& msg)
+{
+	const auto *data = static_cast<const uint8_t *>(msg.payload());
+	size_t left = msg.payload_length();
+	while (left) {
+		if (left < sizeof(AggregateRecord))
+			throw std::runtime_error("truncated aggregate record");
+		const auto& rec = *reinterpret_cast<const AggregateRecord *>(data);
+		data += sizeof(AggregateRecord);
+		left -= sizeof(AggregateRecord);
+		if (rec.length > left)
+			throw std::runtime_error("bad aggregate record length");
+		if (rec.type == MessageId::Aggregate)
+			throw std::runtime_error("nested aggregate");
+
+		try {
+			deliver(MessageView(msg, rec.type, data, rec.length));
+		}
+		catch (const std::exception& e) {
+			ESP_LOGE(TAG, "recv: %s", e.what());
+		}
+		data += rec.length;
+		left -= rec.length;
+	}
+}
+
+void ESPNow::handle_announce(const MessageView& msg)
+{
+	// Announce from v1 firmware has no payload, older v2 one has no groups
+	AnnouncePayload announce = {};
+	announce.version = WIRE_VERSION_1;
+	memcpy(&announce, msg.payload(), std::min(msg.payload_length(), sizeof(announce)));
+	const auto peer_groups = groups_from_bitmap(announce.groups);
+	bool learn;
+	{
+		const auto lock = take_shared_lock();
+		learn = learn_peers && (peers.find(msg.peer()) == peers.end());
+	}
+	if (learn)
+		learn_peer(msg.peer());
+	{
+		const auto lock = take_unique_lock();
+		const auto& found = peers.find(msg.peer());
+		if (found == peers.end())
+			foreign_groups |= peer_groups;
+		if ((found != peers.end()) && !(found->first == PeerBroadcast)) {
+			auto& peer = found->second;
+			if (peer.groups != peer_groups) {
+				peer.groups = peer_groups;
+				peers_changed(lock);
+			}
+			const auto version = std::min(announce.version, WIRE_VERSION_MAX);
+			if (version != peer.wire_version) {
+				ESP_LOGI(TAG, "peer %s: wire version %u",
+						::to_string(msg.peer()).c_str(), version);
+				peer.wire_version = version;
+				peers_changed(lock);
+			}
+		}
+	}
+	dispatch(MessageView(msg, MessageId::Announce,
+				reinterpret_cast<const uint8_t *>(&announce), sizeof(announce)));
+}
+
+void ESPNow::handle_reliable(const MessageView& msg)
+{
+	if (msg.payload_length() < sizeof(ReliableHeader))
+		throw std::runtime_error("truncated reliable header");
+
+	const auto& hdr = msg.payload_as<ReliableHeader>();
+	ReliableRx::Result result;
+	{
+		const auto lock = take_unique_lock();
+		const auto& found = peers.find(msg.peer());
+		if ((found == peers.end()) || (found->first == PeerBroadcast)) {
+			ESP_LOGW(TAG, "reliable message from unknown peer %s", ::to_string(msg.peer()).c_str());
+			return;
+		}
+		auto& rrx = found->second.rrx;
+		result = rrx.receive(hdr.epoch, hdr.rseq, hdr.base);
+		// Duplicates are acknowledged too, the previous ack may have been lost
+		if (!rrx.ack_pending) {
+			rrx.ack_pending = true;
+			rrx.ack_deadline_us = esp_timer_get_time() + ACK_DELAY_US;
+		}
+	}
+	if (result != ReliableRx::Result::Deliver)
+		return;
+
+	switch (hdr.type) {
+		case MessageId::Aggregate:
+		case MessageId::Ack:
+		case MessageId::Reliable:
+			throw std::runtime_error("bad reliable message type");
+	}
+	const auto *data = static_cast<const uint8_t *>(msg.payload()) + sizeof(ReliableHeader);
+	deliver(MessageView(msg, hdr.type, data, msg.payload_length() - sizeof(ReliableHeader)));
+}
+
+void ESPNow::handle_ack(const MessageView& msg)
+{
+	if (msg.payload_length() != sizeof(AckPayload))
+		throw std::runtime_error("bad ack length");
+
+	const auto& ack = msg.payload_as<AckPayload>();
+	// Acknowledges messages sent before this boot
+	if (ack.epoch != reliable_epoch)
+		return;
+
+	const auto lock = take_unique_lock();
+	const auto& found = peers.find(msg.peer());
+	if (found == peers.end())
+		return;
+	found->second.rtx.ack(ack.base, ack.bitmap, esp_timer_get_time(),
+			[&](ReliableTx::Entry& e) {
+				complete(lock, std::move(e.callback), true);
+			});
+}
+
+bool ESPNow::rx_account(const MessageView& msg, int8_t rssi)
+{
+	const auto& hdr = msg.header();
+	const auto lock = take_unique_lock();
+	const auto& found = peers.find(msg.peer());
+	if (found != peers.end()) {
+		auto& peer = found->second;
+		peer.link.rx(hdr.seq, msg.version());
+		// Anyone sending v2 understands it
+		if (msg.version() > peer.wire_version) {
+			peer.wire_version = msg.version();
+			peers_changed(lock);
+		}
+		if (!link_up.first_rx_us && !(found->first == PeerBroadcast))
+			link_up.first_rx_us = esp_timer_get_time();
+		peer.rate.rssi(rssi);
+		peer.last_rx_seq = hdr.seq;
+		peer.last_rx_time = time_now();
+	}
+	if ((msg.group() != GROUP_NONE) && !groups[msg.group()]) {
+		rx_filtered++;
+		return false;
+	}
+	if (led)
+		led->blink_once(20);
+	return true;
+}
+
+void ESPNow::deliver(const MessageView& msg)
+{
+	switch (msg.header().type) {
+		case MessageId::Ping:
+			handle_ping(msg);
+			break;
+		case MessageId::Pong:
+			handle_pong(msg);
+			break;
+		case MessageId::Aggregate:
+			handle_aggregate(msg);
+			break;
+		case MessageId::Announce:
+			handle_announce(msg);
+			break;
+		case MessageId::Reliable:
+			handle_reliable(msg);
+			break;
+		case MessageId::Ack:
+			handle_ack(msg);
+			break;
+		case MessageId::StreamData:
+			handle_stream_data(msg);
+			break;
+		case MessageId::StreamAck:
+			handle_stream_ack(msg);
+			break;
+		default:
+			dispatch(msg);
+			break;
+	}
+}
+
+std::optional<ESPNow::TxStats> ESPNow::tx_stats(const PeerAddress& address) const
+{
+	const auto lock = take_shared_lock();
+	const auto& found = peers.find(address);
+	if (found == peers.end())
+		return std::nullopt;
+	return found->second.tx_stats;
+}
+
+void ESPNow::set_handler(MessageType type, Handler&& handler)
+{
+	std::unique_lock<std::shared_mutex> lock(handlers_lock);
 	handlers[type] = std::move(handler);
 }
 
+void ESPNow::dispatch(const MessageView& msg)
+{
+	std::shared_lock<std::shared_mutex> lock(handlers_lock);
+	const auto& hdr = msg.header();
+	auto& handler = handlers[hdr.type];
+	if (!handler.thunk) {
+		rx_unhandled++;
+		ESP_LOGW(TAG, "No handler for message: %s", msg.to_string().c_str());
+		return;
+	}
+	if ((hdr.length < handler.min_length) || (hdr.length > handler.max_length)) {
+		rx_bad_length++;
+		ESP_LOGW(TAG, "Bad payload length for message: %s", msg.to_string().c_str());
+		return;
+	}
+
+	handler.thunk(*handler.ctx, msg);
+	if (!control_seen && (lanes[hdr.type] == Lane::Control))
+		note_first_control(msg);
+}
+
+FramePool::Stats ESPNow::frame_pool_stats() const
+{
+	return frames.stats();
+}
+
+void ESPNow::print_stats() const
+{
+	const auto pool = frame_pool_stats();
+	std::cout << "\nRX frame pool:" <<
+		"\n  capacity   : " << pool.capacity <<
+		"\n  in use     : " << pool.in_use <<
+		"\n  high water : " << pool.high_water <<
+		"\n  taken      : " << pool.taken <<
+		"\n  exhausted  : " << pool.exhausted <<
+		"\n  oversized  : " << pool.oversized <<
+		"\nRX dispatch:" <<
+		"\n  invalid    : " << rx_invalid <<
+		"\n  unhandled  : " << rx_unhandled <<
+		"\n  bad length : " << rx_bad_length <<
+		"\n  filtered   : " << rx_filtered;
+	const auto up = link_up_stats();
+	std::cout << "\nLink-up:" <<
+		"\n  init       : " << up.init_us / 1000 << " ms" <<
+		"\n  restored   : " << up.restored_peers << " peers" <<
+		"\n  first rx   : " << up.first_rx_us / 1000 << " ms" <<
+		"\n  first ctl  : " << up.first_control_us / 1000 << " ms";
+	if (up.first_control_us)
+		std::cout << " (0x" << std::hex << static_cast<unsigned>(up.first_control_type) << std::dec <<
+			" from " << up.first_control_peer << ")";
+	std::cout << "\nTask:" <<
+		"\n  stack free : " << stack_free_min << " of " << TASK_STACK_SIZE << " bytes";
+	static const char *lane_names[LANE_COUNT] = {"control    ", "bulk       "};
+	std::cout << "\nEvent lanes:";
+	for (size_t i = 0; i < LANE_COUNT; i++) {
+		const auto st = lane_stats(static_cast<Lane>(i));
+		std::cout << "\n  " << lane_names[i] << ": events " << st.events << ", dropped " << st.dropped <<
+			", depth " << st.depth << " (max " << st.depth_max << ")";
+	}
+	std::cout << "\n" << std::endl;
+}
+
+void ESPNow::print_peers() const
+{
+	const auto lock = take_shared_lock();
+	for (const auto& [addr, peer] : peers) {
+		const auto& tx = peer.tx_stats;
+		const auto link = peer.link.stats();
+		const auto clock = peer.clock.stats();
+		const auto& rtx = peer.rtx.stats();
+		const auto& rrx = peer.rrx.st;
+		std::cout << "\nPeer " << addr << ":" <<
+			"\n  tx window   : " << peer.tx_window << ", in flight " << peer.tx_in_flight <<
+			"\n  tx depth    : " << tx.depth << " (max " << tx.depth_max << ")" <<
+			"\n  tx queued   : " << tx.queued << ", sent " << tx.sent <<
+				" frames, aggregated " << tx.aggregated <<
+			"\n  tx ok       : " << tx.ok << ", failed " << tx.failed <<
+				", timeouts " << tx.timeouts << " (" << tx.late_callbacks << " reported late)" <<
+				", dropped " << tx.dropped <<
+			"\n  tx latency  : " << tx.latency_last_us << " us (avg " << tx.latency_avg_us <<
+				", max " << tx.latency_max_us << ")" <<
+			"\n  queue wait  : max " << tx.queue_wait_max_us << " us" <<
+			"\n  rx frames   : " << link.rx_frames << ", lost " << link.rx_lost <<
+				", late " << link.rx_late << ", resets " << link.rx_resets <<
+			"\n  ping        : " << link.pongs_received << "/" << link.pings_sent <<
+			"\n  rtt         : " << link.rtt_last_us << " us (min " << link.rtt_min_us <<
+				", p50 " << link.rtt_p50_us << ", p99 " << link.rtt_p99_us <<
+				", max " << link.rtt_max_us << ")" <<
+			"\n  jitter      : " << link.jitter_us << " us" <<
+			"\n  clock       : " << (clock.synced ? "" : "not synced, ") <<
+				"offset " << clock.offset_us << " us, drift " << clock.drift_ppb << " ppb" <<
+				", delay " << clock.delay_last_us << " us (min " << clock.delay_min_us << ")" <<
+				", samples " << clock.trusted << "/" << clock.samples << ", steps " << clock.steps <<
+				((clock_reference == addr) ? ", reference" : "") <<
+			"\n  reliable tx : " << rtx.sent << ", retransmits " << rtx.retransmits <<
+				", acked " << rtx.acked << ", gave up " << rtx.gave_up <<
+				", unacked " << peer.rtx.size() <<
+			"\n  reliable rto: " << peer.rtx.rto_us() << " us (srtt " << peer.rtx.srtt_us() << ")" <<
+			"\n  reliable rx : " << rrx.delivered << ", duplicates " << rrx.duplicates <<
+				", out of window " << rrx.out_of_window << ", skipped " << rrx.skipped <<
+				", acks " << rrx.acks_sent <<
+			"\n  wire version: " << static_cast<unsigned>(std::min(peer.wire_version, peer.max_wire_version)) <<
+			"\n  rate        : " << (peer.rate_control ? RateControl::RATES[peer.rate.current()].name : "fixed") <<
+				", rssi " << static_cast<int>(peer.rate.last_rssi()) << " dBm" <<
+			"\n  last rx seq : " << peer.last_rx_seq <<
+			"\n  last tx seq : " << peer.last_tx_seq <<
+			"\n";
+	}
+	std::cout << std::endl;
+}
+
+void ESPNow::print_state_channels() const
+{
+	std::lock_guard<std::mutex> lock(state_channels_lock);
+	for (const auto& ch : state_channels) {
+		std::cout << ch->to_string() << "\n";
+	}
+	std::cout << std::endl;
+}
+
+void ESPNow::print_streams() const
+{
+	std::lock_guard<std::mutex> lock(streams_lock);
+	for (const auto& s : streams) {
+		std::cout << s->to_string() << "\n";
+	}
+	std::cout << std::endl;
+}
+
+void ESPNow::print_clock() const
+{
+	const auto local = esp_timer_get_time();
+	const auto sync = to_sync_time(local);
+	const auto lock = take_shared_lock();
+	std::cout << "\nClock reference: " << (clock_reference ? ::to_string(*clock_reference) : "self");
+	const auto clock = reference_clock(lock);
+	if (clock) {
+		const auto st = clock->stats();
+		std::cout << (st.synced ? "" : " (not synced)") <<
+			"\n  offset : " << st.offset_us << " us" <<
+			"\n  drift  : " << st.drift_ppb << " ppb" <<
+			"\n  delay  : " << st.delay_last_us << " us (min " << st.delay_min_us << ")";
+	}
+	std::cout <<
+		"\n  local  : " << local << " us" <<
+		"\n  sync   : " << sync << " us" <<
+		"\n" << std::endl;
+}
+
 ESPNow::Peer::Peer() :
-	send_result()
+	tx_window(DEFAULT_TX_WINDOW),
+	learned(false),
+	aggregate(true),
+	rate_control(true),
+	rate(),
+	wire_version(WIRE_VERSION_1),
+	max_wire_version(WIRE_VERSION_MAX),
+	groups(),
+	channel(0),
+	tx_queue(),
+	tx_in_flight(0),
+	tx_frames_in_flight(0),
+	tx_frames_expired(0),
+	tx_expired_us(0),
+	tx_stats(),
+	tx_seq(0),
+	rtx(),
+	rrx(),
+	link(),
+	clock(),
+	ping_id(0),
+	last_ping_us(0),
+	last_rx_seq(0),
+	last_rx_time(),
+	last_tx_seq(0),
+	last_tx_time()
 {}
 
 void ESPNow::run()
 {
+	static constexpr auto EXPIRE_CHECK_INTERVAL_US =
+		std::chrono::duration_cast<std::chrono::microseconds>(TX_TIMEOUT).count() / 4;
+	static constexpr auto MAX_WAIT = std::chrono::duration_cast<milliseconds>(TX_TIMEOUT) / 4;
+
+	auto wait = MAX_WAIT;
 	while (1) {
-		auto ret = events.receive(MAX_DELAY);
-		if (!ret)
-			continue;
+		const TickType_t wait_ticks = std::max<TickType_t>(1, wait.count() / portTICK_PERIOD_MS);
+		Event evt;
+		if (event_set.wait(wait_ticks) && next_event(evt)) {
+			switch (evt.id) {
+				case EventID::None:
+					break;
 
-		Event& evt = *ret;
+				case EventID::Send:
+					handle_send_cb(evt.info.send);
+					break;
 
-		switch (evt.id) {
-			case EventID::None:
-				break;
+				case EventID::Recv:
+					handle_recv_cb(evt.info.recv);
+					break;
+			}
+		}
 
-			case EventID::Send:
-				handle_send_cb(evt.info.send);
-				break;
+		const auto now = esp_timer_get_time();
+		if (now - last_expire_check_us > EXPIRE_CHECK_INTERVAL_US) {
+			last_expire_check_us = now;
+			stack_free_min = uxTaskGetStackHighWaterMark(nullptr);
+			const auto lock = take_unique_lock();
+			tx_expire(lock);
+		}
 
-			case EventID::Recv:
-				handle_recv_cb(evt.info.recv);
-				break;
+		ping_peers();
+		run_completions();
+		service_peer_store(now);
+		wait = std::min({MAX_WAIT, service_state_channels(), service_streams(),
+				reliable_service(), service_announce(now)});
+		if (pump_requested.exchange(false)) {
+			const auto lock = take_unique_lock();
+			tx_pump_all(lock);
 		}
 	}
 }
@@ -245,35 +1795,45 @@ void ESPNow::handle_send_cb(ESPNow::EventSend& ev)
 		ESP_LOGW(TAG, "send cb event for unknown peer %s", ::to_string(ev.peer).c_str());
 		return;
 	}
-	auto& peer = found->second;
+	auto& [addr, peer] = *found;
 	ESP_LOGD(TAG, "send %s: status %d",
 			to_string(ev.peer).c_str(),
 			ev.status);
 	peer.last_tx_time = time_now();
-	if (peer.send_result) {
-		peer.send_result->promise.set_value(ev.status == ESP_NOW_SEND_SUCCESS);
-		peer.send_result.reset();
+	// Callbacks come in send order, one for a frame that timed out must not
+	// be credited to the frame after it
+	if (peer.tx_frames_expired) {
+		peer.tx_frames_expired--;
+		peer.tx_stats.late_callbacks++;
+		ESP_LOGD(TAG, "send %s: late status for a timed out frame", ::to_string(ev.peer).c_str());
+		return;
+	}
+	if (!peer.tx_frames_in_flight) {
+		ESP_LOGW(TAG, "send cb event for %s with nothing in flight", ::to_string(ev.peer).c_str());
+		return;
 	}
+	tx_complete(lock, peer, ev.status == ESP_NOW_SEND_SUCCESS);
+	tx_pump(lock, addr, peer);
 }
 
 void ESPNow::handle_recv_cb(ESPNow::EventRecv& ev)
 {
-	const auto lock = take_shared_lock();
-	if (led)
-		led->blink_once(20);
+	const FramePool::Lease frame(frames, ev.frame);
+	std::optional<MessageView> view;
 	try {
-		auto msg = Message(ev.peer, ev.data, ev.data_len);
-		ev.release();
+		view.emplace(frame->peer, frame->data, frame->len);
+	}
+	catch (const std::exception& e) {
+		rx_invalid++;
+		ESP_LOGE(TAG, "recv %s: %s", ::to_string(frame->peer).c_str(), e.what());
+		return;
+	}
+
+	try {
+		const auto& msg = *view;
 		ESP_LOGD(TAG, "recv: %s", msg.to_string().c_str());
-	
-		const auto hdr = msg.header();
-		const auto& handler = handlers.find(hdr.type);
-		if (handler == handlers.end()) {
-			ESP_LOGW(TAG, "No handler for message: %s", msg.to_string().c_str());
-			return;
-		}
-	
-		handler->second(msg);
+		if (rx_account(msg, frame->rssi))
+			deliver(msg);
 	}
 	catch (const std::exception& e) {
 		ESP_LOGE(TAG, "recv: %s", e.what());
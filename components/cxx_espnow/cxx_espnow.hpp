@@ -5,29 +5,43 @@
 #include "util_time.hpp"
 #include "util_queue.hpp"
 #include "util_misc.hpp"
+#include "util_ring.hpp"
 #include "wifi.h"
 
 #include "core_status_led.hpp"
+#include "cxx_espnow_frame_pool.hpp"
+#include "cxx_espnow_clock.hpp"
+#include "cxx_espnow_link.hpp"
 #include "cxx_espnow_message.hpp"
 #include "cxx_espnow_peer.hpp"
+#include "cxx_espnow_peer_store.hpp"
+#include "cxx_espnow_rate.hpp"
+#include "cxx_espnow_reliable.hpp"
+#include "cxx_espnow_state_channel.hpp"
+#include "cxx_espnow_state_history.hpp"
+#include "cxx_espnow_stream.hpp"
 
 #include "driver/gpio.h"
 #include "esp_now.h"
 #include "esp_wifi.h"
 
+#include <atomic>
+#include <bitset>
 #include <chrono>
-#include <future>
 #include <functional>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <ostream>
+#include <shared_mutex>
 #include <string>
+#include <type_traits>
 #include <unordered_map>
+#include <vector>
 
 namespace esp_now {
 
-using SendResult = bool;
-
 class ESPNow :
 	private Task,
 	private Lockable<std::shared_mutex>
@@ -41,26 +55,383 @@ public:
 	void add_peer(
 			const PeerAddress& address,
 			const std::optional<PeerKey>& key = std::nullopt,
-			uint8_t channel = 0
+			uint8_t channel = 0,
+			size_t tx_window = DEFAULT_TX_WINDOW
 			);
-	std::shared_future<SendResult> send(const MessageInterface& msg);
+	void set_tx_window(const PeerAddress& address, size_t tx_window);
+
+	/**
+	 * Allow packing several queued messages for `address` into one Aggregate
+	 * frame. Enabled by default, it takes effect once the peer is known to
+	 * speak wire version 2, v1 firmware drops Aggregate frames. The receiver
+	 * unpacks them before dispatch.
+	 */
+	void set_aggregation(const PeerAddress& address, bool enable);
+
+	/**
+	 * Adapt PHY rate for unicast frames to `address` based on delivery
+	 * statistics and RSSI. Enabled by default, otherwise 1 Mbps is used.
+	 */
+	void set_rate_control(const PeerAddress& address, bool enable);
+
+	/**
+	 * Limit wire format version used towards `address`. Unicast peers get the
+	 * highest version both sides support, as learned from their Announce or
+	 * frames. Broadcast defaults to v1, so that peers running older firmware
+	 * can still decode it.
+	 */
+	void set_max_wire_version(const PeerAddress& address, uint8_t version);
+
+	/**
+	 * Deliver unicast messages of `type` reliably: they are retransmitted until
+	 * the receiver acknowledges them, and the send callback reports the
+	 * acknowledgement rather than the radio-level result. Receivers suppress
+	 * duplicates, but don't reorder. Both sides must run firmware that knows
+	 * the reliable class, broadcast messages are always sent unreliably.
+	 */
+	void set_reliable(MessageType type, bool enable = true);
+
+	template <typename MessageT>
+	void set_reliable(bool enable = true)
+	{
+		set_reliable(MessageT::type, enable);
+	}
+
+	/** Event lanes, drained by the ESP-NOW task in strict priority order */
+	enum class Lane : uint8_t {
+		Control,
+		Bulk,
+	};
+	static constexpr size_t LANE_COUNT = 2;
+
+	/**
+	 * Handle received messages of `type` in `lane`, by default Bulk. Reliable
+	 * and Aggregate frames go by the messages they carry. Send completions
+	 * always use the Control lane.
+	 */
+	void set_lane(MessageType type, Lane lane);
+
+	template <typename MessageT>
+	void set_lane(Lane lane)
+	{
+		set_lane(MessageT::type, lane);
+	}
+
+	struct LaneStats {
+		uint32_t events = 0;
+		uint32_t dropped = 0;
+		size_t depth = 0;
+		size_t depth_max = 0;
+	};
+	LaneStats lane_stats(Lane lane) const;
+
+	/** Broadcast Announce advertising supported wire format version */
+	void announce();
+
+	/**
+	 * Period of Announces sent by the ESP-NOW task, 0 disables them. A short
+	 * burst goes out right after start, so peers notice a rebooted node
+	 * without waiting for the period.
+	 */
+	void set_announce_interval(milliseconds interval);
+
+	/**
+	 * Register nodes that announce themselves but aren't in the peer table
+	 * yet. Off by default, peers are normally added by the application.
+	 * At most MAX_LEARNED_PEERS are kept, the one silent the longest makes
+	 * room for a new one, so strangers can't crowd out the driver's table.
+	 */
+	void set_learn_peers(bool enable);
 
-	using MessageHandler = std::function<void(const Message&)>;
-	void on_recv(MessageType type, MessageHandler&& handler);
+	/**
+	 * Queue message for transmission, never blocks on the radio.
+	 *
+	 * `cb` is called from the ESP-NOW task (without the transport lock held)
+	 * once the send callback for the frame arrives. Throws if the peer's
+	 * transmit queue is full.
+	 */
+	void send(const MessageInterface& msg, SendCallback&& cb = nullptr);
+	void send(const MessageBuilder& msg, SendCallback&& cb = nullptr);
+	void send(const PeerAddress& peer, MessageType type, const void *payload, size_t length,
+			SendCallback&& cb = nullptr);
+
+	/**
+	 * Group membership of this node. Frames addressed to a group are dropped
+	 * by receivers that aren't members. Membership is advertised in Announce.
+	 */
+	void join_group(GroupId group);
+	void leave_group(GroupId group);
+	bool in_group(GroupId group) const;
+
+	/**
+	 * Send to every member of `group` with a single frame. It is unicast if
+	 * the only member heard of is a registered peer that speaks wire v2.
+	 * Otherwise it is broadcast, which needs the broadcast peer. Group frames
+	 * always use wire v2 and are never reliable.
+	 */
+	void send_group(GroupId group, MessageType type, const void *payload, size_t length,
+			SendCallback&& cb = nullptr);
+	void send_group(GroupId group, const MessageBuilder& msg, SendCallback&& cb = nullptr);
+
+	/**
+	 * Create latest-value channel for `MessageT` to `peer`, serviced by the
+	 * ESP-NOW task. The channel lives as long as the transport.
+	 */
+	template <typename MessageT>
+	StateChannel<MessageT>& state_channel(const PeerAddress& peer,
+			milliseconds min_interval, milliseconds heartbeat)
+	{
+		auto channel = std::make_unique<StateChannel<MessageT>>(*this, peer,
+				min_interval, heartbeat);
+		auto& ref = *channel;
+		add_state_channel(std::move(channel));
+		return ref;
+	}
+
+	/**
+	 * Like `state_channel()`, but every frame also carries the states sent
+	 * before it, see `StateHistoryChannel`.
+	 */
+	template <typename MessageT>
+	StateHistoryChannel<MessageT>& state_history_channel(const PeerAddress& peer,
+			milliseconds min_interval, milliseconds heartbeat)
+	{
+		auto channel = std::make_unique<StateHistoryChannel<MessageT>>(*this, peer,
+				min_interval, heartbeat);
+		auto& ref = *channel;
+		add_state_channel(std::move(channel));
+		return ref;
+	}
+
+	/**
+	 * Open byte stream `id` to `peer`. The peer opens the same id towards
+	 * this node to talk back. The stream lives as long as the transport.
+	 */
+	Stream& stream(const PeerAddress& peer, StreamId id);
+
+	/**
+	 * Register handler for `MessageT`, called as `fn(const Payload&, const MessageView&)`,
+	 * or `fn(const MessageView&)` for messages without payload.
+	 *
+	 * The payload reference points into the receive buffer. Frames with payload
+	 * length other than `sizeof(Payload)` are dropped before reaching the handler.
+	 */
+	template <typename MessageT, typename Fn>
+	void on_recv(Fn&& fn)
+	{
+		using Payload = typename MessageT::payload_type;
+		using Context = HandlerFn<std::decay_t<Fn>>;
+
+		Handler h;
+		h.ctx = std::make_unique<Context>(std::forward<Fn>(fn));
+		if constexpr (std::is_void_v<Payload>) {
+			h.min_length = h.max_length = 0;
+			h.thunk = [](HandlerContext& ctx, const MessageView& msg) {
+				static_cast<Context&>(ctx).fn(msg);
+			};
+		}
+		else {
+			static_assert(sizeof(Payload) <= MAX_PAYLOAD_LENGTH, "Payload too long");
+			h.min_length = h.max_length = sizeof(Payload);
+			h.thunk = [](HandlerContext& ctx, const MessageView& msg) {
+				static_cast<Context&>(ctx).fn(msg.payload_as<Payload>(), msg);
+			};
+		}
+		set_handler(MessageT::type, std::move(h));
+	}
+
+	/** Register handler for variable length messages of `type`, called as `fn(const MessageView&)` */
+	template <typename Fn>
+	void on_recv(MessageType type, Fn&& fn)
+	{
+		using Context = HandlerFn<std::decay_t<Fn>>;
+
+		Handler h;
+		h.ctx = std::make_unique<Context>(std::forward<Fn>(fn));
+		h.min_length = 0;
+		h.max_length = MAX_PAYLOAD_LENGTH;
+		h.thunk = [](HandlerContext& ctx, const MessageView& msg) {
+			static_cast<Context&>(ctx).fn(msg);
+		};
+		set_handler(type, std::move(h));
+	}
+
+	struct TxStats {
+		uint32_t queued = 0;
+		uint32_t sent = 0;
+		uint32_t aggregated = 0;
+		uint32_t ok = 0;
+		uint32_t failed = 0;
+		uint32_t dropped = 0;
+		uint32_t timeouts = 0;
+		/** Send callbacks for frames that had timed out already, discarded */
+		uint32_t late_callbacks = 0;
+		size_t depth = 0;
+		size_t depth_max = 0;
+		uint32_t latency_last_us = 0;
+		uint32_t latency_avg_us = 0;
+		uint32_t latency_max_us = 0;
+		uint32_t queue_wait_max_us = 0;
+	};
+	std::optional<TxStats> tx_stats(const PeerAddress& address) const;
+	std::optional<LinkMetrics::Stats> link_stats(const PeerAddress& address) const;
+
+	/** Period of Ping probes sent to unicast peers, 0 disables probing */
+	void set_ping_interval(milliseconds interval);
+
+	/**
+	 * Follow `peer`'s clock as the time base shared across nodes. Without a
+	 * reference this node's own clock is the shared time base, so nodes
+	 * following it can synchronise to it.
+	 */
+	void set_clock_reference(std::optional<PeerAddress> peer);
+	/**
+	 * Current time in the shared time base, microseconds on the reference
+	 * node's esp_timer. Local time until the first exchange with the
+	 * reference completes.
+	 */
+	int64_t sync_now() const;
+	/** Convert local esp_timer time to the shared time base */
+	int64_t to_sync_time(int64_t local_us) const;
+	/** Convert shared time base to local esp_timer time, e.g. to schedule an action */
+	int64_t to_local_time(int64_t sync_us) const;
+	/** Shared time base is available, always true on the reference */
+	bool clock_synced() const;
+	std::optional<ClockSync::Stats> clock_stats(const PeerAddress& address) const;
+
+	/** Boot to link-up milestones, times since boot, 0 until reached */
+	struct LinkUpStats {
+		int64_t init_us = 0;
+		int64_t first_rx_us = 0;
+		/** First message from a peer dispatched on the Control lane */
+		int64_t first_control_us = 0;
+		PeerAddress first_control_peer;
+		MessageType first_control_type = 0;
+		size_t restored_peers = 0;
+	};
+	LinkUpStats link_up_stats() const;
+
+	FramePool::Stats frame_pool_stats() const;
+	void print_stats() const;
+	void print_peers() const;
+	void print_state_channels() const;
+	void print_streams() const;
+	void print_clock() const;
+
+	static constexpr size_t DEFAULT_TX_WINDOW = 2;
+	static constexpr size_t TX_QUEUE_SIZE = 8;
+	static constexpr auto DEFAULT_PING_INTERVAL = 1s;
+	/** Ping period to the clock reference until its clock filter has filled */
+	static constexpr auto CLOCK_ACQUIRE_INTERVAL = 100ms;
+	static constexpr auto DEFAULT_ANNOUNCE_INTERVAL = 1s;
 
 private:
+	using unique_lock = Lockable::unique_lock;
+	using shared_lock = Lockable::shared_lock;
+	/**
+	 * Message handlers, reliable sends and completions all run on the
+	 * ESP-NOW task, some of them parse and build JSON
+	 */
+	static constexpr int TASK_STACK_SIZE = 8*1024;
+	static constexpr auto TX_TIMEOUT = 1s;
+	static constexpr size_t LANE_QUEUE_SIZE = FramePool::SIZE;
+	/** Receive frame slots that only Control lane frames may take */
+	static constexpr size_t CONTROL_RESERVED_FRAMES = 4;
+	/** How long an acknowledgement waits for outgoing traffic to ride on */
+	static constexpr int64_t ACK_DELAY_US = 10000;
+	/** Announce times after start, before the regular period takes over */
+	static constexpr uint16_t ANNOUNCE_BURST_MS[] = {0, 20, 50, 100, 200, 400};
+	/** Peer table changes are written to NVS after settling this long */
+	static constexpr int64_t PEER_STORE_DELAY_US = 2000000;
+	/**
+	 * Learned peers kept at once. The driver's table holds 20, this leaves
+	 * room for the broadcast peer and the ones the application adds.
+	 */
+	static constexpr size_t MAX_LEARNED_PEERS = 8;
+	/** A learned peer is only evicted after being silent this long */
+	static constexpr auto LEARNED_PEER_IDLE = 30s;
+
 	std::shared_ptr<Core::StatusLed> led;
 	wifi_interface_t iface;
-	std::unordered_map<MessageType, MessageHandler> handlers;
+
+	struct HandlerContext {
+		virtual ~HandlerContext() = default;
+	};
+
+	template <typename Fn>
+	struct HandlerFn : HandlerContext {
+		HandlerFn(Fn&& _fn) : fn(std::move(_fn)) {}
+		HandlerFn(const Fn& _fn) : fn(_fn) {}
+		Fn fn;
+	};
+
+	struct Handler {
+		using Thunk = void (*)(HandlerContext& ctx, const MessageView& msg);
+
+		Thunk thunk = nullptr;
+		std::unique_ptr<HandlerContext> ctx;
+		uint8_t min_length = 0;
+		uint8_t max_length = 0;
+	};
+
+	/** Separate from the transport lock so handlers can send */
+	mutable std::shared_mutex handlers_lock;
+	std::array<Handler, 256> handlers;
+	uint32_t rx_unhandled;
+	uint32_t rx_bad_length;
+	uint32_t rx_invalid;
+	uint32_t rx_filtered;
+
+	void set_handler(MessageType type, Handler&& handler);
+	void dispatch(const MessageView& msg);
+
+	struct TxEntry {
+		MessageType type;
+		uint8_t length;
+		std::array<uint8_t, MAX_PAYLOAD_LENGTH> payload;
+		SendCallback callback;
+		int64_t queued_us;
+		int64_t sent_us;
+		/** Number of queued messages carried by the frame starting at this entry */
+		uint8_t batch;
+		/** RateControl rate index the frame was sent at */
+		uint8_t rate;
+		GroupId group;
+	};
 
 	struct Peer {
 		Peer();
 
-		struct ResultPromise {
-			std::promise<SendResult> promise;
-			std::shared_future<SendResult> future;
-		};
-		std::unique_ptr<ResultPromise> send_result;
+		size_t tx_window;
+		/** Added from an Announce or the peer store, not by the application */
+		bool learned;
+		/** Aggregation allowed, see tx_aggregates() for when it is used */
+		bool aggregate;
+		bool rate_control;
+		RateControl rate;
+		/** Highest wire version the peer is known to support */
+		uint8_t wire_version;
+		uint8_t max_wire_version;
+		/** Groups the peer advertised membership of */
+		std::bitset<256> groups;
+		uint8_t channel;
+		RingBuffer<TxEntry, TX_QUEUE_SIZE> tx_queue;
+		size_t tx_in_flight;
+		size_t tx_frames_in_flight;
+		/** Frames given up on whose send callback may still come in */
+		size_t tx_frames_expired;
+		int64_t tx_expired_us;
+		TxStats tx_stats;
+		uint32_t tx_seq;
+
+		ReliableTx rtx;
+		ReliableRx rrx;
+
+		LinkMetrics link;
+		ClockSync clock;
+		uint32_t ping_id;
+		int64_t last_ping_us;
+
 		uint32_t last_rx_seq;
 		time_point last_rx_time;
 		uint32_t last_tx_seq;
@@ -68,9 +439,91 @@ private:
 	};
 	std::unordered_map<PeerAddress, Peer, PeerAddressHasher> peers;
 
-	uint32_t send_seq;
+	std::array<uint8_t, ESP_NOW_MAX_DATA_LEN> tx_frame;
+	FramePool frames;
+
+	struct Completion {
+		SendCallback callback;
+		SendResult result;
+	};
+	RingBuffer<Completion, 2*TX_QUEUE_SIZE> completions;
+	int64_t last_expire_check_us;
+	/** Least free stack of the ESP-NOW task seen so far, in bytes */
+	std::atomic<uint32_t> stack_free_min;
+	milliseconds ping_interval;
+	std::optional<PeerAddress> clock_reference;
+	wifi_phy_rate_t phy_rate;
+	std::atomic<bool> pump_requested;
+	/** Identifies this boot in Reliable messages */
+	uint32_t reliable_epoch;
+	std::bitset<256> reliable_types;
+	std::bitset<256> groups;
+	/** Groups that nodes missing from the peer table advertised */
+	std::bitset<256> foreign_groups;
+	milliseconds announce_interval;
+	size_t announce_burst;
+	int64_t last_announce_us;
+	bool learn_peers;
+	PeerStore peer_store;
+	std::vector<StoredPeer> peer_store_saved;
+	bool peer_store_dirty;
+	int64_t peer_store_dirty_us;
+	LinkUpStats link_up;
+	std::atomic<bool> control_seen;
+
+	void enqueue(const unique_lock& lock, const PeerAddress& addr, Peer& peer,
+			MessageType type, const void *payload, size_t length, SendCallback&& cb,
+			GroupId group = GROUP_NONE);
+	std::pair<const PeerAddress, Peer>& group_route(const unique_lock& lock, GroupId group);
+	void request_pump();
+	bool tx_aggregates(const PeerAddress& addr, const Peer& peer, GroupId group) const;
+	size_t tx_batch(const PeerAddress& addr, const Peer& peer) const;
+	void tx_pump(const unique_lock& lock, const PeerAddress& addr, Peer& peer);
+	void tx_pump_all(const unique_lock& lock);
+	void tx_complete(const unique_lock& lock, Peer& peer, SendResult result);
+	void tx_expire(const unique_lock& lock);
+	void complete(const unique_lock& lock, SendCallback&& cb, SendResult result);
+	void run_completions();
+	void reliable_send(const unique_lock& lock, const PeerAddress& addr, Peer& peer,
+			MessageType type, const void *payload, size_t length, SendCallback&& cb);
+	bool reliable_transmit(const unique_lock& lock, const PeerAddress& addr, Peer& peer,
+			const ReliableTx::Entry& entry);
+	milliseconds reliable_service();
+	void ping_peers();
+	void handle_ping(const MessageView& msg);
+	void handle_pong(const MessageView& msg);
+	milliseconds service_announce(int64_t now_us);
+	void learn_peer(const PeerAddress& address);
+	void restore_peers();
+	void peers_changed(const unique_lock& lock);
+	std::vector<StoredPeer> stored_peers(const shared_lock& lock) const;
+	void service_peer_store(int64_t now_us);
+	void note_first_control(const MessageView& msg);
+	const ClockSync *reference_clock(const shared_lock& lock) const;
+	void handle_aggregate(const MessageView& msg);
+	void handle_announce(const MessageView& msg);
+	void handle_reliable(const MessageView& msg);
+	void handle_ack(const MessageView& msg);
+	bool rx_account(const MessageView& msg, int8_t rssi);
+	void deliver(const MessageView& msg);
 
+	mutable std::mutex state_channels_lock;
+	std::list<std::unique_ptr<StateChannelBase>> state_channels;
+	void add_state_channel(std::unique_ptr<StateChannelBase>&& channel);
+	milliseconds service_state_channels();
+
+	mutable std::mutex streams_lock;
+	std::list<std::unique_ptr<Stream>> streams;
+	Stream *find_stream(const PeerAddress& peer, StreamId id) const;
+	size_t tx_queue_room(const PeerAddress& address) const;
+	milliseconds service_streams();
+	void handle_stream_data(const MessageView& msg);
+	void handle_stream_ack(const MessageView& msg);
+
+	void wake();
 	void run() override;
+	void register_console_cmd();
+	void register_http_handlers();
 
 	enum EventID {
 		None,
@@ -86,12 +539,9 @@ private:
 	};
 
 	struct EventRecv {
-		EventRecv(const uint8_t *mac_addr, const uint8_t *data, size_t data_len);
-		void release();
+		EventRecv(Frame *frame);
 
-		const PeerAddress peer;
-		uint8_t *data;
-		const size_t data_len;
+		Frame *frame;
 	};
 
 	struct Event {
@@ -107,9 +557,29 @@ private:
 		} info;
 	};
 
-	Queue<Event> events;
+	struct EventLane {
+		EventLane(size_t size);
+
+		Queue<Event> queue;
+		std::atomic<uint32_t> events;
+		std::atomic<uint32_t> dropped;
+		std::atomic<size_t> depth_max;
+	};
+
+	std::array<std::atomic<Lane>, 256> lanes;
+	std::array<EventLane, LANE_COUNT> event_lanes;
+	QueueSet event_set;
+
+	EventLane& event_lane(Lane lane) { return event_lanes[static_cast<size_t>(lane)]; }
+	const EventLane& event_lane(Lane lane) const { return event_lanes[static_cast<size_t>(lane)]; }
+	Lane classify(const uint8_t *frame, size_t length) const;
+	Lane message_lane(MessageType type, const uint8_t *payload, size_t length) const;
+	bool post(Lane lane, Event&& event, TickType_t timeout);
+	bool next_event(Event& event);
 	void handle_send_cb(EventSend& ev);
 	void handle_recv_cb(EventRecv& ev);
+	friend StateChannelBase;
+	friend Stream;
 	friend void espnow_send_cb(const uint8_t *mac_addr, esp_now_send_status_t status);
 	friend void espnow_recv_cb(const uint8_t *mac_addr, const uint8_t *data, int data_len);
 };
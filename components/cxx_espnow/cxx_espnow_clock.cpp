@@ -0,0 +1,125 @@
+#include "cxx_espnow_clock.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+namespace esp_now {
+
+ClockSync::ClockSync() :
+	filter(),
+	fit(),
+	base_t(0),
+	base_offset(0),
+	drift(0),
+	st()
+{}
+
+void ClockSync::sample(int64_t t1, int64_t t2, int64_t t3, int64_t t4)
+{
+	const int64_t delay = (t4 - t1) - (t3 - t2);
+	if ((delay < 0) || (delay > UINT32_MAX))
+		return;
+
+	const Sample s = {
+		.t = t1 + (t4 - t1) / 2,
+		.offset = ((t2 - t1) + (t3 - t4)) / 2,
+		.delay = static_cast<uint32_t>(delay),
+	};
+
+	// Further off than any error this sample could have: peer clock restarted
+	if (synced() && (std::abs(s.offset - offset_at(s.t)) > STEP_US + delay)) {
+		st.steps++;
+		reset();
+	}
+
+	st.samples++;
+	st.delay_last_us = s.delay;
+	if (filter.full())
+		filter.pop_front();
+	filter.push_back(s);
+
+	size_t best = 0;
+	for (size_t i = 1; i < filter.size(); i++) {
+		if (filter[i].delay <= filter[best].delay)
+			best = i;
+	}
+	st.delay_min_us = filter[best].delay;
+	// Same best sample as last time, nothing new to fit
+	if (!fit.empty() && (filter[best].t <= fit.back().t))
+		return;
+
+	st.trusted++;
+	if (fit.full())
+		fit.pop_front();
+	fit.push_back(filter[best]);
+	refit();
+}
+
+void ClockSync::refit()
+{
+	const auto& last = fit.back();
+	const int64_t span = last.t - fit.front().t;
+	if ((fit.size() < 3) || (span < MIN_FIT_SPAN_US)) {
+		base_t = last.t;
+		base_offset = last.offset;
+		return;
+	}
+
+	// Relative to the newest sample, keeps the doubles small
+	double mt = 0, mo = 0;
+	for (size_t i = 0; i < fit.size(); i++) {
+		mt += fit[i].t - last.t;
+		mo += fit[i].offset - last.offset;
+	}
+	mt /= fit.size();
+	mo /= fit.size();
+	double cov = 0, var = 0;
+	for (size_t i = 0; i < fit.size(); i++) {
+		const double dt = (fit[i].t - last.t) - mt;
+		const double doff = (fit[i].offset - last.offset) - mo;
+		cov += dt * doff;
+		var += dt * dt;
+	}
+	drift = std::clamp(cov / var, -MAX_DRIFT_PPB * 1e-9, MAX_DRIFT_PPB * 1e-9);
+	base_t = last.t;
+	base_offset = last.offset + std::llround(mo - drift * mt);
+}
+
+void ClockSync::reset()
+{
+	filter.clear();
+	fit.clear();
+	base_t = 0;
+	base_offset = 0;
+	drift = 0;
+}
+
+int64_t ClockSync::offset_at(int64_t local_us) const
+{
+	if (!synced())
+		return 0;
+	return base_offset + std::llround(drift * (local_us - base_t));
+}
+
+int64_t ClockSync::to_peer(int64_t local_us) const
+{
+	return local_us + offset_at(local_us);
+}
+
+int64_t ClockSync::to_local(int64_t peer_us) const
+{
+	// Drift is tiny, one correction step is exact to well below a microsecond
+	return peer_us - offset_at(peer_us - offset_at(peer_us));
+}
+
+ClockSync::Stats ClockSync::stats() const
+{
+	auto s = st;
+	s.synced = synced();
+	s.offset_us = base_offset;
+	s.drift_ppb = std::lround(drift * 1e9);
+	return s;
+}
+
+}
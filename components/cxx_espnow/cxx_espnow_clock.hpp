@@ -0,0 +1,81 @@
+#pragma once
+
+#include "util_ring.hpp"
+
+#include <cstdint>
+
+namespace esp_now {
+
+/**
+ * Offset and drift of a peer's esp_timer clock relative to the local one,
+ * estimated from NTP-style Ping/Pong exchanges.
+ *
+ * An exchange gives four timestamps: Ping sent (t1) and Pong received (t4)
+ * on the local clock, Ping received (t2) and Pong sent (t3) on the peer's.
+ * Offset is ((t2 - t1) + (t3 - t4)) / 2, wrong by at most half the round
+ * trip delay (t4 - t1) - (t3 - t2). Like NTP's clock filter, only the lowest
+ * delay sample of the last FILTER_SIZE is trusted, as queueing on either
+ * side makes the path asymmetric. Drift is the least squares slope of the
+ * trusted offsets over the last FIT_SIZE of them.
+ */
+class ClockSync
+{
+public:
+	static constexpr size_t FILTER_SIZE = 8;
+	static constexpr size_t FIT_SIZE = 16;
+	/** Drift is only estimated once trusted samples span this long */
+	static constexpr int64_t MIN_FIT_SPAN_US = 4000000;
+	/** Crystal tolerance, anything beyond is noise */
+	static constexpr int32_t MAX_DRIFT_PPB = 200000;
+	/** Offset jump, on top of the sample's own error bound, taken as a peer restart */
+	static constexpr int64_t STEP_US = 10000;
+
+	struct Stats {
+		bool synced = false;
+		int64_t offset_us = 0;
+		int32_t drift_ppb = 0;
+		uint32_t delay_last_us = 0;
+		uint32_t delay_min_us = 0;
+		uint32_t samples = 0;
+		uint32_t trusted = 0;
+		uint32_t steps = 0;
+	};
+
+	ClockSync();
+
+	void sample(int64_t t1, int64_t t2, int64_t t3, int64_t t4);
+
+	/** At least one sample went in */
+	bool synced() const { return !fit.empty(); }
+	/** Filter isn't full yet, worth sampling faster */
+	bool acquiring() const { return filter.size() < FILTER_SIZE; }
+
+	/** Peer's clock at local time `local_us`, `local_us` itself until synced */
+	int64_t to_peer(int64_t local_us) const;
+	/** Local time at peer's clock `peer_us` */
+	int64_t to_local(int64_t peer_us) const;
+
+	Stats stats() const;
+
+private:
+	struct Sample {
+		/** Local time of the exchange midpoint */
+		int64_t t;
+		int64_t offset;
+		uint32_t delay;
+	};
+
+	RingBuffer<Sample, FILTER_SIZE> filter;
+	RingBuffer<Sample, FIT_SIZE> fit;
+	/** offset(t) = base_offset + drift * (t - base_t) */
+	int64_t base_t;
+	int64_t base_offset;
+	double drift;
+	Stats st;
+
+	int64_t offset_at(int64_t local_us) const;
+	void refit();
+	void reset();
+};
+
+}
@@ -0,0 +1,67 @@
+#include "cxx_espnow.hpp"
+
+#include "argtable3/argtable3.h"
+#include "esp_console.h"
+#include "esp_log.h"
+
+#define TAG "espnow"
+
+namespace esp_now {
+
+static struct {
+	struct arg_str *action;
+	struct arg_end *end;
+} cmd_espnow_args;
+
+int handle_cmd_espnow(int argc, char **argv)
+{
+	int ret = arg_parse(argc, argv, (void **)&cmd_espnow_args);
+	if (ret) {
+		arg_print_errors(stderr, cmd_espnow_args.end, argv[0]);
+		return 1;
+	}
+
+	if (!espnow) {
+		ESP_LOGE(TAG, "Not initialized");
+		return 1;
+	}
+
+	const char *action = cmd_espnow_args.action->count
+		? cmd_espnow_args.action->sval[0]
+		: "stats";
+	if (strcmp(action, "stats") == 0) {
+		espnow->print_stats();
+	}
+	else if (strcmp(action, "peers") == 0) {
+		espnow->print_peers();
+	}
+	else if (strcmp(action, "channels") == 0) {
+		espnow->print_state_channels();
+	}
+	else if (strcmp(action, "streams") == 0) {
+		espnow->print_streams();
+	}
+	else if (strcmp(action, "clock") == 0) {
+		espnow->print_clock();
+	}
+	else {
+		ESP_LOGD(TAG, "Invalid action");
+	}
+	return 0;
+}
+
+void ESPNow::register_console_cmd()
+{
+	cmd_espnow_args.action = arg_str0(NULL, NULL, "<stats|peers|channels|streams|clock>", "Action to run");
+	cmd_espnow_args.end = arg_end(1);
+	static const esp_console_cmd_t cmd_espnow = {
+		.command = "espnow",
+		.help = "ESP-NOW transport",
+		.hint = NULL,
+		.func = &handle_cmd_espnow,
+		.argtable = &cmd_espnow_args,
+	};
+	ESP_ERROR_CHECK(esp_console_cmd_register(&cmd_espnow));
+}
+
+}
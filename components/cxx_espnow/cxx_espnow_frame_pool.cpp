@@ -0,0 +1,77 @@
+#include "cxx_espnow_frame_pool.hpp"
+
+#include <cstring>
+
+namespace esp_now {
+
+FramePool::FramePool() :
+	slots(),
+	free_slots(SIZE),
+	in_use(0),
+	high_water(0),
+	taken(0),
+	exhausted(0),
+	oversized(0)
+{
+	for (auto& slot : slots) {
+		free_slots.send(&slot);
+	}
+}
+
+Frame *FramePool::take(const uint8_t *mac_addr, const uint8_t *data, size_t len, int8_t rssi)
+{
+	if (len > ESP_NOW_MAX_DATA_LEN) {
+		oversized++;
+		return nullptr;
+	}
+
+	Frame *frame;
+	if (!free_slots.receive(frame)) {
+		exhausted++;
+		return nullptr;
+	}
+
+	frame->peer = PeerAddress(mac_addr);
+	frame->rssi = rssi;
+	frame->len = len;
+	memcpy(frame->data, data, len);
+
+	taken++;
+	const auto used = ++in_use;
+	auto hw = high_water.load();
+	while (used > hw && !high_water.compare_exchange_weak(hw, used));
+
+	return frame;
+}
+
+void FramePool::release(Frame *frame)
+{
+	if (!frame)
+		return;
+	in_use--;
+	free_slots.send(std::move(frame));
+}
+
+FramePool::Stats FramePool::stats() const
+{
+	return Stats {
+		.capacity = SIZE,
+		.in_use = in_use,
+		.high_water = high_water,
+		.taken = taken,
+		.exhausted = exhausted,
+		.oversized = oversized,
+	};
+}
+
+FramePool::Lease::Lease(FramePool& _pool, Frame *_frame) :
+	pool(_pool),
+	frame(_frame)
+{}
+
+FramePool::Lease::~Lease()
+{
+	pool.release(frame);
+}
+
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "cxx_espnow_peer.hpp"
+#include "util_queue.hpp"
+
+#include <esp_now.h>
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace esp_now {
+
+/**
+ * Raw frame as received from ESP-NOW, stored in a preallocated pool slot.
+ */
+struct Frame
+{
+	PeerAddress peer;
+	/** Signal strength of the frame, 0 if unknown */
+	int8_t rssi;
+	size_t len;
+	uint8_t data[ESP_NOW_MAX_DATA_LEN];
+};
+
+/**
+ * Fixed-size pool of receive frame slots.
+ *
+ * `take()` is called from the Wi-Fi task receive callback and never allocates:
+ * free slots are handed out through a FreeRTOS queue of pointers into the
+ * statically sized slot array.
+ */
+class FramePool
+{
+public:
+	static constexpr size_t SIZE = 16;
+
+	FramePool();
+	FramePool(const FramePool&) = delete;
+
+	Frame *take(const uint8_t *mac_addr, const uint8_t *data, size_t len, int8_t rssi = 0);
+	void release(Frame *frame);
+	size_t available() const { return SIZE - in_use; }
+
+	struct Stats
+	{
+		size_t capacity;
+		size_t in_use;
+		size_t high_water;
+		uint32_t taken;
+		uint32_t exhausted;
+		uint32_t oversized;
+	};
+	Stats stats() const;
+
+	/** Returns the slot to the pool when going out of scope */
+	class Lease
+	{
+	public:
+		Lease(FramePool& pool, Frame *frame);
+		Lease(const Lease&) = delete;
+		~Lease();
+
+		const Frame& operator*() const { return *frame; }
+		const Frame *operator->() const { return frame; }
+
+	private:
+		FramePool& pool;
+		Frame *frame;
+	};
+
+private:
+	std::array<Frame, SIZE> slots;
+	Queue<Frame *> free_slots;
+
+	std::atomic<size_t> in_use;
+	std::atomic<size_t> high_water;
+	std::atomic<uint32_t> taken;
+	std::atomic<uint32_t> exhausted;
+	std::atomic<uint32_t> oversized;
+};
+
+}
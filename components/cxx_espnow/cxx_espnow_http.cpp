@@ -0,0 +1,149 @@
+#include "cxx_espnow.hpp"
+#include "core_http.hpp"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+namespace esp_now {
+
+using Core::http;
+using Core::json;
+
+static constexpr char URL_PEERS[] = "/api/v1/espnow/peers";
+static constexpr char URL_LANES[] = "/api/v1/espnow/lanes";
+static constexpr char URL_CLOCK[] = "/api/v1/espnow/clock";
+static constexpr char URL_LINKUP[] = "/api/v1/espnow/linkup";
+
+void ESPNow::register_http_handlers()
+{
+	http->on(URL_PEERS, HTTP_GET, [this](httpd_req_t *req) {
+		json j = json::array();
+		{
+			const auto lock = take_shared_lock();
+			for (const auto& [addr, peer] : peers) {
+				const auto& tx = peer.tx_stats;
+				const auto link = peer.link.stats();
+				const auto clock = peer.clock.stats();
+				const auto& rtx = peer.rtx.stats();
+				const auto& rrx = peer.rrx.st;
+				const auto rx_expected = link.rx_frames + link.rx_lost;
+				j.push_back({
+					{"address", ::to_string(addr)},
+					{"wire_version", std::min(peer.wire_version, peer.max_wire_version)},
+					{"tx", {
+						{"window", peer.tx_window},
+						{"in_flight", peer.tx_in_flight},
+						{"depth", tx.depth},
+						{"depth_max", tx.depth_max},
+						{"queued", tx.queued},
+						{"sent", tx.sent},
+						{"aggregated", tx.aggregated},
+						{"ok", tx.ok},
+						{"failed", tx.failed},
+						{"timeouts", tx.timeouts},
+						{"late_callbacks", tx.late_callbacks},
+						{"dropped", tx.dropped},
+						{"fail_rate", (tx.ok + tx.failed) ? float(tx.failed) / (tx.ok + tx.failed) : 0.0f},
+						{"latency_us", tx.latency_last_us},
+						{"latency_avg_us", tx.latency_avg_us},
+						{"latency_max_us", tx.latency_max_us},
+					}},
+					{"rx", {
+						{"frames", link.rx_frames},
+						{"lost", link.rx_lost},
+						{"late", link.rx_late},
+						{"resets", link.rx_resets},
+						{"loss_rate", rx_expected ? float(link.rx_lost) / rx_expected : 0.0f},
+					}},
+					{"rtt", {
+						{"pings", link.pings_sent},
+						{"pongs", link.pongs_received},
+						{"last_us", link.rtt_last_us},
+						{"min_us", link.rtt_min_us},
+						{"p50_us", link.rtt_p50_us},
+						{"p99_us", link.rtt_p99_us},
+						{"max_us", link.rtt_max_us},
+						{"jitter_us", link.jitter_us},
+					}},
+					{"clock", {
+						{"synced", clock.synced},
+						{"reference", clock_reference == addr},
+						{"offset_us", clock.offset_us},
+						{"drift_ppb", clock.drift_ppb},
+						{"delay_us", clock.delay_last_us},
+						{"delay_min_us", clock.delay_min_us},
+						{"samples", clock.samples},
+						{"trusted", clock.trusted},
+						{"steps", clock.steps},
+					}},
+					{"reliable", {
+						{"sent", rtx.sent},
+						{"retransmits", rtx.retransmits},
+						{"acked", rtx.acked},
+						{"gave_up", rtx.gave_up},
+						{"unacked", peer.rtx.size()},
+						{"rto_us", peer.rtx.rto_us()},
+						{"srtt_us", peer.rtx.srtt_us()},
+						{"delivered", rrx.delivered},
+						{"duplicates", rrx.duplicates},
+						{"out_of_window", rrx.out_of_window},
+						{"skipped", rrx.skipped},
+						{"acks_sent", rrx.acks_sent},
+					}},
+					{"rate", {
+						{"adaptive", peer.rate_control},
+						{"current", RateControl::RATES[peer.rate.current()].name},
+						{"rssi", peer.rate.last_rssi()},
+					}},
+				});
+			}
+		}
+		return Core::httpd_resp_json(req, j);
+	});
+
+	http->on(URL_LANES, HTTP_GET, [this](httpd_req_t *req) {
+		static const char *names[LANE_COUNT] = {"control", "bulk"};
+		json j = json::object();
+		for (size_t i = 0; i < LANE_COUNT; i++) {
+			const auto st = lane_stats(static_cast<Lane>(i));
+			j[names[i]] = {
+				{"events", st.events},
+				{"dropped", st.dropped},
+				{"depth", st.depth},
+				{"depth_max", st.depth_max},
+			};
+		}
+		return Core::httpd_resp_json(req, j);
+	});
+
+	http->on(URL_CLOCK, HTTP_GET, [this](httpd_req_t *req) {
+		const auto local = esp_timer_get_time();
+		json j = {
+			{"synced", clock_synced()},
+			{"local_us", local},
+			{"sync_us", to_sync_time(local)},
+		};
+		{
+			const auto lock = take_shared_lock();
+			j["reference"] = clock_reference ? ::to_string(*clock_reference) : "self";
+		}
+		return Core::httpd_resp_json(req, j);
+	});
+
+	http->on(URL_LINKUP, HTTP_GET, [this](httpd_req_t *req) {
+		const auto up = link_up_stats();
+		json j = {
+			{"init_us", up.init_us},
+			{"restored_peers", up.restored_peers},
+			{"first_rx_us", up.first_rx_us},
+			{"first_control_us", up.first_control_us},
+		};
+		if (up.first_control_us) {
+			j["first_control_peer"] = ::to_string(up.first_control_peer);
+			j["first_control_type"] = up.first_control_type;
+		}
+		return Core::httpd_resp_json(req, j);
+	});
+}
+
+}
@@ -0,0 +1,75 @@
+#include "cxx_espnow_link.hpp"
+
+#include <cstdlib>
+
+namespace esp_now {
+
+/** Forward gaps larger than this are treated as a peer restart */
+static constexpr int32_t MAX_SEQ_GAP = 1024;
+
+void LinkMetrics::SeqTracker::update(uint32_t seq, unsigned bits, Stats& st)
+{
+	const uint32_t mask = (1u << bits) - 1;
+	seq &= mask;
+	if (!valid) {
+		valid = true;
+		next = (seq + 1) & mask;
+		return;
+	}
+
+	// Sign-extend difference of `bits` wide sequence numbers
+	const unsigned shift = 32 - bits;
+	const int32_t delta = static_cast<int32_t>((seq - next) << shift) >> shift;
+	if ((delta >= 0) && (delta < MAX_SEQ_GAP)) {
+		st.rx_lost += delta;
+		next = (seq + 1) & mask;
+	}
+	else if ((delta < 0) && (delta > -MAX_SEQ_GAP)) {
+		// Reordered or duplicated, was counted as lost before
+		st.rx_late++;
+		if (st.rx_lost)
+			st.rx_lost--;
+	}
+	else {
+		st.rx_resets++;
+		next = (seq + 1) & mask;
+	}
+}
+
+void LinkMetrics::rx(uint32_t seq, uint8_t version)
+{
+	const unsigned bits = (version == WIRE_VERSION_1) ? 31 : 16;
+	st.rx_frames++;
+	if (seq & BROADCAST_SEQ_FLAG)
+		broadcast.update(seq, bits, st);
+	else
+		unicast.update(seq, bits, st);
+}
+
+void LinkMetrics::ping_sent()
+{
+	st.pings_sent++;
+}
+
+void LinkMetrics::pong(uint32_t rtt_us)
+{
+	if (st.pongs_received) {
+		const int32_t d = std::abs(static_cast<int32_t>(rtt_us - st.rtt_last_us));
+		st.jitter_us += (d - static_cast<int32_t>(st.jitter_us)) / 16;
+	}
+	st.pongs_received++;
+	st.rtt_last_us = rtt_us;
+	rtt.add(rtt_us);
+}
+
+LinkMetrics::Stats LinkMetrics::stats() const
+{
+	auto s = st;
+	s.rtt_min_us = rtt.min();
+	s.rtt_p50_us = rtt.percentile(50);
+	s.rtt_p99_us = rtt.percentile(99);
+	s.rtt_max_us = rtt.max();
+	return s;
+}
+
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "util_histogram.hpp"
+#include "cxx_espnow_message.hpp"
+
+#include <cstdint>
+
+namespace esp_now {
+
+/**
+ * Receive-side link quality for a single peer.
+ *
+ * Loss is derived from gaps in the peer's per-destination sequence numbers,
+ * unicast and broadcast streams are tracked separately. RTT comes from
+ * Ping/Pong round trips, jitter is the smoothed RTT variation (RFC 3550).
+ */
+class LinkMetrics
+{
+public:
+	struct Stats {
+		uint32_t rx_frames = 0;
+		uint32_t rx_lost = 0;
+		uint32_t rx_late = 0;
+		uint32_t rx_resets = 0;
+		uint32_t pings_sent = 0;
+		uint32_t pongs_received = 0;
+		uint32_t rtt_last_us = 0;
+		uint32_t rtt_min_us = 0;
+		uint32_t rtt_p50_us = 0;
+		uint32_t rtt_p99_us = 0;
+		uint32_t rtt_max_us = 0;
+		uint32_t jitter_us = 0;
+	};
+
+	/** Account received frame, `seq` as decoded by MessageView */
+	void rx(uint32_t seq, uint8_t version);
+	void ping_sent();
+	void pong(uint32_t rtt_us);
+	Stats stats() const;
+
+private:
+	struct SeqTracker {
+		bool valid = false;
+		uint32_t next = 0;
+
+		void update(uint32_t seq, unsigned bits, Stats& st);
+	};
+
+	SeqTracker unicast, broadcast;
+	Stats st;
+	LogHistogram<> rtt;
+};
+
+}
@@ -1,5 +1,120 @@
 #include "cxx_espnow_message.hpp"
 
+namespace esp_now {
+
+/** First byte of the little endian v1 magic */
+static constexpr uint8_t V1_MAGIC_BYTE = Message::MAGIC & 0xff;
+
+size_t header_length(uint8_t version, GroupId group)
+{
+	if (version == WIRE_VERSION_1)
+		return sizeof(MessageHeader);
+	return sizeof(MessageHeaderV2) + ((group != GROUP_NONE) ? sizeof(GroupId) : 0);
+}
+
+size_t encode_header(uint8_t *buf, uint8_t version, uint32_t seq, uint8_t flags,
+		MessageType type, size_t length, GroupId group)
+{
+	if (version == WIRE_VERSION_1) {
+		auto& hdr = *reinterpret_cast<MessageHeader *>(buf);
+		hdr.magic = Message::MAGIC;
+		hdr.seq = seq | ((flags & HeaderFlagBroadcast) ? BROADCAST_SEQ_FLAG : 0);
+		hdr.type = type;
+		hdr.length = length;
+		hdr.crc = esp_crc16_le(UINT16_MAX, buf + sizeof(MessageHeader), length);
+		return sizeof(MessageHeader) + length;
+	}
+
+	auto& hdr = *reinterpret_cast<MessageHeaderV2 *>(buf);
+	if (group != GROUP_NONE) {
+		flags |= HeaderFlagGroup;
+		buf[sizeof(MessageHeaderV2)] = group;
+	}
+	else {
+		flags &= ~HeaderFlagGroup;
+	}
+	hdr.version_flags = (WIRE_VERSION_2 << 4) | (flags & 0x0f);
+	hdr.seq = seq;
+	hdr.type = type;
+	return header_length(version, group) + length;
+}
+
+bool peek_header(const uint8_t *frame, size_t length, MessageType& type,
+		const uint8_t *& payload, size_t& payload_length)
+{
+	if (!length)
+		return false;
+
+	size_t hdr_length = sizeof(MessageHeader);
+	if (frame[0] != V1_MAGIC_BYTE) {
+		hdr_length = sizeof(MessageHeaderV2);
+		if (header_v2_flags(frame[0]) & HeaderFlagGroup)
+			hdr_length += sizeof(GroupId);
+	}
+	if (length < hdr_length)
+		return false;
+
+	type = (hdr_length == sizeof(MessageHeader))
+		? reinterpret_cast<const MessageHeader *>(frame)->type
+		: reinterpret_cast<const MessageHeaderV2 *>(frame)->type;
+	payload = frame + hdr_length;
+	payload_length = length - hdr_length;
+	return true;
+}
+
+MessageView::MessageView(const PeerAddress& peer, const uint8_t *frame, size_t length) :
+	peer_addr(peer),
+	hdr(),
+	data(nullptr),
+	ver(0),
+	grp(GROUP_NONE)
+{
+	if (!length)
+		throw std::runtime_error("empty message");
+
+	if (frame[0] == V1_MAGIC_BYTE) {
+		if (length < sizeof(MessageHeader))
+			throw std::runtime_error("message too short");
+		memcpy(&hdr, frame, sizeof(MessageHeader));
+		if (hdr.magic != Message::MAGIC)
+			throw std::runtime_error("bad magic");
+		if (hdr.length > length - sizeof(MessageHeader))
+			throw std::runtime_error("bad payload length");
+
+		data = frame + sizeof(MessageHeader);
+		auto crc_cal = esp_crc16_le(UINT16_MAX, data, hdr.length);
+		if (crc_cal != hdr.crc)
+			throw std::runtime_error("crc check failed");
+		ver = WIRE_VERSION_1;
+		return;
+	}
+
+	if (header_v2_version(frame[0]) != WIRE_VERSION_2)
+		throw std::runtime_error("unsupported version");
+	if (length < sizeof(MessageHeaderV2))
+		throw std::runtime_error("message too short");
+
+	MessageHeaderV2 v2;
+	memcpy(&v2, frame, sizeof(v2));
+	const auto flags = header_v2_flags(v2.version_flags);
+	size_t hdr_length = sizeof(MessageHeaderV2);
+	if (flags & HeaderFlagGroup) {
+		if (length < hdr_length + sizeof(GroupId))
+			throw std::runtime_error("message too short");
+		grp = frame[hdr_length];
+		if (grp == GROUP_NONE)
+			throw std::runtime_error("bad group");
+		hdr_length += sizeof(GroupId);
+	}
+	hdr.seq = v2.seq | ((flags & HeaderFlagBroadcast) ? BROADCAST_SEQ_FLAG : 0);
+	hdr.type = v2.type;
+	hdr.length = length - hdr_length;
+	data = frame + hdr_length;
+	ver = WIRE_VERSION_2;
+}
+
+}
+
 std::ostream& operator<<(std::ostream& os, const esp_now::MessageInterface& m)
 {
 	os << m.to_string();
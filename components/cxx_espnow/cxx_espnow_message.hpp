@@ -6,24 +6,41 @@
 #include <esp_crc.h>
 #include <esp_log.h>
 
+#include <array>
 #include <cstdint>
+#include <cstring>
 #include <functional>
 #include <memory>
+#include <new>
 #include <string>
 #include <sstream>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 namespace esp_now {
 
 using Buffer = std::vector<uint8_t>;
 using MessageType = uint8_t;
+/** Application-level destination group, membership is filtered by receivers */
+using GroupId = uint8_t;
+static constexpr GroupId GROUP_NONE = 0;
+using SendResult = bool;
+using SendCallback = std::function<void(SendResult)>;
 
 enum MessageId {
 	Announce = 0,
 	Ping,
 	Pong,
+	Aggregate,
+	Ack,
+	Reliable,
+	StreamData,
+	StreamAck,
 };
 
+/** Wire format version 1 header, also used as decoded header of any version */
 struct MessageHeader
 {
 	uint32_t magic;
@@ -33,6 +50,65 @@ struct MessageHeader
 	uint16_t crc;
 } __attribute__((packed));
 
+/**
+ * Wire format version 2 header.
+ *
+ * Version lives in the upper nibble of the first byte, which can't collide
+ * with the first byte of the v1 magic. Payload length is implied by the frame
+ * length and integrity is left to the 802.11 FCS.
+ */
+struct MessageHeaderV2
+{
+	uint8_t version_flags;
+	uint16_t seq;
+	MessageType type;
+} __attribute__((packed));
+
+/** Set in the v1 header sequence number of frames sent to the broadcast address */
+static constexpr uint32_t BROADCAST_SEQ_FLAG = (1u << 31);
+
+static constexpr uint8_t WIRE_VERSION_1 = 1;
+static constexpr uint8_t WIRE_VERSION_2 = 2;
+static constexpr uint8_t WIRE_VERSION_MAX = WIRE_VERSION_2;
+
+enum HeaderFlags : uint8_t {
+	HeaderFlagBroadcast = (1 << 0),
+	/** v2 header is followed by a GroupId byte */
+	HeaderFlagGroup = (1 << 1),
+};
+
+static constexpr uint8_t header_v2_version(uint8_t version_flags) { return version_flags >> 4; }
+static constexpr uint8_t header_v2_flags(uint8_t version_flags) { return version_flags & 0x0f; }
+
+/** Largest payload that fits in a frame with any header version */
+static constexpr size_t MAX_PAYLOAD_LENGTH = ESP_NOW_MAX_DATA_LEN - sizeof(MessageHeader);
+
+/**
+ * Encode header of `version` for `length` bytes of payload already placed at
+ * `buf + header_length(version, group)`. Returns full frame length. Groups
+ * need wire version 2.
+ */
+size_t header_length(uint8_t version, GroupId group = GROUP_NONE);
+size_t encode_header(uint8_t *buf, uint8_t version, uint32_t seq, uint8_t flags,
+		MessageType type, size_t length, GroupId group = GROUP_NONE);
+
+/**
+ * Type and payload of `frame` from a cheap look at its header, without
+ * validating it. Returns false if the frame is too short for any header.
+ */
+bool peek_header(const uint8_t *frame, size_t length, MessageType& type,
+		const uint8_t *& payload, size_t& payload_length);
+
+/**
+ * Sub-header of a message packed into an `Aggregate` frame, followed by
+ * `length` bytes of payload. Records are laid out back to back.
+ */
+struct AggregateRecord
+{
+	MessageType type;
+	uint8_t length;
+} __attribute__((packed));
+
 class MessageInterface
 {
 public:
@@ -151,28 +227,249 @@ protected:
 	}
 };
 
+/**
+ * Transmit-side message built in place in a fixed-size buffer.
+ *
+ * Never allocates: room for the largest header is kept in front of the
+ * payload, so `prepare()` frames the message without copying it and computes
+ * the CRC exactly once. `ESPNow::send()` takes the payload as is and leaves
+ * framing to the transport.
+ */
+class MessageBuilder
+{
+public:
+	MessageBuilder(const PeerAddress& peer, MessageType type) :
+		peer_addr(peer),
+		msg_type(type),
+		length(0),
+		frame_offset(0)
+	{}
+
+	MessageBuilder(const PeerAddress& peer, MessageType type, const void *data, size_t size) :
+		MessageBuilder(peer, type)
+	{
+		append(data, size);
+	}
+
+	const PeerAddress& peer() const { return peer_addr; }
+	MessageType type() const { return msg_type; }
+	uint8_t *payload() { return buffer.data() + PAYLOAD_OFFSET; }
+	const uint8_t *payload() const { return buffer.data() + PAYLOAD_OFFSET; }
+	size_t payload_length() const { return length; }
+
+	/** Grow payload by `size` uninitialized bytes, throws if they don't fit */
+	uint8_t *reserve(size_t size)
+	{
+		if (size > MAX_PAYLOAD_LENGTH - length)
+			throw std::length_error("message payload too long");
+		auto *p = payload() + length;
+		length += size;
+		return p;
+	}
+
+	MessageBuilder& append(const void *data, size_t size)
+	{
+		memcpy(reserve(size), data, size);
+		return *this;
+	}
+
+	/** Construct `T` at the end of the payload */
+	template <typename T, typename... Args>
+	T& emplace(Args&&... args)
+	{
+		static_assert(std::is_trivially_copyable_v<T>, "Payload must be trivially copyable");
+		return *new (reserve(sizeof(T))) T{std::forward<Args>(args)...};
+	}
+
+	void clear() { length = 0; }
+
+	/**
+	 * Put `version` header with `seq` in front of the payload. Returns frame
+	 * length, the frame stays valid until the payload changes.
+	 */
+	size_t prepare(uint32_t seq, uint8_t version = WIRE_VERSION_1, uint8_t flags = 0)
+	{
+		frame_offset = PAYLOAD_OFFSET - header_length(version);
+		return encode_header(buffer.data() + frame_offset, version, seq, flags, msg_type, length);
+	}
+
+	const uint8_t *frame() const { return buffer.data() + frame_offset; }
+
+	std::string to_string() const
+	{
+		using namespace std;
+		ostringstream ss;
+		ss << "Message[peer:" << peer_addr <<
+			", type:" << static_cast<unsigned>(msg_type) <<
+			", len:" << length << "]{";
+		for (size_t i = 0; i < length; i++) {
+			ss << setfill('0') << setw(2) << right << hex << static_cast<unsigned>(payload()[i]);
+		}
+		ss << "}";
+		return ss.str();
+	}
+
+protected:
+	static constexpr size_t PAYLOAD_OFFSET = sizeof(MessageHeader);
+
+	PeerAddress peer_addr;
+	MessageType msg_type;
+	size_t length;
+	size_t frame_offset;
+	std::array<uint8_t, PAYLOAD_OFFSET + MAX_PAYLOAD_LENGTH> buffer;
+};
+
+/**
+ * Read-only view of a received message of any wire version.
+ *
+ * Points directly into the receive buffer, so it must not outlive the frame
+ * it was created from. The header is decoded into the v1 layout; for v2
+ * frames `seq` is 16 bits wide and the broadcast flag maps to
+ * `BROADCAST_SEQ_FLAG`.
+ */
+class MessageView
+{
+public:
+	MessageView(const PeerAddress& peer, const uint8_t *data, size_t length);
+
+	/** View of a message carried inside `outer`, e.g. an aggregate record */
+	MessageView(const MessageView& outer, MessageType type, const uint8_t *payload, size_t length) :
+		peer_addr(outer.peer_addr),
+		hdr(outer.hdr),
+		data(payload),
+		ver(outer.ver),
+		grp(outer.grp)
+	{
+		hdr.type = type;
+		hdr.length = length;
+	}
+
+	std::string to_string() const
+	{
+		using namespace std;
+		ostringstream ss;
+		ss << "Message[peer:" << peer_addr <<
+			", seq:" << dec << hdr.seq <<
+			", type:" << static_cast<unsigned>(hdr.type) <<
+			", len:" << static_cast<unsigned>(hdr.length) << "]{";
+		for (size_t i = 0; i < hdr.length; i++) {
+			ss << setfill('0') << setw(2) << right << hex << static_cast<unsigned>(data[i]);
+		}
+		ss << "}";
+		return ss.str();
+	}
+	const PeerAddress& peer() const
+	{
+		return peer_addr;
+	}
+	const MessageHeader& header() const
+	{
+		return hdr;
+	}
+	const void *payload() const
+	{
+		return data;
+	}
+	size_t payload_length() const
+	{
+		return hdr.length;
+	}
+	uint8_t version() const
+	{
+		return ver;
+	}
+	/** Destination group, GROUP_NONE if addressed to the peer itself */
+	GroupId group() const
+	{
+		return grp;
+	}
+
+	template <typename Payload>
+	const Payload& payload_as() const
+	{
+		return *reinterpret_cast<const Payload *>(data);
+	};
+
+private:
+	const PeerAddress& peer_addr;
+	MessageHeader hdr;
+	const uint8_t *data;
+	uint8_t ver;
+	GroupId grp;
+};
+
+/** Message of `Type` carrying `Payload`, built in place without allocating */
 template <MessageType Type, typename Payload>
 class GenericMessage :
-	public Message
+	public MessageBuilder
 {
 public:
-	GenericMessage(Message&& msg) :
-		Message(std::move(msg))
-	{}
+	using payload_type = Payload;
+	static constexpr MessageType type = Type;
+
+	GenericMessage(const PeerAddress& peer) :
+		MessageBuilder(peer, Type)
+	{
+		emplace<Payload>();
+	}
 
 	GenericMessage(const PeerAddress& peer, const Payload& data) :
-		Message(peer, Type,
-				reinterpret_cast<const uint8_t *>(&data), sizeof(Payload))
+		MessageBuilder(peer, Type, &data, sizeof(Payload))
 	{}
 
+	Payload& content()
+	{
+		return *reinterpret_cast<Payload *>(payload());
+	}
+
 	const Payload& content() const
 	{
-		return *reinterpret_cast<Payload *>(buffer.data() + sizeof(MessageHeader));
+		return *reinterpret_cast<const Payload *>(payload());
 	}
 };
 
-using MessagePing = GenericMessage<MessageId::Ping, void>;
-using MessageAnnounce = GenericMessage<MessageId::Announce, void>;
+template <MessageType Type>
+class GenericMessage<Type, void> :
+	public MessageBuilder
+{
+public:
+	using payload_type = void;
+	static constexpr MessageType type = Type;
+
+	GenericMessage(const PeerAddress& peer) :
+		MessageBuilder(peer, Type)
+	{}
+};
+
+struct AnnouncePayload
+{
+	/** Highest wire format version the sender understands */
+	uint8_t version;
+	/** Bitmap of groups the sender is a member of, absent from older firmware */
+	uint8_t groups[32];
+} __attribute__((packed));
+
+struct PingPayload
+{
+	uint32_t id;
+	int64_t timestamp_us;
+} __attribute__((packed));
+
+/**
+ * Ping echoed back with the responder's clock at Ping reception and Pong
+ * transmission, for clock synchronisation. Older firmware echoes just the
+ * PingPayload.
+ */
+struct PongPayload
+{
+	PingPayload ping;
+	int64_t rx_us;
+	int64_t tx_us;
+} __attribute__((packed));
+
+using MessagePing = GenericMessage<MessageId::Ping, PingPayload>;
+using MessagePong = GenericMessage<MessageId::Pong, PongPayload>;
+using MessageAnnounce = GenericMessage<MessageId::Announce, AnnouncePayload>;
 
 }
 
@@ -0,0 +1,73 @@
+#include "cxx_espnow_peer_store.hpp"
+
+#include "esp_log.h"
+#include "nvs.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#define TAG "espnow"
+
+namespace esp_now {
+
+constexpr char PeerStore::KEY[];
+
+PeerStore::PeerStore(const char *_ns) :
+	ns(_ns)
+{}
+
+std::vector<StoredPeer> PeerStore::load() const
+{
+	std::vector<StoredPeer> peers;
+	nvs_handle_t nvs;
+	if (nvs_open(ns, NVS_READONLY, &nvs) != ESP_OK)
+		return peers;
+
+	uint8_t blob[sizeof(Header) + MAX_PEERS * sizeof(StoredPeer)];
+	size_t length = sizeof(blob);
+	const auto err = nvs_get_blob(nvs, KEY, blob, &length);
+	nvs_close(nvs);
+	if (err != ESP_OK) {
+		if (err != ESP_ERR_NVS_NOT_FOUND)
+			ESP_LOGW(TAG, "peer table: %s", esp_err_to_name(err));
+		return peers;
+	}
+
+	Header hdr = {};
+	if (length >= sizeof(hdr))
+		memcpy(&hdr, blob, sizeof(hdr));
+	if ((length < sizeof(hdr)) || (hdr.version != FORMAT_VERSION) || (hdr.count > MAX_PEERS) ||
+			(length != sizeof(hdr) + hdr.count * sizeof(StoredPeer))) {
+		ESP_LOGW(TAG, "peer table: unknown format, ignoring");
+		return peers;
+	}
+	peers.resize(hdr.count);
+	memcpy(peers.data(), blob + sizeof(hdr), hdr.count * sizeof(StoredPeer));
+	return peers;
+}
+
+void PeerStore::save(const std::vector<StoredPeer>& peers)
+{
+	const Header hdr = {
+		.version = FORMAT_VERSION,
+		.count = static_cast<uint8_t>(std::min(peers.size(), MAX_PEERS)),
+	};
+	uint8_t blob[sizeof(Header) + MAX_PEERS * sizeof(StoredPeer)];
+	memcpy(blob, &hdr, sizeof(hdr));
+	memcpy(blob + sizeof(hdr), peers.data(), hdr.count * sizeof(StoredPeer));
+
+	nvs_handle_t nvs;
+	auto err = nvs_open(ns, NVS_READWRITE, &nvs);
+	if (err != ESP_OK)
+		throw std::runtime_error(std::string("nvs_open: ") + esp_err_to_name(err));
+	err = nvs_set_blob(nvs, KEY, blob, sizeof(hdr) + hdr.count * sizeof(StoredPeer));
+	if (err == ESP_OK)
+		err = nvs_commit(nvs);
+	nvs_close(nvs);
+	if (err != ESP_OK)
+		throw std::runtime_error(std::string("peer table: ") + esp_err_to_name(err));
+}
+
+}
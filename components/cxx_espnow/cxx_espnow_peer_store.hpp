@@ -0,0 +1,50 @@
+#pragma once
+
+#include "cxx_espnow_peer.hpp"
+
+#include <cstdint>
+#include <vector>
+
+namespace esp_now {
+
+/** What is remembered about a peer across reboots */
+struct StoredPeer
+{
+	uint8_t mac[6];
+	uint8_t channel;
+	/** Highest wire format version the peer was known to support */
+	uint8_t wire_version;
+	/** Bitmap of groups the peer advertised */
+	uint8_t groups[32];
+} __attribute__((packed));
+
+/**
+ * Peer table persisted in NVS, so that peers can be registered at boot
+ * without waiting to hear from them again. Encryption keys are not stored,
+ * they stay with the application code that adds the peer.
+ */
+class PeerStore
+{
+public:
+	static constexpr size_t MAX_PEERS = 16;
+
+	explicit PeerStore(const char *ns = "espnow");
+
+	/** Stored peers, empty if there are none or the table is unreadable */
+	std::vector<StoredPeer> load() const;
+	/** Replace stored table, throws on NVS errors */
+	void save(const std::vector<StoredPeer>& peers);
+
+private:
+	static constexpr uint8_t FORMAT_VERSION = 1;
+	static constexpr char KEY[] = "peers";
+
+	struct Header {
+		uint8_t version;
+		uint8_t count;
+	} __attribute__((packed));
+
+	const char *ns;
+};
+
+}
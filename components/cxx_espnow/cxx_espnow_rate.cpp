@@ -0,0 +1,141 @@
+#include "cxx_espnow_rate.hpp"
+
+#include <algorithm>
+
+namespace esp_now {
+
+const std::array<RateControl::Rate, RateControl::RATE_COUNT> RateControl::RATES = {{
+	{WIFI_PHY_RATE_LORA_250K,	"LR 250K",	250,	400,	-128},
+	{WIFI_PHY_RATE_LORA_500K,	"LR 500K",	500,	400,	-95},
+	{WIFI_PHY_RATE_1M_L,		"1M",		1000,	192,	-88},
+	{WIFI_PHY_RATE_2M_S,		"2M",		2000,	96,		-86},
+	{WIFI_PHY_RATE_6M,			"6M",		6000,	20,		-83},
+	{WIFI_PHY_RATE_12M,			"12M",		12000,	20,		-80},
+	{WIFI_PHY_RATE_24M,			"24M",		24000,	20,		-76},
+}};
+
+RateControl::RateControl() :
+	window(),
+	total(),
+	known(),
+	best(DEFAULT_RATE),
+	frames(0),
+	consecutive_failures(0),
+	last_update_us(0),
+	rssi_avg(0)
+{
+	// Slower rates than the default one are assumed to work until proven otherwise
+	for (size_t i = 0; i <= DEFAULT_RATE; i++) {
+		total[i].prob_permille = 1000;
+		known[i] = true;
+	}
+}
+
+uint32_t RateControl::airtime_us(size_t rate)
+{
+	const auto& r = RATES[rate];
+	return r.preamble_us + TYPICAL_FRAME_BYTES * 8 * 1000 / r.kbps;
+}
+
+size_t RateControl::max_allowed() const
+{
+	if (!rssi_avg)
+		return RATE_COUNT - 1;
+
+	size_t i = 0;
+	while ((i + 1 < RATE_COUNT) && (rssi_avg >= RATES[i + 1].min_rssi))
+		i++;
+	return i;
+}
+
+size_t RateControl::select(int64_t now_us)
+{
+	if (now_us - last_update_us >= UPDATE_INTERVAL_US) {
+		last_update_us = now_us;
+		update();
+	}
+
+	const auto max_rate = max_allowed();
+	if (best > max_rate)
+		best = max_rate;
+
+	if ((++frames % SAMPLE_INTERVAL == 0) && (best < max_rate))
+		return best + 1;
+	return best;
+}
+
+void RateControl::report(size_t rate, bool ok, int64_t now_us)
+{
+	if (rate >= RATE_COUNT)
+		return;
+
+	auto& w = window[rate];
+	w.attempts++;
+	total[rate].attempts++;
+	if (ok) {
+		w.successes++;
+		total[rate].successes++;
+	}
+
+	if (rate != best)
+		return;
+
+	if (ok) {
+		consecutive_failures = 0;
+		return;
+	}
+
+	if (++consecutive_failures >= MAX_CONSECUTIVE_FAILURES) {
+		// Fall back right away instead of waiting for the next update
+		consecutive_failures = 0;
+		last_update_us = now_us;
+		update();
+		if (best == rate && best > 0)
+			best--;
+	}
+}
+
+void RateControl::rssi(int8_t value)
+{
+	if (!value)
+		return;
+	rssi_avg = rssi_avg ? (rssi_avg * 3 + value) / 4 : value;
+}
+
+void RateControl::update()
+{
+	for (size_t i = 0; i < RATE_COUNT; i++) {
+		auto& w = window[i];
+		if (!w.attempts)
+			continue;
+
+		const uint16_t p = w.successes * 1000 / w.attempts;
+		auto& prob = total[i].prob_permille;
+		prob = known[i] ? (prob * 3 + p) / 4 : p;
+		known[i] = true;
+		w = {};
+	}
+	choose_best();
+}
+
+void RateControl::choose_best()
+{
+	const auto max_rate = max_allowed();
+	uint32_t best_tp = 0;
+	size_t new_best = 0;
+	for (size_t i = 0; i <= max_rate; i++) {
+		if (!known[i])
+			continue;
+		// Minstrel ignores rates that mostly fail, their throughput estimate is unreliable
+		if (total[i].prob_permille < 100)
+			continue;
+		const uint32_t tp = uint32_t(total[i].prob_permille) * 1000 / airtime_us(i);
+		if (tp > best_tp) {
+			best_tp = tp;
+			new_best = i;
+		}
+	}
+	best = new_best;
+}
+
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <esp_wifi_types.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace esp_now {
+
+/**
+ * Per-peer PHY rate selection in the spirit of Minstrel.
+ *
+ * Delivery probability of each rate is estimated from send callback results
+ * and smoothed with EWMA every `UPDATE_INTERVAL_US`. Frames go out at the
+ * rate with best expected throughput, every `SAMPLE_INTERVAL`-th frame probes
+ * the next faster rate. Two failures in a row at the current rate drop to a
+ * slower one right away. Rates the receiver is unlikely to decode at the last
+ * seen RSSI are not used.
+ */
+class RateControl
+{
+public:
+	struct Rate {
+		wifi_phy_rate_t phy;
+		const char *name;
+		uint16_t kbps;
+		/** PLCP preamble and header time */
+		uint16_t preamble_us;
+		/** Minimum RSSI to consider the rate, sensitivity plus margin */
+		int8_t min_rssi;
+	};
+	static constexpr size_t RATE_COUNT = 7;
+	static const std::array<Rate, RATE_COUNT> RATES;
+	static constexpr size_t DEFAULT_RATE = 2;
+
+	static constexpr int64_t UPDATE_INTERVAL_US = 100000;
+	static constexpr unsigned SAMPLE_INTERVAL = 8;
+	static constexpr unsigned MAX_CONSECUTIVE_FAILURES = 2;
+	/** Frame size used to compare rates by airtime, our frames are small */
+	static constexpr uint32_t TYPICAL_FRAME_BYTES = 64;
+
+	RateControl();
+
+	/** Returns index of the rate to use for the next frame */
+	size_t select(int64_t now_us);
+	void report(size_t rate, bool ok, int64_t now_us);
+	void rssi(int8_t value);
+
+	struct RateStats {
+		uint16_t prob_permille;
+		uint32_t attempts;
+		uint32_t successes;
+	};
+	size_t current() const { return best; }
+	int8_t last_rssi() const { return rssi_avg; }
+	const RateStats& stats(size_t rate) const { return total[rate]; }
+
+private:
+	struct Window {
+		uint16_t attempts;
+		uint16_t successes;
+	};
+	std::array<Window, RATE_COUNT> window;
+	std::array<RateStats, RATE_COUNT> total;
+	std::array<bool, RATE_COUNT> known;
+
+	size_t best;
+	unsigned frames;
+	unsigned consecutive_failures;
+	int64_t last_update_us;
+	int8_t rssi_avg;
+
+	static uint32_t airtime_us(size_t rate);
+	size_t max_allowed() const;
+	void update();
+	void choose_best();
+};
+
+}
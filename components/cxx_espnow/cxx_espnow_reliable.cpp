@@ -0,0 +1,119 @@
+#include "cxx_espnow_reliable.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+namespace esp_now {
+
+ReliableTx::ReliableTx() :
+	unacked(),
+	next_rseq(0),
+	has_rtt(false),
+	srtt(0),
+	rttvar(0),
+	rto(INITIAL_RTO_US),
+	st()
+{}
+
+ReliableTx::Entry& ReliableTx::push(MessageType type, const void *payload, size_t length,
+		SendCallback&& cb)
+{
+	auto& e = unacked.emplace_back();
+	e.rseq = next_rseq++;
+	e.type = type;
+	e.length = length;
+	memcpy(e.payload.data(), payload, length);
+	e.callback = std::move(cb);
+	e.retries = 0;
+	st.sent++;
+	return e;
+}
+
+void ReliableTx::rtt_sample(int64_t rtt_us)
+{
+	if (rtt_us <= 0)
+		return;
+
+	const uint32_t r = std::min<int64_t>(rtt_us, MAX_RTO_US);
+	if (!has_rtt) {
+		has_rtt = true;
+		srtt = r;
+		rttvar = r / 2;
+	}
+	else {
+		const uint32_t err = std::abs(static_cast<int32_t>(srtt - r));
+		rttvar = (3 * rttvar + err) / 4;
+		srtt = (7 * srtt + r) / 8;
+	}
+	rto = std::clamp<uint32_t>(srtt + 4 * rttvar, MIN_RTO_US, MAX_RTO_US);
+}
+
+ReliableRx::ReliableRx() :
+	ack_pending(false),
+	ack_deadline_us(0),
+	st(),
+	valid(false),
+	epoch(0),
+	base(0),
+	bitmap(0)
+{}
+
+ReliableRx::Result ReliableRx::receive(uint32_t _epoch, uint16_t rseq, uint16_t sender_base)
+{
+	if (!valid || (_epoch != epoch)) {
+		// First message or the sender restarted. Messages before the sender's
+		// base are done with, anything from there on may still be on the way.
+		valid = true;
+		epoch = _epoch;
+		base = sender_base;
+		bitmap = 0;
+	}
+
+	// The sender gave up on messages we haven't seen, stop waiting for them
+	const int16_t skip = static_cast<int16_t>(sender_base - base);
+	if (skip > 0) {
+		if (skip >= static_cast<int16_t>(WINDOW)) {
+			st.skipped += skip - __builtin_popcount(bitmap);
+			bitmap = 0;
+		}
+		else {
+			st.skipped += skip - __builtin_popcount(bitmap & ((1u << skip) - 1));
+			bitmap >>= skip;
+		}
+		base = sender_base;
+		while (bitmap & 1) {
+			bitmap >>= 1;
+			base++;
+		}
+	}
+
+	const int16_t d = static_cast<int16_t>(rseq - base);
+	if (d >= static_cast<int16_t>(WINDOW)) {
+		st.out_of_window++;
+		return Result::OutOfWindow;
+	}
+	if ((d < 0) || (bitmap & (1u << d))) {
+		st.duplicates++;
+		return Result::Duplicate;
+	}
+
+	bitmap |= (1u << d);
+	while (bitmap & 1) {
+		bitmap >>= 1;
+		base++;
+	}
+	st.delivered++;
+	return Result::Deliver;
+}
+
+AckPayload ReliableRx::ack() const
+{
+	return AckPayload {
+		.epoch = epoch,
+		.base = base,
+		.bitmap = bitmap,
+	};
+}
+
+}
@@ -0,0 +1,194 @@
+#pragma once
+
+#include "util_ring.hpp"
+
+#include "cxx_espnow_message.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+namespace esp_now {
+
+/** Prefix of `Reliable` message payload, followed by the wrapped message payload */
+struct ReliableHeader
+{
+	/** Sender session, picked at boot so receivers can tell a restarted peer */
+	uint32_t epoch;
+	uint16_t rseq;
+	/** Oldest message the sender still retransmits, receivers sync their window to it */
+	uint16_t base;
+	MessageType type;
+} __attribute__((packed));
+
+/**
+ * Selective acknowledgement. Everything before `base` has been received, bit
+ * `i` of `bitmap` is set if `base + i` has been received as well.
+ */
+struct AckPayload
+{
+	uint32_t epoch;
+	uint16_t base;
+	uint32_t bitmap;
+} __attribute__((packed));
+
+static constexpr size_t MAX_RELIABLE_PAYLOAD_LENGTH = MAX_PAYLOAD_LENGTH - sizeof(ReliableHeader);
+
+/**
+ * Sender side of the reliable class for a single peer: window of
+ * unacknowledged messages and retransmit timeout estimation (RFC 6298).
+ */
+class ReliableTx
+{
+public:
+	static constexpr size_t WINDOW = 8;
+	static constexpr unsigned MAX_RETRIES = 8;
+	static constexpr uint32_t INITIAL_RTO_US = 100000;
+	static constexpr uint32_t MIN_RTO_US = 30000;
+	static constexpr uint32_t MAX_RTO_US = 1000000;
+
+	struct Entry {
+		uint16_t rseq;
+		MessageType type;
+		uint8_t length;
+		std::array<uint8_t, MAX_RELIABLE_PAYLOAD_LENGTH> payload;
+		SendCallback callback;
+		int64_t first_sent_us;
+		int64_t last_sent_us;
+		uint8_t retries;
+	};
+
+	struct Stats {
+		uint32_t sent = 0;
+		uint32_t retransmits = 0;
+		uint32_t acked = 0;
+		uint32_t gave_up = 0;
+	};
+
+	ReliableTx();
+
+	bool full() const { return unacked.full(); }
+	size_t size() const { return unacked.size(); }
+	/** Sequence number of the oldest unacknowledged message, or the next one */
+	uint16_t base() const { return unacked.empty() ? next_rseq : unacked.front().rseq; }
+	Entry& push(MessageType type, const void *payload, size_t length, SendCallback&& cb);
+
+	/** Calls `completed(Entry&)` for every entry covered by the ack and forgets it */
+	template <typename Fn>
+	void ack(uint16_t base, uint32_t bitmap, int64_t now_us, Fn&& completed)
+	{
+		int64_t rtt_us = 0;
+		size_t i = 0;
+		while (i < unacked.size()) {
+			auto& e = unacked[i];
+			const int16_t d = static_cast<int16_t>(e.rseq - base);
+			const bool acked = (d < 0) || ((d < 32) && (bitmap & (1u << d)));
+			if (!acked) {
+				i++;
+				continue;
+			}
+			// Karn's algorithm: only unambiguous round trips are sampled,
+			// one sample per ack from the most recent message it covers
+			if (!e.retries)
+				rtt_us = now_us - e.first_sent_us;
+			st.acked++;
+			completed(e);
+			unacked.erase(i);
+		}
+		if (rtt_us)
+			rtt_sample(rtt_us);
+	}
+
+	/**
+	 * Calls `retransmit(Entry&)` for entries whose timer expired, returning
+	 * false defers the retransmission. Entries out of retries are passed to
+	 * `give_up(Entry&)` and forgotten. Returns time of the next deadline.
+	 */
+	template <typename Retransmit, typename GiveUp>
+	int64_t poll(int64_t now_us, Retransmit&& retransmit, GiveUp&& give_up)
+	{
+		int64_t next = INT64_MAX;
+		size_t i = 0;
+		while (i < unacked.size()) {
+			auto& e = unacked[i];
+			const int64_t deadline = e.last_sent_us + (int64_t(rto) << std::min<uint8_t>(e.retries, 4));
+			if (deadline > now_us) {
+				next = std::min(next, deadline);
+				i++;
+				continue;
+			}
+			if (e.retries >= MAX_RETRIES) {
+				st.gave_up++;
+				give_up(e);
+				unacked.erase(i);
+				continue;
+			}
+			if (retransmit(e)) {
+				e.retries++;
+				e.last_sent_us = now_us;
+				st.retransmits++;
+			}
+			next = std::min(next, now_us + rto);
+			i++;
+		}
+		return next;
+	}
+
+	void rtt_sample(int64_t rtt_us);
+	uint32_t rto_us() const { return rto; }
+	uint32_t srtt_us() const { return srtt; }
+	const Stats& stats() const { return st; }
+
+private:
+	RingBuffer<Entry, WINDOW> unacked;
+	uint16_t next_rseq;
+	bool has_rtt;
+	uint32_t srtt;
+	uint32_t rttvar;
+	uint32_t rto;
+	Stats st;
+};
+
+/**
+ * Receiver side of the reliable class for a single peer: duplicate
+ * suppression and acknowledgement state. Messages are delivered as they
+ * arrive, not reordered.
+ */
+class ReliableRx
+{
+public:
+	static constexpr size_t WINDOW = 32;
+
+	enum class Result {
+		Deliver,
+		Duplicate,
+		OutOfWindow,
+	};
+
+	struct Stats {
+		uint32_t delivered = 0;
+		uint32_t duplicates = 0;
+		uint32_t out_of_window = 0;
+		/** Messages the sender gave up on before they got here */
+		uint32_t skipped = 0;
+		uint32_t acks_sent = 0;
+	};
+
+	ReliableRx();
+
+	/** `sender_base` is the sender's `ReliableTx::base()` when it sent `rseq` */
+	Result receive(uint32_t epoch, uint16_t rseq, uint16_t sender_base);
+	AckPayload ack() const;
+
+	bool ack_pending;
+	int64_t ack_deadline_us;
+	Stats st;
+
+private:
+	bool valid;
+	uint32_t epoch;
+	uint16_t base;
+	uint32_t bitmap;
+};
+
+}
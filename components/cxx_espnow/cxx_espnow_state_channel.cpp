@@ -0,0 +1,149 @@
+#include "cxx_espnow_state_channel.hpp"
+#include "cxx_espnow.hpp"
+
+#include "esp_log.h"
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+
+#define TAG "espnow"
+
+namespace esp_now {
+
+StateChannelBase::StateChannelBase(
+		ESPNow& _transport,
+		const PeerAddress& peer,
+		MessageType type,
+		size_t _length,
+		milliseconds _min_interval,
+		milliseconds _heartbeat) :
+	Lockable("state_channel"),
+	transport(_transport),
+	peer_addr(peer),
+	msg_type(type),
+	length(_length),
+	min_interval(_min_interval),
+	heartbeat(_heartbeat),
+	payload(),
+	valid(false),
+	dirty(false),
+	in_flight(false),
+	dirty_since(),
+	pending_since(),
+	last_send(),
+	st()
+{
+	if (length > MAX_PAYLOAD_LENGTH)
+		throw std::invalid_argument("StateChannel: Payload too long");
+}
+
+const PeerAddress& StateChannelBase::peer() const
+{
+	return peer_addr;
+}
+
+MessageType StateChannelBase::type() const
+{
+	return msg_type;
+}
+
+StateChannelBase::Stats StateChannelBase::stats() const
+{
+	const auto lock = take_shared_lock();
+	return st;
+}
+
+std::string StateChannelBase::to_string() const
+{
+	const auto s = stats();
+	std::ostringstream ss;
+	ss << "StateChannel[peer:" << peer_addr <<
+		", type:" << static_cast<unsigned>(msg_type) <<
+		", interval:" << min_interval.count() << "/" << heartbeat.count() << "ms]" <<
+		" updates " << s.updates <<
+		", coalesced " << s.coalesced <<
+		", sent " << s.sent_change << "+" << s.sent_heartbeat << " hb" <<
+		", ok " << s.ok <<
+		", failed " << s.failed <<
+		", dropped " << s.dropped <<
+		", age " << s.age_last.count() << "ms (max " << s.age_max.count() << "ms)";
+	return ss.str();
+}
+
+void StateChannelBase::set_raw(const void *data, std::optional<bool> changed)
+{
+	bool wake = false;
+	{
+		const auto lock = take_unique_lock();
+		const bool is_changed = changed.value_or(
+				!valid || memcmp(payload.data(), data, length) != 0);
+		memcpy(payload.data(), data, length);
+		valid = true;
+		st.updates++;
+		if (is_changed) {
+			if (dirty) {
+				st.coalesced++;
+			}
+			else {
+				dirty = true;
+				dirty_since = time_now();
+				wake = !in_flight;
+			}
+		}
+	}
+	if (wake)
+		transport.wake();
+}
+
+milliseconds StateChannelBase::service(time_point now)
+{
+	const auto lock = take_unique_lock();
+	if (!valid || in_flight)
+		return heartbeat;
+
+	const auto since_last = now - last_send;
+	const bool send_change = dirty && (since_last >= min_interval);
+	if (!send_change && (since_last < heartbeat))
+		return (dirty ? min_interval : heartbeat) - since_last;
+
+	try {
+		transport.send(peer_addr, msg_type, payload.data(), length,
+				[this](SendResult result) { handle_sent(result); });
+	}
+	catch (const std::exception& e) {
+		ESP_LOGD(TAG, "state channel %u send failed: %s", msg_type, e.what());
+		st.dropped++;
+		return min_interval;
+	}
+
+	if (send_change)
+		st.sent_change++;
+	else
+		st.sent_heartbeat++;
+	pending_since = dirty ? dirty_since : now;
+	dirty = false;
+	in_flight = true;
+	last_send = now;
+	return heartbeat;
+}
+
+void StateChannelBase::handle_sent(SendResult result)
+{
+	const auto lock = take_unique_lock();
+	in_flight = false;
+	if (!result) {
+		st.failed++;
+		// Newest value has to be delivered again, keep the oldest change time
+		if (!dirty || pending_since < dirty_since)
+			dirty_since = pending_since;
+		dirty = true;
+		return;
+	}
+
+	st.ok++;
+	st.age_last = std::chrono::duration_cast<milliseconds>(time_now() - pending_since);
+	st.age_max = std::max(st.age_max, st.age_last);
+}
+
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "util_lockable.hpp"
+#include "util_time.hpp"
+
+#include "cxx_espnow_message.hpp"
+#include "cxx_espnow_peer.hpp"
+
+#include <array>
+#include <optional>
+#include <string>
+
+namespace esp_now {
+
+class ESPNow;
+
+/**
+ * Latest-value channel for periodically published state.
+ *
+ * Holds only the newest payload for a (peer, message type) pair. The ESP-NOW
+ * task sends it when it changes, but not more often than `min_interval`, and
+ * repeats it every `heartbeat` when idle. At most one frame per channel is in
+ * flight, so a stale state never sits in the transmit queue behind a fresh
+ * one.
+ *
+ * Channels are owned by the transport, create them with
+ * `ESPNow::state_channel()`.
+ */
+class StateChannelBase :
+	private Lockable<>
+{
+public:
+	StateChannelBase(
+			ESPNow& transport,
+			const PeerAddress& peer,
+			MessageType type,
+			size_t length,
+			milliseconds min_interval,
+			milliseconds heartbeat);
+	StateChannelBase(const StateChannelBase&) = delete;
+	virtual ~StateChannelBase() = default;
+
+	const PeerAddress& peer() const;
+	MessageType type() const;
+
+	struct Stats {
+		uint32_t updates = 0;
+		uint32_t coalesced = 0;
+		uint32_t sent_change = 0;
+		uint32_t sent_heartbeat = 0;
+		uint32_t ok = 0;
+		uint32_t failed = 0;
+		uint32_t dropped = 0;
+		milliseconds age_last = 0ms;
+		milliseconds age_max = 0ms;
+	};
+	Stats stats() const;
+	std::string to_string() const;
+
+protected:
+	/**
+	 * Store new payload. If `changed` is not given, it is detected by
+	 * comparing with the previous payload.
+	 */
+	void set_raw(const void *data, std::optional<bool> changed);
+
+private:
+	ESPNow& transport;
+	const PeerAddress peer_addr;
+	const MessageType msg_type;
+	const size_t length;
+	const milliseconds min_interval;
+	const milliseconds heartbeat;
+
+	std::array<uint8_t, MAX_PAYLOAD_LENGTH> payload;
+	bool valid;
+	bool dirty;
+	bool in_flight;
+	time_point dirty_since;
+	time_point pending_since;
+	time_point last_send;
+	Stats st;
+
+	/** Send if due, returns time until the channel needs servicing again */
+	milliseconds service(time_point now);
+	void handle_sent(SendResult result);
+
+	friend class ESPNow;
+};
+
+template <typename MessageT>
+class StateChannel :
+	public StateChannelBase
+{
+public:
+	using Payload = typename MessageT::payload_type;
+
+	StateChannel(ESPNow& transport, const PeerAddress& peer,
+			milliseconds min_interval, milliseconds heartbeat) :
+		StateChannelBase(transport, peer, MessageT::type, sizeof(Payload),
+				min_interval, heartbeat)
+	{}
+
+	/** Update state, change is detected by comparing payload bytes */
+	void set(const Payload& data)
+	{
+		set_raw(&data, std::nullopt);
+	}
+
+	/** Update state, caller decides whether it's worth sending right away */
+	void set(const Payload& data, bool changed)
+	{
+		set_raw(&data, changed);
+	}
+};
+
+}
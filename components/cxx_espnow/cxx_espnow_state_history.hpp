@@ -0,0 +1,154 @@
+#pragma once
+
+#include "util_time.hpp"
+
+#include "cxx_espnow_state_channel.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+
+namespace esp_now {
+
+/**
+ * Payload carrying the last `N` distinct states of a sender, newest first.
+ * `states[i]` has sequence number `seq - i`, only the first `count` are
+ * valid. A receiver that missed frames replays the states it hasn't seen
+ * yet, so a short transition (e.g. a button tap) survives the loss of the
+ * frame that carried it.
+ */
+template <typename State, size_t N>
+struct StateHistory
+{
+	using state_type = State;
+	static constexpr size_t depth = N;
+
+	uint16_t seq;
+	uint8_t count;
+	State states[N];
+} __attribute__((packed));
+
+/**
+ * State channel that sends each state together with the ones before it.
+ * Every call to set() with a state different from the previous one gets a
+ * new sequence number, including states that get coalesced before they
+ * could be sent on their own. Those are counted in `stats().coalesced` and
+ * reach the receiver from the history like the ones of lost frames do.
+ */
+template <typename MessageT>
+class StateHistoryChannel :
+	public StateChannelBase
+{
+public:
+	using Payload = typename MessageT::payload_type;
+	using State = typename Payload::state_type;
+
+	StateHistoryChannel(ESPNow& transport, const PeerAddress& peer,
+			milliseconds min_interval, milliseconds heartbeat) :
+		StateChannelBase(transport, peer, MessageT::type, sizeof(Payload),
+				min_interval, heartbeat),
+		history_lock(),
+		history()
+	{}
+
+	/** Record new state, unchanged ones are only repeated by the heartbeat */
+	void set(const State& st)
+	{
+		std::lock_guard<std::mutex> lock(history_lock);
+		if (history.count && (memcmp(&history.states[0], &st, sizeof(State)) == 0))
+			return;
+		memmove(&history.states[1], &history.states[0], sizeof(State) * (Payload::depth - 1));
+		history.states[0] = st;
+		history.seq++;
+		history.count = std::min<size_t>(history.count + 1, Payload::depth);
+		set_raw(&history, true);
+	}
+
+private:
+	std::mutex history_lock;
+	Payload history;
+};
+
+/**
+ * Receiving end of a `StateHistoryChannel`: picks out the states not seen
+ * yet from each payload.
+ *
+ * States the sender coalesced never had a frame of their own, so from here
+ * they look the same as states whose frame got lost. The stats count both,
+ * compare with the sender's `coalesced` to tell how many frames got lost.
+ */
+template <typename Payload>
+class StateHistoryReceiver
+{
+public:
+	using State = typename Payload::state_type;
+
+	/** A jump past the history after this long without frames is a restart */
+	static constexpr milliseconds RESYNC_SILENCE = 1s;
+
+	struct Stats {
+		/** States applied, including replayed ones */
+		uint32_t applied = 0;
+		/** States applied from the history instead of the frame carrying them */
+		uint32_t replayed = 0;
+		/** States that fell out of the history before a frame got through */
+		uint32_t skipped = 0;
+		/** Heartbeats and repeated frames with nothing new */
+		uint32_t duplicates = 0;
+		uint32_t resyncs = 0;
+	};
+
+	/**
+	 * Call `apply(const State&)` for every state newer than the last one
+	 * applied, oldest first. Returns number of states applied.
+	 */
+	template <typename Fn>
+	size_t receive(const Payload& h, Fn&& apply)
+	{
+		if (!h.count)
+			return 0;
+
+		const auto now = time_now();
+		const auto silence = now - last_rx;
+		last_rx = now;
+
+		const int16_t d = static_cast<int16_t>(h.seq - last_seq);
+		if (synced && (d == 0)) {
+			st.duplicates++;
+			return 0;
+		}
+
+		size_t n = 1;
+		// A sender that restarted may come back anywhere in the sequence
+		// space, a long jump forward included
+		const bool restarted = (d < 0) ||
+			((d > static_cast<int16_t>(Payload::depth)) && (silence >= RESYNC_SILENCE));
+		if (!synced || restarted) {
+			// First frame or the sender restarted, only the newest state counts
+			if (synced)
+				st.resyncs++;
+			synced = true;
+		}
+		else {
+			n = std::min<size_t>(d, h.count);
+			st.skipped += d - n;
+			st.replayed += n - 1;
+		}
+
+		last_seq = h.seq;
+		st.applied += n;
+		for (size_t i = n; i-- > 0;)
+			apply(h.states[i]);
+		return n;
+	}
+
+	const Stats& stats() const { return st; }
+
+private:
+	bool synced = false;
+	uint16_t last_seq = 0;
+	time_point last_rx;
+	Stats st;
+};
+
+}
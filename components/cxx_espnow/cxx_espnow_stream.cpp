@@ -0,0 +1,208 @@
+#include "cxx_espnow_stream.hpp"
+#include "cxx_espnow.hpp"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+
+#define TAG "espnow"
+
+namespace esp_now {
+
+Stream::Stream(ESPNow& _transport, const PeerAddress& peer, StreamId id, uint32_t epoch) :
+	transport(_transport),
+	peer_addr(peer),
+	stream_id(id),
+	mutex(),
+	writable(),
+	readable(),
+	tx(epoch),
+	rx(),
+	tx_queue_full(0)
+{}
+
+const PeerAddress& Stream::peer() const
+{
+	return peer_addr;
+}
+
+StreamId Stream::id() const
+{
+	return stream_id;
+}
+
+template <typename Predicate>
+bool Stream::wait(std::condition_variable& cv, std::unique_lock<std::mutex>& lock,
+		milliseconds timeout, Predicate&& pred)
+{
+	if (timeout == milliseconds::max()) {
+		cv.wait(lock, pred);
+		return true;
+	}
+	return cv.wait_for(lock, timeout, pred);
+}
+
+size_t Stream::write(const void *data, size_t length, milliseconds timeout)
+{
+	const auto *p = static_cast<const uint8_t *>(data);
+	const auto start = time_now();
+	size_t written = 0;
+	std::unique_lock<std::mutex> lock(mutex);
+	while (1) {
+		const auto n = tx.write(p + written, length - written);
+		written += n;
+		if (n)
+			transport.wake();
+		if (written == length)
+			break;
+
+		const auto left = (timeout == milliseconds::max())
+			? timeout
+			: timeout - std::chrono::duration_cast<milliseconds>(time_now() - start);
+		if ((left <= 0ms) || !wait(writable, lock, left, [this] { return tx.writable() > 0; }))
+			break;
+	}
+	return written;
+}
+
+size_t Stream::read(void *data, size_t length, milliseconds timeout)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	if (!wait(readable, lock, timeout, [this] { return rx.available() > 0; }))
+		return 0;
+
+	const auto window = rx.window();
+	const auto n = rx.read(data, length);
+	// Reopen a nearly closed window right away, the sender may be stalled
+	if ((window <= StreamRx::WINDOW / 4) && (rx.window() >= StreamRx::WINDOW / 2))
+		send_ack(esp_timer_get_time());
+	return n;
+}
+
+size_t Stream::available() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return rx.available();
+}
+
+bool Stream::flush(milliseconds timeout)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	return wait(writable, lock, timeout, [this] { return tx.idle(); });
+}
+
+Stream::Stats Stream::stats() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return Stats {
+		.tx = tx.stats(),
+		.rx = rx.st,
+		.tx_queue_full = tx_queue_full,
+		.rto_us = tx.rto_us(),
+		.srtt_us = tx.srtt_us(),
+		.peer_window = tx.window(),
+		.window = rx.window(),
+	};
+}
+
+std::string Stream::to_string() const
+{
+	const auto s = stats();
+	std::ostringstream ss;
+	ss << "Stream[peer:" << peer_addr <<
+		", id:" << static_cast<unsigned>(stream_id) << "]" <<
+		" tx " << s.tx.bytes_written << "B written, " << s.tx.bytes_acked << "B acked" <<
+		", segments " << s.tx.segments_sent <<
+		", retransmits " << s.tx.retransmits << " (" << s.tx.fast_retransmits << " fast)" <<
+		", stalls " << s.tx.window_stalls <<
+		", queue full " << s.tx_queue_full <<
+		", rtt " << s.srtt_us << "us, rto " << s.rto_us << "us" <<
+		", window " << static_cast<unsigned>(s.peer_window) <<
+		"; rx " << s.rx.bytes_received << "B received, " << s.rx.bytes_read << "B read" <<
+		", out of order " << s.rx.out_of_order <<
+		", duplicates " << s.rx.duplicates <<
+		", out of window " << s.rx.out_of_window <<
+		", window " << static_cast<unsigned>(s.window);
+	return ss.str();
+}
+
+bool Stream::transmit(const StreamTx::Segment& segment)
+{
+	// Bulk data must not crowd control messages out of the queue
+	if (transport.tx_queue_room(peer_addr) <= TX_QUEUE_RESERVE) {
+		tx_queue_full++;
+		return false;
+	}
+
+	std::array<uint8_t, MAX_PAYLOAD_LENGTH> payload;
+	const StreamDataHeader header = {
+		.stream = stream_id,
+		.epoch = tx.epoch(),
+		.seq = segment.seq,
+		.base = tx.base(),
+	};
+	memcpy(payload.data(), &header, sizeof(header));
+	memcpy(payload.data() + sizeof(header), segment.data.data(), segment.length);
+	try {
+		transport.send(peer_addr, MessageId::StreamData, payload.data(),
+				sizeof(header) + segment.length);
+	}
+	catch (const std::exception& e) {
+		ESP_LOGD(TAG, "stream %u send failed: %s", stream_id, e.what());
+		tx_queue_full++;
+		return false;
+	}
+	return true;
+}
+
+void Stream::send_ack(int64_t now_us)
+{
+	const auto ack = rx.ack(stream_id);
+	try {
+		transport.send(peer_addr, MessageId::StreamAck, &ack, sizeof(ack));
+	}
+	catch (const std::exception& e) {
+		ESP_LOGD(TAG, "stream %u ack failed: %s", stream_id, e.what());
+		rx.ack_defer(now_us);
+		return;
+	}
+	rx.ack_sent();
+}
+
+milliseconds Stream::service(int64_t now_us)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (rx.ack_pending && (now_us >= rx.ack_deadline_us))
+		send_ack(now_us);
+
+	auto next = tx.poll(now_us, [this](const StreamTx::Segment& s) { return transmit(s); });
+	if (rx.ack_pending)
+		next = std::min(next, rx.ack_deadline_us);
+	if (next == INT64_MAX)
+		return milliseconds::max();
+	return std::chrono::duration_cast<milliseconds>(
+			std::chrono::microseconds(std::max<int64_t>(0, next - now_us)));
+}
+
+void Stream::handle_data(const StreamDataHeader& header, const uint8_t *data, size_t length)
+{
+	const auto now = esp_timer_get_time();
+	std::lock_guard<std::mutex> lock(mutex);
+	const auto result = rx.receive(header.epoch, header.seq, header.base, data, length);
+	if (result == StreamRx::Result::InOrder)
+		readable.notify_all();
+	if (rx.ack_now(result, now))
+		send_ack(now);
+}
+
+void Stream::handle_ack(const StreamAckPayload& ack)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	tx.ack(ack, esp_timer_get_time());
+	writable.notify_all();
+}
+
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "util_time.hpp"
+
+#include "cxx_espnow_peer.hpp"
+#include "cxx_espnow_stream_window.hpp"
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+
+namespace esp_now {
+
+class ESPNow;
+
+/**
+ * Ordered, reliable byte stream to a peer, for data that doesn't fit in one
+ * frame.
+ *
+ * Writes are cut into segments of up to STREAM_SEGMENT_LENGTH bytes, up to
+ * StreamTx::WINDOW of them are in flight at once and lost ones are
+ * retransmitted. The receiver reassembles them and holds data until it is
+ * read. A slow reader closes the window, which in turn blocks write() on the
+ * sending side. Both sides of a stream use the same (peer, id) pair, and each
+ * can write and read.
+ *
+ * Streams are owned by the transport, create them with `ESPNow::stream()`.
+ */
+class Stream
+{
+public:
+	Stream(ESPNow& transport, const PeerAddress& peer, StreamId id, uint32_t epoch);
+	Stream(const Stream&) = delete;
+
+	const PeerAddress& peer() const;
+	StreamId id() const;
+
+	/**
+	 * Queue `length` bytes, waiting up to `timeout` while the send buffer is
+	 * full. Returns number of bytes queued.
+	 */
+	size_t write(const void *data, size_t length, milliseconds timeout = milliseconds::max());
+
+	/**
+	 * Read up to `length` bytes, waiting up to `timeout` for any to arrive.
+	 * Returns number of bytes read, 0 on timeout.
+	 */
+	size_t read(void *data, size_t length, milliseconds timeout = milliseconds::max());
+
+	/** Bytes that can be read without waiting */
+	size_t available() const;
+
+	/** Wait up to `timeout` until everything written has been acknowledged */
+	bool flush(milliseconds timeout = milliseconds::max());
+
+	struct Stats {
+		StreamTx::Stats tx;
+		StreamRx::Stats rx;
+		uint32_t tx_queue_full = 0;
+		uint32_t rto_us = 0;
+		uint32_t srtt_us = 0;
+		uint8_t peer_window = 0;
+		uint8_t window = 0;
+	};
+	Stats stats() const;
+	std::string to_string() const;
+
+private:
+	/** Transmit queue slots to the peer left for other messages */
+	static constexpr size_t TX_QUEUE_RESERVE = 2;
+
+	ESPNow& transport;
+	const PeerAddress peer_addr;
+	const StreamId stream_id;
+
+	mutable std::mutex mutex;
+	std::condition_variable writable;
+	std::condition_variable readable;
+	StreamTx tx;
+	StreamRx rx;
+	uint32_t tx_queue_full;
+
+	template <typename Predicate>
+	bool wait(std::condition_variable& cv, std::unique_lock<std::mutex>& lock,
+			milliseconds timeout, Predicate&& pred);
+	bool transmit(const StreamTx::Segment& segment);
+	void send_ack(int64_t now_us);
+
+	/** Called by the ESP-NOW task, returns time until the stream needs servicing again */
+	milliseconds service(int64_t now_us);
+	void handle_data(const StreamDataHeader& header, const uint8_t *data, size_t length);
+	void handle_ack(const StreamAckPayload& ack);
+
+	friend class ESPNow;
+};
+
+}
@@ -0,0 +1,262 @@
+#include "cxx_espnow_stream_window.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+namespace esp_now {
+
+StreamTx::StreamTx(uint32_t epoch) :
+	segments(),
+	session(epoch),
+	next_seq(0),
+	peer_window(StreamRx::WINDOW),
+	last_ack_us(0),
+	stalled(false),
+	has_rtt(false),
+	srtt(0),
+	rttvar(0),
+	rto(INITIAL_RTO_US),
+	st()
+{}
+
+size_t StreamTx::write(const void *data, size_t length)
+{
+	const auto *p = static_cast<const uint8_t *>(data);
+	size_t written = 0;
+	while (written < length) {
+		// Top up the last segment as long as it hasn't gone out
+		if (segments.empty() || segments.back().sent_us ||
+				(segments.back().length == STREAM_SEGMENT_LENGTH)) {
+			if (segments.full())
+				break;
+			auto& s = segments.emplace_back();
+			s.seq = next_seq++;
+		}
+		auto& s = segments.back();
+		const size_t n = std::min(length - written, STREAM_SEGMENT_LENGTH - s.length);
+		memcpy(s.data.data() + s.length, p + written, n);
+		s.length += n;
+		written += n;
+	}
+	st.bytes_written += written;
+	return written;
+}
+
+size_t StreamTx::writable() const
+{
+	size_t n = (WINDOW - segments.size()) * STREAM_SEGMENT_LENGTH;
+	if (!segments.empty() && !segments.back().sent_us)
+		n += STREAM_SEGMENT_LENGTH - segments.back().length;
+	return n;
+}
+
+void StreamTx::ack(const StreamAckPayload& ack, int64_t now_us)
+{
+	if (ack.epoch != session)
+		return;
+
+	st.acks++;
+	last_ack_us = now_us;
+	peer_window = ack.window;
+
+	// Karn's algorithm: only segments sent once give a round trip sample,
+	// one sample per ack from the most recent segment it covers
+	int64_t rtt_us = 0;
+	while (!segments.empty() && segments.front().sent_us &&
+			(static_cast<int16_t>(segments.front().seq - ack.next) < 0)) {
+		const auto& s = segments.front();
+		if (!s.retries && !s.sacked)
+			rtt_us = now_us - s.sent_us;
+		st.bytes_acked += s.length;
+		segments.pop_front();
+	}
+
+	for (size_t i = 0; i < segments.size(); i++) {
+		auto& s = segments[i];
+		const int16_t d = static_cast<int16_t>(s.seq - ack.next) - 1;
+		if (!s.sent_us || s.sacked || (d < 0) || (d >= 32) || !(ack.sack & (1u << d)))
+			continue;
+		if (!s.retries)
+			rtt_us = now_us - s.sent_us;
+		s.sacked = true;
+	}
+
+	// A hole is lost once enough segments sent after it made it through
+	unsigned above = 0;
+	int64_t above_sent_us = 0;
+	for (size_t i = segments.size(); i-- > 0;) {
+		auto& s = segments[i];
+		if (s.sacked) {
+			above++;
+			above_sent_us = std::max(above_sent_us, s.sent_us);
+		}
+		else if (s.sent_us && (above >= DUP_THRESHOLD) && (s.sent_us < above_sent_us)) {
+			s.lost = true;
+		}
+	}
+
+	if (rtt_us)
+		rtt_sample(rtt_us);
+}
+
+void StreamTx::rtt_sample(int64_t rtt_us)
+{
+	if (rtt_us <= 0)
+		return;
+
+	const uint32_t r = std::min<int64_t>(rtt_us, MAX_RTO_US);
+	if (!has_rtt) {
+		has_rtt = true;
+		srtt = r;
+		rttvar = r / 2;
+	}
+	else {
+		const uint32_t err = std::abs(static_cast<int32_t>(srtt - r));
+		rttvar = (3 * rttvar + err) / 4;
+		srtt = (7 * srtt + r) / 8;
+	}
+	// Round trips vary with the queue depth in front of each segment, keep
+	// some margin when the variance estimate settles
+	rto = std::clamp<uint32_t>(srtt + std::max(4 * rttvar, srtt / 2), MIN_RTO_US, MAX_RTO_US);
+}
+
+StreamRx::StreamRx() :
+	ack_pending(false),
+	ack_deadline_us(0),
+	st(),
+	slots(),
+	synced(false),
+	session(0),
+	base(0),
+	next(0),
+	offset(0),
+	ready(0),
+	unacked(0),
+	hole(false)
+{}
+
+StreamRx::Result StreamRx::receive(uint32_t epoch, uint16_t seq, uint16_t sender_base,
+		const uint8_t *data, size_t length)
+{
+	if (!synced || (epoch != session)) {
+		// First segment or the sender restarted, unread data is gone. Start
+		// at the sender's base, earlier segments may have been lost.
+		synced = true;
+		session = epoch;
+		base = next = sender_base;
+		offset = 0;
+		ready = 0;
+		for (auto& s : slots)
+			s.valid = false;
+	}
+
+	const int16_t d = static_cast<int16_t>(seq - base);
+	if (d >= static_cast<int16_t>(WINDOW)) {
+		st.out_of_window++;
+		return Result::OutOfWindow;
+	}
+	if ((static_cast<int16_t>(seq - next) < 0) || slot(seq).valid) {
+		st.duplicates++;
+		return Result::Duplicate;
+	}
+
+	auto& s = slot(seq);
+	s.valid = true;
+	s.length = length;
+	memcpy(s.data.data(), data, length);
+	st.segments++;
+	st.bytes_received += length;
+
+	if (seq != next) {
+		st.out_of_order++;
+		return Result::OutOfOrder;
+	}
+	while ((static_cast<uint16_t>(next - base) < WINDOW) && slot(next).valid) {
+		ready += slot(next).length;
+		next++;
+	}
+	return Result::InOrder;
+}
+
+size_t StreamRx::read(void *data, size_t length)
+{
+	auto *p = static_cast<uint8_t *>(data);
+	size_t n = 0;
+	while ((n < length) && (base != next)) {
+		auto& s = slot(base);
+		const size_t chunk = std::min(length - n, s.length - offset);
+		memcpy(p + n, s.data.data() + offset, chunk);
+		n += chunk;
+		offset += chunk;
+		if (offset == s.length) {
+			s.valid = false;
+			offset = 0;
+			base++;
+		}
+	}
+	ready -= n;
+	st.bytes_read += n;
+	return n;
+}
+
+uint8_t StreamRx::window() const
+{
+	return WINDOW - static_cast<uint16_t>(next - base);
+}
+
+bool StreamRx::ack_now(Result result, int64_t now_us)
+{
+	// Duplicates and a full window mean the sender is missing an ack. A hole
+	// is reported at the first segment past it, further ones are paced like
+	// in-order segments.
+	if ((result == Result::Duplicate) || (result == Result::OutOfWindow))
+		return true;
+	if ((result == Result::OutOfOrder) && !hole) {
+		hole = true;
+		return true;
+	}
+	if (result == Result::InOrder)
+		hole = false;
+	if (++unacked >= ACK_EVERY)
+		return true;
+	if (!ack_pending) {
+		ack_pending = true;
+		ack_deadline_us = now_us + ACK_DELAY_US;
+	}
+	return false;
+}
+
+void StreamRx::ack_sent()
+{
+	st.acks_sent++;
+	ack_pending = false;
+	unacked = 0;
+}
+
+void StreamRx::ack_defer(int64_t now_us)
+{
+	ack_pending = true;
+	ack_deadline_us = now_us + ACK_DELAY_US;
+}
+
+StreamAckPayload StreamRx::ack(StreamId stream) const
+{
+	uint32_t sack = 0;
+	for (size_t i = 0; i < 32; i++) {
+		const uint16_t seq = next + 1 + i;
+		if (static_cast<uint16_t>(seq - base) >= WINDOW)
+			break;
+		if (slot(seq).valid)
+			sack |= (1u << i);
+	}
+	return StreamAckPayload {
+		.stream = stream,
+		.epoch = session,
+		.next = next,
+		.sack = sack,
+		.window = window(),
+	};
+}
+
+}
@@ -0,0 +1,257 @@
+#pragma once
+
+#include "util_ring.hpp"
+
+#include "cxx_espnow_message.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+namespace esp_now {
+
+using StreamId = uint8_t;
+
+/** Prefix of `StreamData` payload, followed by segment data */
+struct StreamDataHeader
+{
+	StreamId stream;
+	/** Sender session, picked at boot so receivers can tell a restarted peer */
+	uint32_t epoch;
+	uint16_t seq;
+	/** Oldest segment the sender hasn't seen acknowledged, receivers start there */
+	uint16_t base;
+} __attribute__((packed));
+
+/**
+ * Cumulative and selective acknowledgement of stream segments. Everything
+ * before `next` has been received, bit `i` of `sack` is set if `next + 1 + i`
+ * has been received as well. The receiver has room for `window` segments
+ * starting at `next`.
+ */
+struct StreamAckPayload
+{
+	StreamId stream;
+	uint32_t epoch;
+	uint16_t next;
+	uint32_t sack;
+	uint8_t window;
+} __attribute__((packed));
+
+static constexpr size_t STREAM_SEGMENT_LENGTH = MAX_PAYLOAD_LENGTH - sizeof(StreamDataHeader);
+
+/**
+ * Sender side of a byte stream: segmentation, window of segments in flight,
+ * retransmission on timeout (RFC 6298) or when later segments got selectively
+ * acknowledged.
+ */
+class StreamTx
+{
+public:
+	/** Segments buffered by the sender, acknowledged or not */
+	static constexpr size_t WINDOW = 32;
+	/** Later segments acknowledged before an earlier one is deemed lost */
+	static constexpr unsigned DUP_THRESHOLD = 3;
+	static constexpr uint32_t INITIAL_RTO_US = 200000;
+	static constexpr uint32_t MIN_RTO_US = 30000;
+	static constexpr uint32_t MAX_RTO_US = 2000000;
+
+	struct Segment {
+		uint16_t seq;
+		uint8_t length;
+		std::array<uint8_t, STREAM_SEGMENT_LENGTH> data;
+		/** Time of the last transmission, 0 if not sent yet */
+		int64_t sent_us;
+		uint8_t retries;
+		bool sacked;
+		bool lost;
+	};
+
+	struct Stats {
+		uint32_t bytes_written = 0;
+		uint32_t bytes_acked = 0;
+		uint32_t segments_sent = 0;
+		uint32_t retransmits = 0;
+		uint32_t fast_retransmits = 0;
+		uint32_t window_stalls = 0;
+		uint32_t acks = 0;
+	};
+
+	explicit StreamTx(uint32_t epoch);
+
+	/** Buffer up to `length` bytes, returns how many fit */
+	size_t write(const void *data, size_t length);
+	/** Bytes write() would take right now */
+	size_t writable() const;
+	/** Everything written has been acknowledged */
+	bool idle() const { return segments.empty(); }
+
+	void ack(const StreamAckPayload& ack, int64_t now_us);
+
+	/**
+	 * Calls `transmit(const Segment&)` for segments that are due, lost ones
+	 * first in sequence order, then new ones the receiver has room for.
+	 * Returning false stops, the segment is offered again on the next poll.
+	 * A partly filled last segment waits until everything before it has been
+	 * acknowledged, so small writes coalesce. Returns time of the next
+	 * retransmission deadline.
+	 */
+	template <typename Fn>
+	int64_t poll(int64_t now_us, Fn&& transmit)
+	{
+		int64_t next = INT64_MAX;
+		for (size_t i = 0; i < segments.size(); i++) {
+			auto& s = segments[i];
+			if (s.sacked)
+				continue;
+
+			if (!s.sent_us) {
+				// Receiver buffer is full: probe with one segment after a
+				// timeout in case the window update got lost
+				const bool probe = (i == 0) && (now_us - last_ack_us >= rto);
+				if ((i >= peer_window) && !probe) {
+					if (!stalled)
+						st.window_stalls++;
+					stalled = true;
+					next = std::min(next, last_ack_us + rto);
+					break;
+				}
+				if ((s.length < STREAM_SEGMENT_LENGTH) && (i > 0))
+					break;
+				stalled = false;
+				if (!transmit(static_cast<const Segment&>(s)))
+					break;
+				s.sent_us = now_us;
+				st.segments_sent++;
+				next = std::min(next, now_us + rto);
+				continue;
+			}
+
+			const int64_t deadline = s.sent_us + (int64_t(rto) << std::min<uint8_t>(s.retries, 4));
+			if (!s.lost && (deadline > now_us)) {
+				next = std::min(next, deadline);
+				continue;
+			}
+			if (!transmit(static_cast<const Segment&>(s)))
+				break;
+			if (s.lost)
+				st.fast_retransmits++;
+			st.retransmits++;
+			s.lost = false;
+			s.retries = std::min<unsigned>(s.retries + 1, UINT8_MAX);
+			s.sent_us = now_us;
+			next = std::min(next, now_us + (int64_t(rto) << std::min<uint8_t>(s.retries, 4)));
+		}
+		return next;
+	}
+
+	uint32_t epoch() const { return session; }
+	/** Sequence number of the oldest unacknowledged segment, or the next one */
+	uint16_t base() const { return segments.empty() ? next_seq : segments.front().seq; }
+	uint8_t window() const { return peer_window; }
+	uint32_t rto_us() const { return rto; }
+	uint32_t srtt_us() const { return srtt; }
+	const Stats& stats() const { return st; }
+
+private:
+	/** Unacknowledged and unsent segments in sequence order */
+	RingBuffer<Segment, WINDOW> segments;
+	const uint32_t session;
+	uint16_t next_seq;
+	uint8_t peer_window;
+	int64_t last_ack_us;
+	bool stalled;
+	bool has_rtt;
+	uint32_t srtt;
+	uint32_t rttvar;
+	uint32_t rto;
+	Stats st;
+
+	void rtt_sample(int64_t rtt_us);
+};
+
+/**
+ * Receiver side of a byte stream: reassembly of segments in a fixed window
+ * and the read buffer. The window only advances as the reader consumes data,
+ * which is how the sender is held back.
+ */
+class StreamRx
+{
+public:
+	static constexpr size_t WINDOW = 32;
+	/** Acks wait this long for more segments, unless ACK_EVERY arrived */
+	static constexpr int64_t ACK_DELAY_US = 10000;
+	static constexpr uint8_t ACK_EVERY = 4;
+
+	enum class Result {
+		InOrder,
+		OutOfOrder,
+		Duplicate,
+		OutOfWindow,
+	};
+
+	struct Stats {
+		uint32_t bytes_received = 0;
+		uint32_t bytes_read = 0;
+		uint32_t segments = 0;
+		uint32_t out_of_order = 0;
+		uint32_t duplicates = 0;
+		uint32_t out_of_window = 0;
+		uint32_t acks_sent = 0;
+	};
+
+	StreamRx();
+
+	/** `sender_base` is the sender's `StreamTx::base()` when it sent `seq` */
+	Result receive(uint32_t epoch, uint16_t seq, uint16_t sender_base,
+			const uint8_t *data, size_t length);
+
+	/** Copy up to `length` in-order bytes out, returns how many */
+	size_t read(void *data, size_t length);
+	/** In-order bytes ready for read() */
+	size_t available() const { return ready; }
+	/** Free segment slots from `next` on */
+	uint8_t window() const;
+	StreamAckPayload ack(StreamId stream) const;
+
+	/**
+	 * Whether the segment that gave `result` must be acknowledged right away.
+	 * Otherwise a delayed ack is armed, due at `ack_deadline_us`.
+	 */
+	bool ack_now(Result result, int64_t now_us);
+	/** Record that an ack went out */
+	void ack_sent();
+	/** Retry a delayed ack that couldn't be sent */
+	void ack_defer(int64_t now_us);
+
+	bool ack_pending;
+	int64_t ack_deadline_us;
+	Stats st;
+
+private:
+	struct Slot {
+		bool valid;
+		uint8_t length;
+		std::array<uint8_t, STREAM_SEGMENT_LENGTH> data;
+	};
+
+	std::array<Slot, WINDOW> slots;
+	bool synced;
+	uint32_t session;
+	/** First segment not completely read */
+	uint16_t base;
+	/** First segment not received */
+	uint16_t next;
+	/** Bytes of `base` already read */
+	size_t offset;
+	size_t ready;
+	/** Segments received since the last ack */
+	uint8_t unacked;
+	/** A segment arrived past a missing one */
+	bool hole;
+
+	Slot& slot(uint16_t seq) { return slots[seq % WINDOW]; }
+	const Slot& slot(uint16_t seq) const { return slots[seq % WINDOW]; }
+};
+
+}
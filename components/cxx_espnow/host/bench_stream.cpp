@@ -0,0 +1,277 @@
+/*
+ * Host benchmark of sustained stream throughput at each PHY rate. StreamTx
+ * and StreamRx run over a simulated half-duplex channel with 802.11 airtime,
+ * the ESP-NOW transmit queue depth and receive task latency. The result is
+ * compared with the goodput of back-to-back data frames alone. Before that
+ * it checks that a receiver which missed the first segments of a stream
+ * still reads it from the start. From the repository root:
+ *
+ *   g++ -std=gnu++17 -O2 \
+ *       -Icomponents/cxx_espnow/host -Icomponents/esp_now_sim/host \
+ *       -Icomponents/cxx_espnow -Icomponents/cxx_utils \
+ *       components/cxx_espnow/host/bench_stream.cpp \
+ *       components/cxx_espnow/cxx_espnow_stream_window.cpp \
+ *       components/cxx_espnow/cxx_espnow_message.cpp \
+ *       components/cxx_espnow/cxx_espnow_peer.cpp \
+ *       -o bench_stream && ./bench_stream [loss_permille] [seconds]
+ */
+#include "cxx_espnow_stream_window.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <random>
+#include <vector>
+
+using namespace esp_now;
+
+enum class Phy {
+	DSSS,
+	OFDM,
+	HT,
+};
+
+struct Rate {
+	const char *name;
+	Phy phy;
+	double mbps;
+};
+
+static const Rate rates[] = {
+	{"1M",    Phy::DSSS, 1},
+	{"2M",    Phy::DSSS, 2},
+	{"5.5M",  Phy::DSSS, 5.5},
+	{"11M",   Phy::DSSS, 11},
+	{"6M",    Phy::OFDM, 6},
+	{"12M",   Phy::OFDM, 12},
+	{"24M",   Phy::OFDM, 24},
+	{"54M",   Phy::OFDM, 54},
+	{"MCS0",  Phy::HT,   6.5},
+	{"MCS3",  Phy::HT,   26},
+	{"MCS7",  Phy::HT,   65},
+};
+
+/** 802.11 MAC header, vendor specific action frame body and FCS around ESP-NOW data */
+static constexpr size_t ESPNOW_OVERHEAD = 24 + 15 + 4;
+static constexpr size_t MAC_ACK_LENGTH = 14;
+static constexpr size_t WIRE_HEADER_LENGTH = sizeof(MessageHeaderV2);
+/** ESPNow transmit queue per peer, less the slots a stream leaves to other messages */
+static constexpr size_t TX_QUEUE_SIZE = 8 - 2;
+/** Receive callback to ESP-NOW task handling */
+static constexpr int64_t RX_LATENCY_US = 150;
+
+static double ppdu_us(const Rate& r, size_t bytes)
+{
+	switch (r.phy) {
+		case Phy::DSSS:
+			return 192 + bytes * 8 / r.mbps;
+		case Phy::OFDM:
+			return 20 + 4 * std::ceil((16 + 6 + 8 * bytes) / (4 * r.mbps));
+		case Phy::HT:
+			return 36 + 4 * std::ceil((16 + 6 + 8 * bytes) / (4 * r.mbps));
+	}
+	return 0;
+}
+
+/** Channel time of one unicast frame with `length` bytes of ESP-NOW data */
+static double airtime_us(const Rate& r, size_t length)
+{
+	const bool dsss = (r.phy == Phy::DSSS);
+	const double slot = dsss ? 20 : 9;
+	const double sifs = 10;
+	const double difs = sifs + 2 * slot;
+	const double backoff = (dsss ? 31 : 15) / 2.0 * slot;
+	const Rate ack_rate = dsss ? Rate{"", Phy::DSSS, 1} : Rate{"", Phy::OFDM, std::min(r.mbps, 24.0)};
+	return difs + backoff + ppdu_us(r, ESPNOW_OVERHEAD + length) + sifs + ppdu_us(ack_rate, MAC_ACK_LENGTH);
+}
+
+struct Frame {
+	bool data;
+	StreamDataHeader header;
+	std::vector<uint8_t> payload;
+	StreamAckPayload ack;
+	size_t length;
+};
+
+struct Arrival {
+	int64_t at_us;
+	Frame frame;
+};
+
+struct Result {
+	double goodput_kbps;
+	uint32_t retransmits;
+	uint32_t acks;
+};
+
+static Result simulate(const Rate& rate, unsigned loss_permille, double seconds, unsigned seed)
+{
+	std::mt19937 rng(seed);
+	std::uniform_int_distribution<unsigned> permille(0, 999);
+
+	StreamTx tx(1);
+	StreamRx rx;
+	std::deque<Frame> tx_queue, rx_queue;
+	std::deque<Arrival> arrivals;
+	bool busy = false;
+	bool busy_from_tx = false;
+	int64_t busy_until = 0;
+	Frame in_air;
+
+	std::vector<uint8_t> source(STREAM_SEGMENT_LENGTH * StreamTx::WINDOW);
+	std::vector<uint8_t> sink(source.size());
+	uint64_t delivered = 0;
+
+	const int64_t end_us = seconds * 1e6;
+	int64_t now = 1;
+	while (now < end_us) {
+		// Channel finished a frame
+		if (busy && (now >= busy_until)) {
+			busy = false;
+			auto& q = busy_from_tx ? tx_queue : rx_queue;
+			q.pop_front();
+			if (permille(rng) >= loss_permille)
+				arrivals.push_back({now + RX_LATENCY_US, in_air});
+		}
+
+		while (!arrivals.empty() && (arrivals.front().at_us <= now)) {
+			const auto f = std::move(arrivals.front().frame);
+			arrivals.pop_front();
+			if (f.data) {
+				const auto result = rx.receive(f.header.epoch, f.header.seq, f.header.base,
+						f.payload.data(), f.payload.size());
+				if (rx.ack_now(result, now) && (rx_queue.size() < TX_QUEUE_SIZE)) {
+					rx_queue.push_back({false, {}, {}, rx.ack(0), sizeof(StreamAckPayload)});
+					rx.ack_sent();
+				}
+			}
+			else {
+				tx.ack(f.ack, now);
+			}
+		}
+
+		// Reader keeps up, window updates are sent like Stream::read() does
+		const auto window = rx.window();
+		delivered += rx.read(sink.data(), sink.size());
+		const bool window_update = (window <= StreamRx::WINDOW / 4) && (rx.window() >= StreamRx::WINDOW / 2);
+		if ((window_update || (rx.ack_pending && (now >= rx.ack_deadline_us))) &&
+				(rx_queue.size() < TX_QUEUE_SIZE)) {
+			rx_queue.push_back({false, {}, {}, rx.ack(0), sizeof(StreamAckPayload)});
+			rx.ack_sent();
+		}
+
+		// Writer always has more
+		while (tx.writable())
+			tx.write(source.data(), std::min(source.size(), tx.writable()));
+
+		int64_t next = tx.poll(now, [&](const StreamTx::Segment& s) {
+			if (tx_queue.size() >= TX_QUEUE_SIZE)
+				return false;
+			Frame f = {true, {0, tx.epoch(), s.seq, tx.base()},
+				std::vector<uint8_t>(s.data.begin(), s.data.begin() + s.length), {},
+				sizeof(StreamDataHeader) + s.length};
+			tx_queue.push_back(std::move(f));
+			return true;
+		});
+
+		// Both ends contend for the channel, take turns when both have frames
+		if (!busy && (!tx_queue.empty() || !rx_queue.empty())) {
+			busy_from_tx = rx_queue.empty() || (!tx_queue.empty() && !busy_from_tx);
+			in_air = busy_from_tx ? tx_queue.front() : rx_queue.front();
+			busy = true;
+			busy_until = now + std::lround(airtime_us(rate, WIRE_HEADER_LENGTH + in_air.length));
+		}
+
+		if (busy)
+			next = std::min(next, busy_until);
+		if (!arrivals.empty())
+			next = std::min(next, arrivals.front().at_us);
+		if (rx.ack_pending)
+			next = std::min(next, rx.ack_deadline_us);
+		now = std::max(now + 1, next);
+	}
+
+	return Result {
+		.goodput_kbps = delivered / seconds / 1024,
+		.retransmits = tx.stats().retransmits,
+		.acks = rx.st.acks_sent,
+	};
+}
+
+/**
+ * The first segment is dropped and the rest arrive: the receiver must wait
+ * for its retransmission instead of starting the stream at the second one.
+ */
+static bool check_first_segment_loss()
+{
+	StreamTx tx(1);
+	StreamRx rx;
+	std::vector<uint8_t> source(3 * STREAM_SEGMENT_LENGTH);
+	for (size_t i = 0; i < source.size(); i++)
+		source[i] = i * 7;
+	tx.write(source.data(), source.size());
+
+	int64_t now = 1;
+	bool dropped = false;
+	std::vector<StreamAckPayload> acks;
+	auto deliver = [&](const StreamTx::Segment& s) {
+		if (!dropped && (s.seq == 0)) {
+			dropped = true;
+			return true;
+		}
+		const auto result = rx.receive(tx.epoch(), s.seq, tx.base(), s.data.data(), s.length);
+		rx.ack_now(result, now);
+		acks.push_back(rx.ack(0));
+		rx.ack_sent();
+		return true;
+	};
+
+	tx.poll(now, deliver);
+	for (const auto& a : acks)
+		tx.ack(a, now);
+	acks.clear();
+	if (tx.idle() || rx.available()) {
+		printf("first segment loss: receiver skipped the lost segment\n");
+		return false;
+	}
+
+	// Retransmission timeout
+	now += StreamTx::MAX_RTO_US;
+	tx.poll(now, deliver);
+	for (const auto& a : acks)
+		tx.ack(a, now);
+
+	std::vector<uint8_t> sink(source.size());
+	const size_t n = rx.read(sink.data(), sink.size());
+	if (!tx.idle() || (n != source.size()) || (sink != source)) {
+		printf("first segment loss: read %zu of %zu bytes, %s\n", n, source.size(),
+				(sink == source) ? "in order" : "corrupted");
+		return false;
+	}
+	printf("first segment loss: ok\n");
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	const unsigned loss = (argc > 1) ? strtoul(argv[1], nullptr, 0) : 0;
+	const double seconds = (argc > 2) ? strtod(argv[2], nullptr) : 10;
+
+	if (!check_first_segment_loss())
+		return 1;
+
+	printf("segment %zu bytes, window %zu, loss %u permille, %.0f s\n",
+			STREAM_SEGMENT_LENGTH, StreamTx::WINDOW, loss, seconds);
+	printf("%-6s %12s %12s %7s %10s %8s\n",
+			"rate", "link kB/s", "stream kB/s", "eff", "retransmit", "acks");
+	for (const auto& r : rates) {
+		const double frame_us = airtime_us(r, WIRE_HEADER_LENGTH + sizeof(StreamDataHeader) + STREAM_SEGMENT_LENGTH);
+		const double link_kbps = STREAM_SEGMENT_LENGTH / frame_us * 1e6 / 1024;
+		const auto res = simulate(r, loss, seconds, 1);
+		printf("%-6s %12.1f %12.1f %6.1f%% %10u %8u\n",
+				r.name, link_kbps, res.goodput_kbps, 100 * res.goodput_kbps / link_kbps,
+				res.retransmits, res.acks);
+	}
+	return 0;
+}
@@ -0,0 +1,12 @@
+/* Host stand-in for the bits of esp_err.h used by host builds of components */
+#pragma once
+
+#include <stdint.h>
+
+typedef int esp_err_t;
+
+#define ESP_OK              0
+#define ESP_FAIL            -1
+#define ESP_ERR_NO_MEM      0x101
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_WIFI_BASE   0x3000
@@ -33,7 +33,7 @@ class EventGroup
 		{
 			return static_cast<Event>(xEventGroupWaitBits(
 					event,
-					static_cast<EventBits_t>(Event::Any),
+					static_cast<EventBits_t>(mask),
 					clear,
 					all,
 					timeout));
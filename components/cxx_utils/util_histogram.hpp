@@ -0,0 +1,93 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+/**
+ * Fixed-size histogram with logarithmic buckets.
+ *
+ * Every power of two is split into `1 << SubBits` linear buckets, so the
+ * relative error of reported percentiles is bounded by `2^-SubBits`. Values
+ * above the covered range land in the last bucket. Not thread-safe.
+ */
+template <size_t Octaves = 24, size_t SubBits = 2>
+class LogHistogram
+{
+public:
+	static constexpr size_t SUB_BUCKETS = 1 << SubBits;
+	static constexpr size_t BUCKETS = (Octaves + 1) * SUB_BUCKETS;
+
+	LogHistogram()
+	{
+		reset();
+	}
+
+	void reset()
+	{
+		buckets.fill(0);
+		n = 0;
+		sum = 0;
+		min_value = std::numeric_limits<uint32_t>::max();
+		max_value = 0;
+	}
+
+	void add(uint32_t value)
+	{
+		buckets[bucket_index(value)]++;
+		n++;
+		sum += value;
+		min_value = std::min(min_value, value);
+		max_value = std::max(max_value, value);
+	}
+
+	uint32_t count() const { return n; }
+	uint32_t min() const { return n ? min_value : 0; }
+	uint32_t max() const { return max_value; }
+	uint32_t mean() const { return n ? sum / n : 0; }
+
+	/** Returns upper bound of the bucket holding percentile `p` (0..100) */
+	uint32_t percentile(float p) const
+	{
+		if (!n)
+			return 0;
+		const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(n * p / 100.0f + 0.5f));
+		uint64_t seen = 0;
+		for (size_t i = 0; i < BUCKETS; i++) {
+			seen += buckets[i];
+			if (seen >= rank)
+				return std::min(bucket_upper(i), max_value);
+		}
+		return max_value;
+	}
+
+private:
+	std::array<uint32_t, BUCKETS> buckets;
+	uint32_t n;
+	uint64_t sum;
+	uint32_t min_value;
+	uint32_t max_value;
+
+	static size_t bucket_index(uint32_t value)
+	{
+		if (value < SUB_BUCKETS)
+			return value;
+		const size_t msb = 31 - __builtin_clz(value);
+		const size_t octave = msb - SubBits + 1;
+		const size_t sub = (value >> (msb - SubBits)) & (SUB_BUCKETS - 1);
+		return std::min(octave * SUB_BUCKETS + sub, BUCKETS - 1);
+	}
+
+	static uint32_t bucket_upper(size_t index)
+	{
+		if (index < SUB_BUCKETS)
+			return index;
+		const size_t octave = index / SUB_BUCKETS;
+		const size_t sub = index % SUB_BUCKETS;
+		const size_t shift = octave - 1;
+		const uint64_t upper = (static_cast<uint64_t>(SUB_BUCKETS + sub + 1) << shift) - 1;
+		return std::min<uint64_t>(upper, std::numeric_limits<uint32_t>::max());
+	}
+};
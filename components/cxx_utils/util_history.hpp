@@ -0,0 +1,90 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Fixed-size history of the last N items, written by one producer and read
+ * by any number of readers without locking.
+ *
+ * Items are numbered by a running sequence number. The producer never waits:
+ * once the ring is full each push overwrites the oldest item. Readers copy
+ * items out and then drop any that the producer may have been overwriting
+ * during the copy, seqlock style, so a read returns only whole items. Pushes
+ * must not run concurrently with each other, T must be trivially copyable.
+ */
+template <typename T, size_t N>
+class HistoryRing
+{
+public:
+	static constexpr size_t capacity = N;
+
+	HistoryRing() :
+		items(),
+		started(0),
+		written(0)
+	{}
+
+	void push(const T& item)
+	{
+		const uint32_t seq = written.load(std::memory_order_relaxed);
+		started.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		items[seq % N] = item;
+		written.store(seq + 1, std::memory_order_release);
+	}
+
+	/** Sequence number the next push will get */
+	uint32_t head() const { return written.load(std::memory_order_acquire); }
+	/** Sequence number of the oldest item still held */
+	uint32_t tail() const
+	{
+		const uint32_t end = head();
+		return (end > N) ? end - N : 0;
+	}
+
+	/**
+	 * Copy up to `max` items, every `step`-th one, starting at sequence
+	 * `seq` or the oldest held item if that is gone already. `seq` is
+	 * advanced past the items read, ready for the next call.
+	 */
+	size_t read(uint32_t& seq, T *out, size_t max, uint32_t step = 1) const
+	{
+		step = std::max<uint32_t>(step, 1);
+		const uint32_t end = written.load(std::memory_order_acquire);
+		// Next item of a decimated read isn't written yet
+		if (static_cast<int32_t>(end - seq) < 0)
+			return 0;
+		if (end - seq > N)
+			seq = end - N;
+
+		size_t n = 0;
+		uint32_t s = seq;
+		for (; (n < max) && (s < end); s += step)
+			out[n++] = items[s % N];
+
+		// Item k is unreliable once the producer has started on k + N
+		std::atomic_thread_fence(std::memory_order_acquire);
+		const uint32_t begun = started.load(std::memory_order_relaxed);
+		size_t skip = 0;
+		while ((skip < n) && (seq + skip * step + N < begun))
+			skip++;
+		if (skip) {
+			std::copy(out + skip, out + n, out);
+			n -= skip;
+		}
+
+		seq = s;
+		return n;
+	}
+
+private:
+	std::array<T, N> items;
+	/** Sequence number of the item being written plus one */
+	std::atomic<uint32_t> started;
+	/** Items written so far */
+	std::atomic<uint32_t> written;
+};
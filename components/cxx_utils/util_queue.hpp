@@ -1,3 +1,5 @@
+#pragma once
+
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
 
@@ -41,6 +43,52 @@ class Queue
 			return !!ret;
 		}
 
+		size_t size() const
+		{
+			return uxQueueMessagesWaiting(handle);
+		}
+
+		QueueHandle_t native_handle() const
+		{
+			return handle;
+		}
+
 	private:
 		QueueHandle_t handle;
 };
+
+/**
+ * Wait on several queues at once. Every successful `wait()` must be followed
+ * by exactly one item received from one of the member queues.
+ */
+class QueueSet
+{
+	public:
+		QueueSet(size_t size)
+		{
+			handle = xQueueCreateSet(size);
+			if (handle == NULL)
+				throw std::runtime_error("Failed to create a queue set");
+		}
+
+		~QueueSet()
+		{
+			vQueueDelete(handle);
+		}
+
+		/** Member queues must be empty when added */
+		template <typename Item>
+		void add(Queue<Item>& queue)
+		{
+			if (xQueueAddToSet(queue.native_handle(), handle) != pdPASS)
+				throw std::runtime_error("Failed to add a queue to the set");
+		}
+
+		bool wait(TickType_t timeout = 0)
+		{
+			return xQueueSelectFromSet(handle, timeout) != NULL;
+		}
+
+	private:
+		QueueSetHandle_t handle;
+};
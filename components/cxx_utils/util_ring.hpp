@@ -0,0 +1,83 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <stdexcept>
+#include <utility>
+
+/**
+ * Fixed-capacity FIFO ring buffer with inline storage.
+ *
+ * Never allocates; pushing into a full ring throws. Not thread-safe, protect
+ * it with the owner's lock.
+ */
+template <typename T, size_t N>
+class RingBuffer
+{
+public:
+	static constexpr size_t capacity = N;
+
+	RingBuffer() :
+		head(0),
+		count(0)
+	{}
+
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	bool full() const { return count == N; }
+
+	T& operator[](size_t i) { return items[(head + i) % N]; }
+	const T& operator[](size_t i) const { return items[(head + i) % N]; }
+
+	T& front() { return (*this)[0]; }
+	const T& front() const { return (*this)[0]; }
+	T& back() { return (*this)[count - 1]; }
+	const T& back() const { return (*this)[count - 1]; }
+
+	/** Appends a default-constructed item and returns it for in-place filling */
+	T& emplace_back()
+	{
+		if (full())
+			throw std::out_of_range("RingBuffer full");
+		count++;
+		back() = T();
+		return back();
+	}
+
+	void push_back(const T& item)
+	{
+		emplace_back() = item;
+	}
+
+	void pop_front()
+	{
+		if (empty())
+			throw std::out_of_range("RingBuffer empty");
+		items[head] = T();
+		head = (head + 1) % N;
+		count--;
+	}
+
+	/** Removes item at position `i`, shifting the following items forward */
+	void erase(size_t i)
+	{
+		if (i >= count)
+			throw std::out_of_range("RingBuffer index");
+		for (; i + 1 < count; i++) {
+			(*this)[i] = std::move((*this)[i + 1]);
+		}
+		back() = T();
+		count--;
+	}
+
+	void clear()
+	{
+		while (!empty())
+			pop_front();
+	}
+
+private:
+	std::array<T, N> items;
+	size_t head;
+	size_t count;
+};
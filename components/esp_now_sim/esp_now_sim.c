@@ -0,0 +1,588 @@
+#include "esp_now_sim.h"
+#include "esp_now.h"
+#include "esp_log.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *TAG = "espnow_sim";
+
+#define SIM_MAGIC		0x4d534e45
+#define SIM_VERSION		1
+#define SIM_QUEUE_LEN	32
+#define ACK_TIMEOUT_US	10000
+
+static const uint8_t BROADCAST[ESP_NOW_ETH_ALEN] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+typedef enum {
+	DATAGRAM_DATA,
+	DATAGRAM_ACK,
+} datagram_type_t;
+
+typedef struct {
+	uint32_t magic;
+	uint8_t type;
+	uint16_t seq;
+	uint8_t src[ESP_NOW_ETH_ALEN];
+	uint8_t dst[ESP_NOW_ETH_ALEN];
+} __attribute__((packed)) datagram_header_t;
+
+typedef struct {
+	datagram_header_t hdr;
+	uint8_t data[ESP_NOW_MAX_DATA_LEN];
+} __attribute__((packed)) datagram_t;
+
+/** Frame waiting for its delivery time */
+typedef struct {
+	int64_t due_us;
+	size_t len;
+	datagram_t dgram;
+} pending_t;
+
+/** Send status, reported in submission order like the driver does */
+typedef struct {
+	uint16_t seq;
+	uint8_t dst[ESP_NOW_ETH_ALEN];
+	bool acked;
+	int64_t deadline_us;
+} status_t;
+
+static struct {
+	bool configured;
+	bool initialized;
+	bool stop;
+	esp_now_sim_config_t config;
+	int sock;
+	struct sockaddr_in group;
+	pthread_t rx_thread;
+	pthread_t tx_thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	esp_now_recv_cb_t recv_cb;
+	esp_now_send_cb_t send_cb;
+	esp_now_peer_info_t peers[ESP_NOW_MAX_TOTAL_PEER_NUM];
+	size_t peer_count;
+
+	pending_t pending[SIM_QUEUE_LEN];
+	size_t pending_count;
+	status_t status[SIM_QUEUE_LEN];
+	size_t status_head;
+	size_t status_count;
+	uint16_t seq;
+
+	esp_now_sim_stats_t stats;
+} sim = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.sock = -1,
+};
+
+static int64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool mac_eq(const uint8_t *a, const uint8_t *b)
+{
+	return memcmp(a, b, ESP_NOW_ETH_ALEN) == 0;
+}
+
+static bool parse_mac(const char *str, uint8_t *mac)
+{
+	unsigned int b[ESP_NOW_ETH_ALEN];
+	if (sscanf(str, "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != ESP_NOW_ETH_ALEN)
+		return false;
+	for (size_t i = 0; i < ESP_NOW_ETH_ALEN; i++)
+		mac[i] = b[i];
+	return true;
+}
+
+static unsigned long env_ulong(const char *name, unsigned long defval)
+{
+	const char *val = getenv(name);
+	return val ? strtoul(val, NULL, 0) : defval;
+}
+
+void esp_now_sim_default_config(esp_now_sim_config_t *config)
+{
+	memset(config, 0, sizeof(*config));
+
+	const char *mac = getenv("ESPNOW_SIM_MAC");
+	if (!mac || !parse_mac(mac, config->mac)) {
+		// Locally administered unicast address, unique per process
+		const pid_t pid = getpid();
+		const uint8_t def[ESP_NOW_ETH_ALEN] = {0x02, 0x00, pid >> 24, pid >> 16, pid >> 8, pid};
+		memcpy(config->mac, def, ESP_NOW_ETH_ALEN);
+	}
+
+	const char *group = getenv("ESPNOW_SIM_GROUP");
+	snprintf(config->group, sizeof(config->group), "%s", group ? group : "239.255.42.1");
+	config->port = env_ulong("ESPNOW_SIM_PORT", 42420);
+	config->loss_permille = env_ulong("ESPNOW_SIM_LOSS", 0);
+	config->delay_us = env_ulong("ESPNOW_SIM_DELAY_US", 0);
+	config->jitter_us = env_ulong("ESPNOW_SIM_JITTER_US", 0);
+	config->seed = env_ulong("ESPNOW_SIM_SEED", time(NULL) ^ getpid());
+}
+
+esp_err_t esp_now_sim_configure(const esp_now_sim_config_t *config)
+{
+	if (!config || (config->loss_permille > 1000))
+		return ESP_ERR_INVALID_ARG;
+
+	pthread_mutex_lock(&sim.lock);
+	if (sim.initialized) {
+		sim.config.loss_permille = config->loss_permille;
+		sim.config.delay_us = config->delay_us;
+		sim.config.jitter_us = config->jitter_us;
+	}
+	else {
+		sim.config = *config;
+		sim.configured = true;
+	}
+	pthread_mutex_unlock(&sim.lock);
+	return ESP_OK;
+}
+
+void esp_now_sim_get_mac(uint8_t mac[ESP_NOW_ETH_ALEN])
+{
+	pthread_mutex_lock(&sim.lock);
+	memcpy(mac, sim.config.mac, ESP_NOW_ETH_ALEN);
+	pthread_mutex_unlock(&sim.lock);
+}
+
+void esp_now_sim_get_stats(esp_now_sim_stats_t *stats)
+{
+	pthread_mutex_lock(&sim.lock);
+	*stats = sim.stats;
+	pthread_mutex_unlock(&sim.lock);
+}
+
+static void transmit(const datagram_t *dgram, size_t len)
+{
+	const ssize_t ret = sendto(sim.sock, dgram, sizeof(datagram_header_t) + len, 0,
+			(const struct sockaddr *)&sim.group, sizeof(sim.group));
+	if (ret < 0)
+		ESP_LOGE(TAG, "sendto: %s", strerror(errno));
+}
+
+static void count(uint32_t *counter)
+{
+	pthread_mutex_lock(&sim.lock);
+	(*counter)++;
+	pthread_mutex_unlock(&sim.lock);
+}
+
+static void send_ack(const datagram_header_t *hdr)
+{
+	datagram_t ack = {
+		.hdr = {
+			.magic = SIM_MAGIC,
+			.type = DATAGRAM_ACK,
+			.seq = hdr->seq,
+		},
+	};
+	memcpy(ack.hdr.src, sim.config.mac, ESP_NOW_ETH_ALEN);
+	memcpy(ack.hdr.dst, hdr->src, ESP_NOW_ETH_ALEN);
+	transmit(&ack, 0);
+}
+
+static void handle_ack(const datagram_header_t *hdr)
+{
+	pthread_mutex_lock(&sim.lock);
+	bool found = false;
+	for (size_t i = 0; i < sim.status_count; i++) {
+		status_t *st = &sim.status[(sim.status_head + i) % SIM_QUEUE_LEN];
+		if ((st->seq == hdr->seq) && mac_eq(st->dst, hdr->src)) {
+			st->acked = true;
+			pthread_cond_signal(&sim.cond);
+			found = true;
+			break;
+		}
+	}
+	// The status went out already, the frame timed out waiting for this
+	if (!found)
+		sim.stats.tx_late_acks++;
+	pthread_mutex_unlock(&sim.lock);
+}
+
+static void *rx_thread(void *arg)
+{
+	(void)arg;
+
+	datagram_t dgram;
+	while (1) {
+		const ssize_t ret = recv(sim.sock, &dgram, sizeof(dgram), 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (sim.stop)
+			break;
+
+		if ((ret < (ssize_t)sizeof(datagram_header_t)) || (dgram.hdr.magic != SIM_MAGIC)) {
+			count(&sim.stats.rx_invalid);
+			continue;
+		}
+		// Multicast loops our own frames back, and frames for others are not ours to see
+		if (mac_eq(dgram.hdr.src, sim.config.mac) ||
+				!(mac_eq(dgram.hdr.dst, sim.config.mac) || mac_eq(dgram.hdr.dst, BROADCAST))) {
+			count(&sim.stats.rx_ignored);
+			continue;
+		}
+
+		if (dgram.hdr.type == DATAGRAM_ACK) {
+			handle_ack(&dgram.hdr);
+			continue;
+		}
+
+		if (!mac_eq(dgram.hdr.dst, BROADCAST))
+			send_ack(&dgram.hdr);
+		count(&sim.stats.rx_frames);
+		const esp_now_recv_cb_t cb = sim.recv_cb;
+		if (cb)
+			cb(dgram.hdr.src, dgram.data, ret - sizeof(datagram_header_t));
+	}
+	return NULL;
+}
+
+static void *tx_thread(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&sim.lock);
+	while (!sim.stop) {
+		const int64_t now = now_us();
+		int64_t next = now + 1000000;
+
+		// Put frames which are due on the air, earliest first. Pending frames
+		// are kept in submission order, so frames due at the same time go
+		// out in the order they were sent.
+		while (sim.pending_count) {
+			size_t first = 0;
+			for (size_t i = 1; i < sim.pending_count; i++) {
+				if (sim.pending[i].due_us < sim.pending[first].due_us)
+					first = i;
+			}
+			pending_t *p = &sim.pending[first];
+			if (p->due_us > now) {
+				if (p->due_us < next)
+					next = p->due_us;
+				break;
+			}
+			transmit(&p->dgram, p->len);
+			sim.pending_count--;
+			memmove(&sim.pending[first], &sim.pending[first + 1],
+					(sim.pending_count - first) * sizeof(sim.pending[0]));
+		}
+
+		while (sim.status_count) {
+			status_t st = sim.status[sim.status_head];
+			if (!st.acked && (st.deadline_us > now)) {
+				if (st.deadline_us < next)
+					next = st.deadline_us;
+				break;
+			}
+			sim.status_head = (sim.status_head + 1) % SIM_QUEUE_LEN;
+			sim.status_count--;
+			if (st.acked)
+				sim.stats.tx_acked++;
+			else
+				sim.stats.tx_ack_timeouts++;
+
+			const esp_now_send_cb_t cb = sim.send_cb;
+			if (cb) {
+				pthread_mutex_unlock(&sim.lock);
+				cb(st.dst, st.acked ? ESP_NOW_SEND_SUCCESS : ESP_NOW_SEND_FAIL);
+				pthread_mutex_lock(&sim.lock);
+			}
+		}
+
+		struct timespec ts = {
+			.tv_sec = next / 1000000,
+			.tv_nsec = (next % 1000000) * 1000,
+		};
+		pthread_cond_timedwait(&sim.cond, &sim.lock, &ts);
+	}
+	pthread_mutex_unlock(&sim.lock);
+	return NULL;
+}
+
+static esp_err_t open_socket(void)
+{
+	sim.sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sim.sock < 0)
+		return ESP_FAIL;
+
+	const int one = 1;
+	const unsigned char ttl = 0;
+	struct in_addr loopback = {
+		.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(sim.config.port),
+		.sin_addr = {
+			.s_addr = htonl(INADDR_ANY),
+		},
+	};
+	struct ip_mreq mreq = {
+		.imr_interface = loopback,
+	};
+	sim.group = (struct sockaddr_in) {
+		.sin_family = AF_INET,
+		.sin_port = htons(sim.config.port),
+	};
+	if (inet_aton(sim.config.group, &sim.group.sin_addr) == 0) {
+		ESP_LOGE(TAG, "Invalid multicast group %s", sim.config.group);
+		goto fail;
+	}
+	mreq.imr_multiaddr = sim.group.sin_addr;
+
+	if ((setsockopt(sim.sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0) ||
+			(setsockopt(sim.sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) ||
+			(bind(sim.sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+			(setsockopt(sim.sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) ||
+			(setsockopt(sim.sock, IPPROTO_IP, IP_MULTICAST_IF, &loopback, sizeof(loopback)) < 0) ||
+			(setsockopt(sim.sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0) ||
+			(setsockopt(sim.sock, IPPROTO_IP, IP_MULTICAST_LOOP, &one, sizeof(one)) < 0)) {
+		ESP_LOGE(TAG, "Socket setup failed: %s", strerror(errno));
+		goto fail;
+	}
+	return ESP_OK;
+
+fail:
+	close(sim.sock);
+	sim.sock = -1;
+	return ESP_FAIL;
+}
+
+esp_err_t esp_now_init(void)
+{
+	pthread_mutex_lock(&sim.lock);
+	if (sim.initialized) {
+		pthread_mutex_unlock(&sim.lock);
+		return ESP_OK;
+	}
+	if (!sim.configured) {
+		esp_now_sim_default_config(&sim.config);
+		sim.configured = true;
+	}
+	if (open_socket() != ESP_OK) {
+		pthread_mutex_unlock(&sim.lock);
+		return ESP_ERR_ESPNOW_INTERNAL;
+	}
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sim.cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	sim.stop = false;
+	sim.peer_count = 0;
+	sim.pending_count = 0;
+	sim.status_head = 0;
+	sim.status_count = 0;
+	pthread_create(&sim.rx_thread, NULL, rx_thread, NULL);
+	pthread_create(&sim.tx_thread, NULL, tx_thread, NULL);
+	sim.initialized = true;
+
+	const uint8_t *mac = sim.config.mac;
+	ESP_LOGI(TAG, "Node %02x:%02x:%02x:%02x:%02x:%02x on %s:%u, loss %u permille, delay %u+%u us",
+			mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
+			sim.config.group, sim.config.port,
+			sim.config.loss_permille, sim.config.delay_us, sim.config.jitter_us);
+	pthread_mutex_unlock(&sim.lock);
+	return ESP_OK;
+}
+
+esp_err_t esp_now_deinit(void)
+{
+	pthread_mutex_lock(&sim.lock);
+	if (!sim.initialized) {
+		pthread_mutex_unlock(&sim.lock);
+		return ESP_OK;
+	}
+	sim.stop = true;
+	pthread_cond_signal(&sim.cond);
+	shutdown(sim.sock, SHUT_RDWR);
+	pthread_mutex_unlock(&sim.lock);
+
+	pthread_join(sim.tx_thread, NULL);
+	pthread_join(sim.rx_thread, NULL);
+
+	pthread_mutex_lock(&sim.lock);
+	close(sim.sock);
+	sim.sock = -1;
+	pthread_cond_destroy(&sim.cond);
+	sim.initialized = false;
+	pthread_mutex_unlock(&sim.lock);
+	return ESP_OK;
+}
+
+esp_err_t esp_now_get_version(uint32_t *version)
+{
+	if (!version)
+		return ESP_ERR_ESPNOW_ARG;
+	*version = SIM_VERSION;
+	return ESP_OK;
+}
+
+esp_err_t esp_now_register_recv_cb(esp_now_recv_cb_t cb)
+{
+	if (!sim.initialized)
+		return ESP_ERR_ESPNOW_NOT_INIT;
+	sim.recv_cb = cb;
+	return ESP_OK;
+}
+
+esp_err_t esp_now_unregister_recv_cb(void)
+{
+	sim.recv_cb = NULL;
+	return ESP_OK;
+}
+
+esp_err_t esp_now_register_send_cb(esp_now_send_cb_t cb)
+{
+	if (!sim.initialized)
+		return ESP_ERR_ESPNOW_NOT_INIT;
+	sim.send_cb = cb;
+	return ESP_OK;
+}
+
+esp_err_t esp_now_unregister_send_cb(void)
+{
+	sim.send_cb = NULL;
+	return ESP_OK;
+}
+
+static esp_now_peer_info_t *find_peer(const uint8_t *peer_addr)
+{
+	for (size_t i = 0; i < sim.peer_count; i++) {
+		if (mac_eq(sim.peers[i].peer_addr, peer_addr))
+			return &sim.peers[i];
+	}
+	return NULL;
+}
+
+esp_err_t esp_now_send(const uint8_t *peer_addr, const uint8_t *data, size_t len)
+{
+	if (!data || !len || (len > ESP_NOW_MAX_DATA_LEN))
+		return ESP_ERR_ESPNOW_ARG;
+
+	pthread_mutex_lock(&sim.lock);
+	esp_err_t ret = ESP_OK;
+	if (!sim.initialized) {
+		ret = ESP_ERR_ESPNOW_NOT_INIT;
+		goto out;
+	}
+	if (!peer_addr || !find_peer(peer_addr)) {
+		ret = ESP_ERR_ESPNOW_NOT_FOUND;
+		goto out;
+	}
+	if ((sim.status_count == SIM_QUEUE_LEN) || (sim.pending_count == SIM_QUEUE_LEN)) {
+		ret = ESP_ERR_ESPNOW_NO_MEM;
+		goto out;
+	}
+
+	const int64_t now = now_us();
+	const bool broadcast = mac_eq(peer_addr, BROADCAST);
+	const uint16_t seq = sim.seq++;
+	const bool lost = (unsigned)(rand_r(&sim.config.seed) % 1000) < sim.config.loss_permille;
+	const uint32_t delay = sim.config.delay_us +
+		(sim.config.jitter_us ? rand_r(&sim.config.seed) % (sim.config.jitter_us + 1) : 0);
+
+	sim.stats.tx_frames++;
+	if (lost) {
+		sim.stats.tx_lost++;
+	}
+	else {
+		pending_t *p = &sim.pending[sim.pending_count++];
+		p->due_us = now + delay;
+		p->len = len;
+		p->dgram.hdr = (datagram_header_t) {
+			.magic = SIM_MAGIC,
+			.type = DATAGRAM_DATA,
+			.seq = seq,
+		};
+		memcpy(p->dgram.hdr.src, sim.config.mac, ESP_NOW_ETH_ALEN);
+		memcpy(p->dgram.hdr.dst, peer_addr, ESP_NOW_ETH_ALEN);
+		memcpy(p->dgram.data, data, len);
+	}
+
+	// Broadcast frames are not acknowledged, the driver reports them sent
+	status_t *st = &sim.status[(sim.status_head + sim.status_count++) % SIM_QUEUE_LEN];
+	st->seq = seq;
+	memcpy(st->dst, peer_addr, ESP_NOW_ETH_ALEN);
+	st->acked = broadcast;
+	st->deadline_us = now + delay + ACK_TIMEOUT_US;
+	pthread_cond_signal(&sim.cond);
+
+out:
+	pthread_mutex_unlock(&sim.lock);
+	return ret;
+}
+
+esp_err_t esp_now_add_peer(const esp_now_peer_info_t *peer)
+{
+	if (!peer)
+		return ESP_ERR_ESPNOW_ARG;
+
+	pthread_mutex_lock(&sim.lock);
+	esp_err_t ret = ESP_OK;
+	if (!sim.initialized)
+		ret = ESP_ERR_ESPNOW_NOT_INIT;
+	else if (find_peer(peer->peer_addr))
+		ret = ESP_ERR_ESPNOW_EXIST;
+	else if (sim.peer_count == ESP_NOW_MAX_TOTAL_PEER_NUM)
+		ret = ESP_ERR_ESPNOW_FULL;
+	else
+		sim.peers[sim.peer_count++] = *peer;
+	pthread_mutex_unlock(&sim.lock);
+	return ret;
+}
+
+esp_err_t esp_now_del_peer(const uint8_t *peer_addr)
+{
+	if (!peer_addr)
+		return ESP_ERR_ESPNOW_ARG;
+
+	pthread_mutex_lock(&sim.lock);
+	esp_now_peer_info_t *p = find_peer(peer_addr);
+	if (p)
+		*p = sim.peers[--sim.peer_count];
+	pthread_mutex_unlock(&sim.lock);
+	return p ? ESP_OK : ESP_ERR_ESPNOW_NOT_FOUND;
+}
+
+esp_err_t esp_now_mod_peer(const esp_now_peer_info_t *peer)
+{
+	if (!peer)
+		return ESP_ERR_ESPNOW_ARG;
+
+	pthread_mutex_lock(&sim.lock);
+	esp_now_peer_info_t *p = find_peer(peer->peer_addr);
+	if (p)
+		*p = *peer;
+	pthread_mutex_unlock(&sim.lock);
+	return p ? ESP_OK : ESP_ERR_ESPNOW_NOT_FOUND;
+}
+
+bool esp_now_is_peer_exist(const uint8_t *peer_addr)
+{
+	pthread_mutex_lock(&sim.lock);
+	const bool found = peer_addr && find_peer(peer_addr);
+	pthread_mutex_unlock(&sim.lock);
+	return found;
+}
@@ -0,0 +1,70 @@
+/*
+ * Host-side stand-in for the ESP-NOW driver.
+ *
+ * Implements esp_now_* on Linux on top of UDP multicast on the loopback
+ * interface, so that several node processes on one machine exchange real
+ * frames. Each process is one node with its own MAC address. Unicast frames
+ * are acknowledged by the receiving node like on air, so the send callback
+ * reports failure for lost frames or absent peers after ACK_TIMEOUT.
+ *
+ * Link impairments are applied by the sender: frames are dropped with
+ * `loss_permille` probability and delivered after `delay_us` plus a uniform
+ * random `jitter_us`. Jitter larger than the frame spacing reorders frames.
+ *
+ * Defaults are taken from the environment:
+ *   ESPNOW_SIM_MAC       node address, aa:bb:cc:dd:ee:ff (default derived from pid)
+ *   ESPNOW_SIM_GROUP     multicast group (default 239.255.42.1)
+ *   ESPNOW_SIM_PORT      UDP port (default 42420)
+ *   ESPNOW_SIM_LOSS      loss probability, permille
+ *   ESPNOW_SIM_DELAY_US  one-way delay
+ *   ESPNOW_SIM_JITTER_US extra random delay
+ *   ESPNOW_SIM_SEED      random seed, for reproducible runs
+ */
+#pragma once
+
+#include "esp_err.h"
+#include "esp_now.h"
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+	uint8_t mac[ESP_NOW_ETH_ALEN];
+	char group[16];
+	uint16_t port;
+	uint16_t loss_permille;
+	uint32_t delay_us;
+	uint32_t jitter_us;
+	unsigned int seed;
+} esp_now_sim_config_t;
+
+typedef struct {
+	uint32_t tx_frames;
+	uint32_t tx_lost;
+	uint32_t tx_acked;
+	uint32_t tx_ack_timeouts;
+	/** Acks that came in after their frame was reported failed */
+	uint32_t tx_late_acks;
+	uint32_t rx_frames;
+	uint32_t rx_ignored;
+	uint32_t rx_invalid;
+} esp_now_sim_stats_t;
+
+/** Fill `config` with defaults, overridden from the environment */
+void esp_now_sim_default_config(esp_now_sim_config_t *config);
+
+/**
+ * Set simulator configuration. Address, group and port only take effect
+ * before esp_now_init(), link impairments can be changed at any time.
+ */
+esp_err_t esp_now_sim_configure(const esp_now_sim_config_t *config);
+
+void esp_now_sim_get_mac(uint8_t mac[ESP_NOW_ETH_ALEN]);
+void esp_now_sim_get_stats(esp_now_sim_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
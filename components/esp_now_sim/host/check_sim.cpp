@@ -0,0 +1,332 @@
+/*
+ * Host check of the ESP-NOW simulator with two nodes, this process and a
+ * forked echo node: send statuses for delivered, lost and unaddressed
+ * frames, broadcasts, and the loss, delay and jitter settings. From the
+ * repository root:
+ *
+ *   gcc -std=gnu11 -O2 -Wall -Wextra \
+ *       -Icomponents/esp_now_sim -Icomponents/esp_now_sim/host \
+ *       -Icomponents/cxx_espnow/host \
+ *       -c components/esp_now_sim/esp_now_sim.c -o esp_now_sim.o && \
+ *   g++ -std=gnu++17 -O2 -Wall -Wextra \
+ *       -Icomponents/esp_now_sim -Icomponents/esp_now_sim/host \
+ *       -Icomponents/cxx_espnow/host \
+ *       components/esp_now_sim/host/check_sim.cpp esp_now_sim.o \
+ *       -pthread -o check_sim && ./check_sim
+ */
+#include "esp_now_sim.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std::chrono_literals;
+using Clock = std::chrono::steady_clock;
+
+static unsigned failures;
+
+#define CHECK(cond) do { \
+		if (!(cond)) { \
+			printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+static const uint8_t NODE_A[ESP_NOW_ETH_ALEN] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x0a};
+static const uint8_t NODE_B[ESP_NOW_ETH_ALEN] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x0b};
+/** Nobody answers to this one */
+static const uint8_t NODE_ABSENT[ESP_NOW_ETH_ALEN] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x0c};
+static const uint8_t BROADCAST[ESP_NOW_ETH_ALEN] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+/** Frames in flight at once, well within the simulator queues */
+static constexpr unsigned MAX_IN_FLIGHT = 8;
+
+static void add_peer(const uint8_t *mac)
+{
+	esp_now_peer_info_t peer = {};
+	memcpy(peer.peer_addr, mac, ESP_NOW_ETH_ALEN);
+	esp_now_add_peer(&peer);
+}
+
+static void start_node(const uint8_t *mac, uint16_t port, unsigned seed)
+{
+	esp_now_sim_config_t config;
+	esp_now_sim_default_config(&config);
+	memcpy(config.mac, mac, ESP_NOW_ETH_ALEN);
+	config.port = port;
+	config.loss_permille = 0;
+	config.delay_us = 0;
+	config.jitter_us = 0;
+	config.seed = seed;
+	esp_now_sim_configure(&config);
+	esp_now_init();
+}
+
+static void set_link(uint16_t loss_permille, uint32_t delay_us, uint32_t jitter_us)
+{
+	esp_now_sim_config_t config;
+	esp_now_sim_default_config(&config);
+	config.loss_permille = loss_permille;
+	config.delay_us = delay_us;
+	config.jitter_us = jitter_us;
+	esp_now_sim_configure(&config);
+}
+
+/** Node B: sends every frame back to where it came from, until node A is gone */
+static void run_echo(uint16_t port, pid_t parent)
+{
+	start_node(NODE_B, port, 2);
+	add_peer(NODE_A);
+	esp_now_register_recv_cb([](const uint8_t *mac, const uint8_t *data, int len) {
+		esp_now_send(mac, data, len);
+	});
+	while (getppid() == parent)
+		sleep(1);
+}
+
+/** Node A's view of what came back */
+static struct {
+	std::mutex mutex;
+	std::condition_variable cond;
+	/** Send statuses in the order they were reported */
+	std::vector<esp_now_send_status_t> statuses;
+	std::vector<Clock::time_point> status_times;
+	/** Sequence numbers of echoed frames in arrival order */
+	std::vector<uint32_t> echoes;
+} node;
+
+static void on_send(const uint8_t *, esp_now_send_status_t status)
+{
+	std::lock_guard<std::mutex> lock(node.mutex);
+	node.statuses.push_back(status);
+	node.status_times.push_back(Clock::now());
+	node.cond.notify_all();
+}
+
+static void on_recv(const uint8_t *mac, const uint8_t *data, int len)
+{
+	if ((len < static_cast<int>(sizeof(uint32_t))) || memcmp(mac, NODE_B, ESP_NOW_ETH_ALEN))
+		return;
+	std::lock_guard<std::mutex> lock(node.mutex);
+	// Straight into the vector, a local copy pushed under the lock trips
+	// -Wdangling-pointer in GCC 12
+	memcpy(&node.echoes.emplace_back(), data, sizeof(uint32_t));
+	node.cond.notify_all();
+}
+
+static void reset()
+{
+	std::lock_guard<std::mutex> lock(node.mutex);
+	node.statuses.clear();
+	node.status_times.clear();
+	node.echoes.clear();
+}
+
+/** ACK_TIMEOUT_US of the simulator */
+static constexpr auto ACK_TIMEOUT = 10ms;
+/** Allowance for the status thread getting to run */
+static constexpr auto SCHEDULING = 10ms;
+
+/**
+ * Outcome of a burst of frames. A frame that came back echoed did arrive,
+ * so a failed status for it means the ack missed the timeout: the other
+ * process wasn't scheduled in time, which a loaded host does now and then.
+ * Each of those must have its ack turn up after the status, as counted by
+ * the simulator, or the status went to the wrong frame.
+ */
+struct Burst {
+	std::vector<Clock::time_point> sent;
+	unsigned success = 0;
+	unsigned fail = 0;
+	/** Failed and not echoed, not delivered */
+	unsigned missing = 0;
+	/** Failed but echoed, the ack was late */
+	unsigned late = 0;
+	/** Acks the simulator got after reporting their frame failed */
+	unsigned late_acks = 0;
+	/** Succeeded without an echo, only right for broadcasts to nobody */
+	unsigned unconfirmed = 0;
+	unsigned echoes = 0;
+	/** Echoes that came back after one with a higher sequence number */
+	unsigned reordered = 0;
+	std::chrono::microseconds min_latency = std::chrono::microseconds::max();
+	std::chrono::microseconds max_latency = std::chrono::microseconds::zero();
+};
+
+/**
+ * Send `count` numbered frames to `dst`, at most `in_flight` awaiting their
+ * status, then wait for the statuses and echoes to settle
+ */
+static Burst send_burst(const uint8_t *dst, unsigned count, unsigned in_flight = MAX_IN_FLIGHT)
+{
+	reset();
+	Burst b;
+	esp_now_sim_stats_t before, after;
+	esp_now_sim_get_stats(&before);
+	for (uint32_t seq = 0; seq < count; seq++) {
+		{
+			std::unique_lock<std::mutex> lock(node.mutex);
+			node.cond.wait_for(lock, 1s, [&] { return seq - node.statuses.size() < in_flight; });
+		}
+		uint8_t frame[32] = {};
+		memcpy(frame, &seq, sizeof(seq));
+		b.sent.push_back(Clock::now());
+		if (esp_now_send(dst, frame, sizeof(frame)) != ESP_OK)
+			printf("esp_now_send %u failed\n", seq);
+	}
+
+	std::unique_lock<std::mutex> lock(node.mutex);
+	node.cond.wait_for(lock, 2s, [&] { return node.statuses.size() >= count; });
+	// Late echoes and acks of the last frames
+	node.cond.wait_for(lock, 100ms, [] { return false; });
+	esp_now_sim_get_stats(&after);
+	b.late_acks = after.tx_late_acks - before.tx_late_acks;
+
+	// Statuses are reported in submission order, status i is for frame i
+	std::vector<bool> echoed(count);
+	for (const auto seq : node.echoes) {
+		if (seq < count)
+			echoed[seq] = true;
+	}
+	for (size_t i = 0; i < node.statuses.size(); i++) {
+		if (node.statuses[i] != ESP_NOW_SEND_SUCCESS) {
+			b.fail++;
+			if (echoed[i])
+				b.late++;
+			else
+				b.missing++;
+			continue;
+		}
+		b.success++;
+		if (!echoed[i])
+			b.unconfirmed++;
+		const auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+				node.status_times[i] - b.sent[i]);
+		b.min_latency = std::min(b.min_latency, latency);
+		b.max_latency = std::max(b.max_latency, latency);
+	}
+	uint32_t highest = 0;
+	for (const auto seq : node.echoes) {
+		if (seq < highest)
+			b.reordered++;
+		highest = std::max(highest, seq);
+	}
+	b.echoes = node.echoes.size();
+	return b;
+}
+
+static void print(const char *name, const Burst& b)
+{
+	printf("%-10s: %u ok, %u failed (%u late, %u late acks), %u echoed, %u reordered",
+			name, b.success, b.fail, b.late, b.late_acks, b.echoes, b.reordered);
+	if (b.success)
+		printf(", status after %lld..%lld us", (long long)b.min_latency.count(), (long long)b.max_latency.count());
+	printf("\n");
+}
+
+static void run_checks()
+{
+	add_peer(NODE_B);
+	add_peer(NODE_ABSENT);
+	add_peer(BROADCAST);
+	esp_now_register_send_cb(on_send);
+	esp_now_register_recv_cb(on_recv);
+
+	// Wait for the echo node to come up
+	bool up = false;
+	for (int i = 0; (i < 100) && !up; i++) {
+		up = send_burst(NODE_B, 1).echoes > 0;
+		if (!up)
+			std::this_thread::sleep_for(20ms);
+	}
+	CHECK(up);
+	if (!up)
+		return;
+
+	// Clean link: every frame delivered, acknowledged and echoed, in order
+	auto b = send_burst(NODE_B, 100);
+	print("clean", b);
+	CHECK((b.success + b.late == 100) && (b.missing == 0) && (b.unconfirmed == 0));
+	CHECK((b.echoes == 100) && (b.reordered == 0));
+	CHECK(b.late == b.late_acks);
+
+	// Nobody acknowledges frames to an absent node
+	b = send_burst(NODE_ABSENT, 10);
+	print("absent", b);
+	CHECK((b.success == 0) && (b.missing == 10) && (b.echoes == 0) && (b.late_acks == 0));
+
+	// Broadcasts are never acknowledged, the driver reports them sent
+	b = send_burst(BROADCAST, 10);
+	print("broadcast", b);
+	CHECK((b.success == 10) && (b.fail == 0) && (b.echoes == 10));
+
+	// Loss: every lost frame fails, every delivered one is acknowledged
+	esp_now_sim_stats_t before, after;
+	esp_now_sim_get_stats(&before);
+	set_link(300, 0, 0);
+	b = send_burst(NODE_B, 500);
+	set_link(0, 0, 0);
+	esp_now_sim_get_stats(&after);
+	print("loss 30%", b);
+	const unsigned lost = after.tx_lost - before.tx_lost;
+	CHECK(after.tx_frames - before.tx_frames == 500);
+	CHECK((lost > 100) && (lost < 200));
+	CHECK((b.missing == lost) && (b.success + b.late == 500 - lost) && (b.unconfirmed == 0));
+	CHECK(b.echoes == 500 - lost);
+	CHECK(b.late == b.late_acks);
+
+	// Fixed delay holds each status back, frames stay in order
+	set_link(0, 20000, 0);
+	b = send_burst(NODE_B, 20);
+	print("delay", b);
+	CHECK((b.success + b.late == 20) && (b.echoes == 20) && (b.reordered == 0));
+	CHECK(b.min_latency >= 20ms);
+	CHECK(b.max_latency <= 20ms + ACK_TIMEOUT + SCHEDULING);
+	CHECK(b.late == b.late_acks);
+
+	// Jitter larger than the frame spacing reorders frames
+	set_link(0, 5000, 20000);
+	b = send_burst(NODE_B, 20, 20);
+	set_link(0, 0, 0);
+	print("jitter", b);
+	CHECK((b.success + b.late == 20) && (b.echoes == 20));
+	CHECK(b.reordered > 0);
+	CHECK(b.min_latency >= 5ms);
+	CHECK(b.max_latency <= 5ms + 20ms + ACK_TIMEOUT + SCHEDULING);
+	CHECK(b.late == b.late_acks);
+}
+
+int main()
+{
+	// Keep clear of other simulator runs on the default port
+	const uint16_t port = 42420 + 1 + getpid() % 1000;
+
+	const pid_t parent = getpid();
+	const pid_t echo = fork();
+	if (echo == 0) {
+		run_echo(port, parent);
+		return 0;
+	}
+
+	start_node(NODE_A, port, 1);
+	run_checks();
+	kill(echo, SIGTERM);
+	waitpid(echo, nullptr, 0);
+	esp_now_deinit();
+
+	if (failures) {
+		printf("%u checks failed\n", failures);
+		return 1;
+	}
+	printf("ok\n");
+	return 0;
+}
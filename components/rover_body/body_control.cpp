@@ -309,6 +309,7 @@ BodyControl::BodyControl() :
 			set_output(Lockout, val);
 		}),
 	state(std::make_unique<State>(*this)),
+	state_channel(nullptr),
 	state_update_callback(nullptr),
 	drive(UART_NUM_1),
 	leds(32*8, GPIO_NUM_13, 0),
@@ -319,10 +320,13 @@ BodyControl::BodyControl() :
 	singleton_instance = std::shared_ptr<BodyControl>(this);
 
 	//espnow->set_led(Core::status_led);
-	espnow->add_peer(PeerBroadcast, std::nullopt, DEFAULT_WIFI_CHANNEL);
 	espnow->add_peer(PeerRemote, std::nullopt, DEFAULT_WIFI_CHANNEL);
-	espnow->on_recv(esp_now::MessageId::Announce,
-		[this](const Message& msg) {
+	// Other controllers get registered from their Announce and remembered
+	espnow->set_learn_peers(true);
+	state_channel = &espnow->state_channel<MessageRoverBodyState>(PeerBroadcast, 10ms, 500ms);
+	state_channel->set(state->pack());
+	espnow->on_recv<esp_now::MessageAnnounce>(
+		[this](const esp_now::AnnouncePayload&, const MessageView& msg) {
 			auto peer = msg.peer();
 			ESP_LOGD(TAG, "Announce from %s", to_string(peer).c_str());
 			const auto now = time_now();
@@ -334,13 +338,40 @@ BodyControl::BodyControl() :
 			}
 			led_remote.blink_once(50);
 		});
-	espnow->on_recv(static_cast<MessageType>(RoverRemoteState),
-		[this](const Message& msg) {
-			handle_remote_state(msg.payload_as<const RemoteState>());
+	espnow->set_lane<MessageRoverRemoteState>(ESPNow::Lane::Control);
+	espnow->set_lane<MessageRoverJoypadState>(ESPNow::Lane::Control);
+	espnow->set_lane<MessageRoverRemoteStateHistory>(ESPNow::Lane::Control);
+	espnow->set_lane<MessageRoverJoypadStateHistory>(ESPNow::Lane::Control);
+	espnow->on_recv<MessageRoverRemoteState>(
+		[this](const RemoteState& st, const MessageView&) {
+			handle_remote_state(st);
 		});
-	espnow->on_recv(static_cast<MessageType>(RoverJoypadState),
-		[this](const Message& msg) {
-			handle_joypad_state(msg.payload_as<const JoypadState>());
+	espnow->on_recv<MessageRoverJoypadState>(
+		[this](const JoypadState& st, const MessageView&) {
+			handle_joypad_state(st);
+		});
+	// Replay states that didn't get a frame through, heartbeats only keep the link alive
+	espnow->on_recv<MessageRoverRemoteStateHistory>(
+		[this](const MessageRoverRemoteStateHistory::payload_type& h, const MessageView&) {
+			const auto n = remote.history.receive(h,
+					[this](const RemoteState& st) { handle_remote_state(st); });
+			if (n > 1)
+				ESP_LOGD(TAG, "Remote: replayed %zu states", n - 1);
+			if (!n) {
+				auto lock = take_unique_lock();
+				remote.last_message_time = time_now();
+			}
+		});
+	espnow->on_recv<MessageRoverJoypadStateHistory>(
+		[this](const MessageRoverJoypadStateHistory::payload_type& h, const MessageView&) {
+			const auto n = joypad.history.receive(h,
+					[this](const JoypadState& st) { handle_joypad_state(st); });
+			if (n > 1)
+				ESP_LOGD(TAG, "Joypad: replayed %zu states", n - 1);
+			if (!n) {
+				auto lock = take_unique_lock();
+				joypad.last_message_time = time_now();
+			}
 		});
 	leds.leds.setNumSegments(1);
 	leds.segments.emplace_back(leds, "led", 0, 0, 32*8);
@@ -473,28 +504,12 @@ void BodyControl::handle_loop()
 
 	joystick_drive(joypad.state.joy_right.x, joypad.state.joy_right.y);
 
-	static bool need_send_state = false;
-	wifi_set_reconnect(false);
 	const auto now = time_now();
 	ESP_LOGD(TAG, "event 0x%08x", to_underlying(event));
 	if (event & Event::StateUpdate) {
 		led_action.blink_once(100);
 		print_state();
-		need_send_state = true;
-	}
-
-	const auto since_last_state_send = now - last_state_send_time;
-	if ((since_last_state_send > 500ms) ||
-			(need_send_state && (since_last_state_send > 10ms))) {
-		try {
-			espnow->send(MessageRoverBodyState(PeerBroadcast, state->pack()));
-			Core::status_led->blink_once(100);
-			last_state_send_time = now;
-			need_send_state = false;
-		}
-		catch (const std::exception& e) {
-			ESP_LOGE(TAG, "state send failed: %s", e.what());
-		}
+		state_channel->set(state->pack());
 	}
 
 	const auto since_last_remote_state = now - remote.last_message_time;
@@ -143,7 +143,7 @@ class BodyControl :
 		static constexpr auto WAIT_TIMEOUT = 10ms;
 
 		std::unique_ptr<State> state;
-		time_point last_state_send_time;
+		esp_now::StateChannel<MessageRoverBodyState> *state_channel;
 		CallbackFn state_update_callback;
 
 		HoverDrive drive;
@@ -159,15 +159,17 @@ class BodyControl :
 		void register_console_cmd();
 		void handle_console_cmd(int argc, char **argv);
 
-		template <typename StateType>
+		template <typename MessageHistoryT>
 		struct ControlDevice
 		{
+			using StateType = typename MessageHistoryT::payload_type::state_type;
 			StateType state;
 			time_point last_message_time;
 			time_point state_time;
+			esp_now::StateHistoryReceiver<typename MessageHistoryT::payload_type> history;
 		};
-		ControlDevice<RemoteState> remote;
-		ControlDevice<JoypadState> joypad;
+		ControlDevice<MessageRoverRemoteStateHistory> remote;
+		ControlDevice<MessageRoverJoypadStateHistory> joypad;
 
 		void handle_loop();
 		void handle_remote_state(const RemoteState& remote);
@@ -1,16 +1,26 @@
 #pragma once
 
 #include "cxx_espnow_message.hpp"
+#include "cxx_espnow_state_history.hpp"
 
 using esp_now::MessageType;
 using esp_now::GenericMessage;
+using esp_now::StateHistory;
 
 enum MessageId : MessageType {
 	RoverRemoteState = 0x90,
 	RoverJoypadState = 0x91,
+	RoverRemoteStateHistory = 0x92,
+	RoverJoypadStateHistory = 0x93,
 	RoverBodyState = 0xA0,
 };
 
+/**
+ * Input states carried by each remote/joypad history frame, a state gets
+ * through unless this many frames in a row are lost
+ */
+static constexpr size_t STATE_HISTORY_DEPTH = 4;
+
 struct JoystickState
 {
 	int16_t x;
@@ -77,6 +87,8 @@ struct RemoteState :
 } __attribute__((__packed__));
 std::ostream& operator<<(std::ostream& os, const RemoteState& st);
 using MessageRoverRemoteState = GenericMessage<MessageId::RoverRemoteState, RemoteState>;
+using MessageRoverRemoteStateHistory = GenericMessage<MessageId::RoverRemoteStateHistory,
+		StateHistory<RemoteState, STATE_HISTORY_DEPTH>>;
 
 struct JoypadState :
 	public ButtonState<JoypadButton>
@@ -88,6 +100,8 @@ struct JoypadState :
 
 std::ostream& operator<<(std::ostream& os, const JoypadState& st);
 using MessageRoverJoypadState = GenericMessage<RoverJoypadState, JoypadState>;
+using MessageRoverJoypadStateHistory = GenericMessage<RoverJoypadStateHistory,
+		StateHistory<JoypadState, STATE_HISTORY_DEPTH>>;
 
 enum OutputId : uint32_t
 {
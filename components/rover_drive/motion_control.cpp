@@ -1,5 +1,6 @@
 //#define LOG_LOCAL_LEVEL ESP_LOG_VERBOSE
 
+#include <algorithm>
 #include <utility>
 #include <math.h>
 
@@ -26,22 +27,59 @@ int sign(float v) {
 		return 0;
 }
 
+static MotionControl::MotorSample motor_sample(const Vesc::vescData& data)
+{
+	return MotionControl::MotorSample {
+		.time_ms = static_cast<uint32_t>(esp_timer_get_time() / 1000),
+		.rpm = static_cast<int32_t>(data.rpm),
+		.motor_current = data.avgMotorCurrent,
+		.input_current = data.avgInputCurrent,
+		.duty = data.dutyCycleNow,
+		.voltage = data.inpVoltage,
+		.temp_fet = data.tempFet,
+		.temp_motor = data.tempMotor,
+		.tachometer = static_cast<int32_t>(data.tachometer),
+		.fault = data.faultCode,
+	};
+}
+
 MotionControl::MotionControl(Vesc& _m_l, Vesc& _m_r) :
 	Task::Task(TAG, 8*1024, 15),
 	m_l(_m_l),
-	m_r(_m_r)
+	m_r(_m_r),
+	tick_timer(nullptr),
+	tick_start_us(0),
+	tick_period_us(0),
+	last_slow_request_us(0),
+	loop(),
+	loop_mutex(),
+	history(std::make_unique<History>())
 {
 	m_l.onValues([&](Vesc& m) {
+			history->motors[Left].push(motor_sample(m.data));
 			events.set(MotorValues_Left);
 		});
 	m_r.onValues([&](Vesc& m) {
+			history->motors[Right].push(motor_sample(m.data));
 			events.set(MotorValues_Right);
 		});
 
 	m_l.setBrakeCurrent(param.brake_current);
 	m_r.setBrakeCurrent(param.brake_current);
 
+	// FreeRTOS ticks are too coarse for the control rate, deadlines come
+	// from a periodic esp_timer instead
+	const esp_timer_create_args_t timer_args = {
+		.callback = &MotionControl::tick_timer_cb,
+		.arg = this,
+		.dispatch_method = ESP_TIMER_TASK,
+		.name = "mc_tick",
+	};
+	if (esp_timer_create(&timer_args, &tick_timer) != ESP_OK)
+		throw std::runtime_error("Unable to create control timer");
+
 	Task::start();
+	register_http_handlers();
 }
 
 Vesc& MotionControl::motor_by_id(MotorId id)
@@ -95,6 +133,9 @@ void to_json(json& j, const Vesc::vescData& data)
 {
 	j = json {
 		{"timestamp", data.timestamp},
+		{"fields", data.fields},
+		{"T_fet", data.tempFet},
+		{"T_motor", data.tempMotor},
 		{"I_motor", data.avgMotorCurrent},
 		{"I_input", data.avgInputCurrent},
 		{"duty", data.dutyCycleNow},
@@ -103,7 +144,8 @@ void to_json(json& j, const Vesc::vescData& data)
 		{"E", data.ampHours},
 		{"E_ch", data.ampHoursCharged},
 		{"tach", data.tachometer},
-		{"tach_abs", data.tachometerAbs}
+		{"tach_abs", data.tachometerAbs},
+		{"fault", data.faultCode}
 	};
 }
 
@@ -133,39 +175,227 @@ const Vesc::vescData& MotionControl::get_motor_values(MotorId id)
 	return motor_by_id(id).data;
 }
 
+void MotionControl::tick_timer_cb(void *arg)
+{
+	static_cast<MotionControl *>(arg)->events.set(Tick);
+}
+
+void MotionControl::tick_timer_start(int64_t period_us)
+{
+	esp_timer_stop(tick_timer);
+	tick_period_us = period_us;
+	tick_start_us = esp_timer_get_time();
+	ESP_ERROR_CHECK(esp_timer_start_periodic(tick_timer, period_us));
+	ESP_LOGI(TAG, "control period %lld us", period_us);
+}
+
 void MotionControl::run()
 {
+	int64_t last_tick_us = 0;
+	int64_t last_deadline = -1;
+	int64_t last_request_us = 0;
+	bool telemetry_pending = false;
+	Event replies = Event(0);
+
 	while (1) {
-		m_l.getValues();
-		m_r.getValues();
-		auto ev = events.wait(Event(MotorValues_Left | MotorValues_Right),
-				param.dt / portTICK_PERIOD_MS,
-				true,
-				true);
-
-		if (ev) {
-			ESP_LOGD(TAG, "got motor values");
-			events.set(MotorValues);
-			if (motor_values_callback)
-				motor_values_callback();
+		const int64_t period_us = std::max(param.dt, MIN_DT) * 1000;
+		if (period_us != tick_period_us) {
+			tick_timer_start(period_us);
+			last_deadline = -1;
 		}
 
-		state_lock lock(state_mutex);
-		time_advance(lock);
-		update(std::move(lock));
-		/*
-		if (braking) {
-			m_l.setBrakeCurrent(param.brake_current);
-			m_r.setBrakeCurrent(param.brake_current);
-			m_l.setRPM(0);
-			m_r.setRPM(0);
+		// Telemetry is handled as it arrives, the control step runs on the
+		// tick with whatever values are newest
+		const auto ev = events.wait(Event(Tick | MotorValues), 100 / portTICK_PERIOD_MS, true, false);
+		const auto now = esp_timer_get_time();
+
+		if (ev & MotorValues) {
+			replies = Event(replies | (ev & MotorValues));
+			if ((replies & MotorValues) == MotorValues) {
+				ESP_LOGD(TAG, "got motor values");
+				replies = Event(0);
+				telemetry_pending = false;
+				{
+					std::lock_guard<std::mutex> lock(loop_mutex);
+					loop.telemetry_replies++;
+				}
+				if (motor_values_callback)
+					motor_values_callback();
+			}
 		}
-		else {
-			update();
+		if (!(ev & Tick))
+			continue;
+
+		// Index of the deadline this tick is for, timer callbacks can be
+		// delayed but never drift
+		const int64_t deadline = (now - tick_start_us) / tick_period_us;
+		const int64_t lateness = (now - tick_start_us) - deadline * tick_period_us;
+		const float dt = last_tick_us
+			? std::min<int64_t>(now - last_tick_us, 4 * tick_period_us) / 1e6f
+			: tick_period_us / 1e6f;
+
+		{
+			state_lock lock(state_mutex);
+			time_advance(lock, dt);
+			update(std::move(lock));
+		}
+
+		// Commands go out first, then the request for fresh values
+		m_l.keepAlive(now);
+		m_r.keepAlive(now);
+
+		bool requested = false, timeout = false;
+		if (now - last_request_us >= std::max(param.telemetry_dt, MIN_DT) * 1000) {
+			requested = true;
+			timeout = telemetry_pending;
+			telemetry_pending = true;
+			replies = Event(0);
+			last_request_us = now;
+			request_values(now);
+
+			state_lock lock(state_mutex);
+			record_state(lock);
 		}
-		*/
-		vTaskDelay(param.dt / portTICK_PERIOD_MS);
+
+		const auto done = esp_timer_get_time();
+		std::lock_guard<std::mutex> lock(loop_mutex);
+		loop.ticks++;
+		if ((last_deadline >= 0) && (deadline - last_deadline > 1))
+			loop.overruns += deadline - last_deadline - 1;
+		if (last_tick_us)
+			loop.period_us.add(now - last_tick_us);
+		loop.lateness_us.add(lateness);
+		loop.compute_us.add(done - now);
+		if (requested)
+			loop.telemetry_requests++;
+		if (timeout)
+			loop.telemetry_timeouts++;
+		last_deadline = deadline;
+		last_tick_us = now;
+	}
+}
+
+void MotionControl::request_values(int64_t now)
+{
+	if (!param.telemetry_selective) {
+		m_l.getValues();
+		m_r.getValues();
+		return;
 	}
+
+	// Temperatures, faults and counters change slowly, only the fields
+	// control needs are fetched every time
+	uint32_t fields = param.telemetry_fields;
+	if (now - last_slow_request_us >= param.telemetry_slow_dt * 1000) {
+		fields = Vesc::AllFields;
+		last_slow_request_us = now;
+	}
+	m_l.getValues(fields);
+	m_r.getValues(fields);
+}
+
+static MotionControl::LoopStats::Summary summarize(const LogHistogram<>& h)
+{
+	return MotionControl::LoopStats::Summary {
+		.min = h.min(),
+		.p50 = h.percentile(50),
+		.p99 = h.percentile(99),
+		.max = h.max(),
+		.mean = h.mean(),
+	};
+}
+
+MotionControl::LoopStats MotionControl::get_loop_stats() const
+{
+	std::lock_guard<std::mutex> lock(loop_mutex);
+	return LoopStats {
+		.period_us = static_cast<uint32_t>(tick_period_us),
+		.ticks = loop.ticks,
+		.overruns = loop.overruns,
+		.telemetry_requests = loop.telemetry_requests,
+		.telemetry_replies = loop.telemetry_replies,
+		.telemetry_timeouts = loop.telemetry_timeouts,
+		.period = summarize(loop.period_us),
+		.lateness = summarize(loop.lateness_us),
+		.compute = summarize(loop.compute_us),
+		.commands = {
+			m_l.commandStats(),
+			m_r.commandStats(),
+		},
+	};
+}
+
+void MotionControl::reset_loop_stats()
+{
+	std::lock_guard<std::mutex> lock(loop_mutex);
+	loop = LoopCounters();
+}
+
+void MotionControl::record_state(const state_lock& lock)
+{
+	history->state.push(StateSample {
+		.time_ms = static_cast<uint32_t>(esp_timer_get_time() / 1000),
+		.speed = state.speed,
+		.omega = state.omega,
+		.throttle_l = state.throttle_l,
+		.throttle_r = state.throttle_r,
+		.flags = static_cast<uint8_t>(
+				(state.moving ? StateSample::Moving : 0) |
+				(state.braking ? StateSample::Braking : 0) |
+				(state.accelerating ? StateSample::Accelerating : 0)),
+	});
+}
+
+const MotionControl::MotorHistory& MotionControl::get_motor_history(MotorId id) const
+{
+	return history->motors[id];
+}
+
+const MotionControl::StateHistory& MotionControl::get_state_history() const
+{
+	return history->state;
+}
+
+void to_json(json& j, const MotionControl::LoopStats::Summary& s)
+{
+	j = json {
+		{"min", s.min},
+		{"p50", s.p50},
+		{"p99", s.p99},
+		{"max", s.max},
+		{"mean", s.mean},
+	};
+}
+
+void to_json(json& j, const Vesc::CommandStats& s)
+{
+	j = json {
+		{"sent", s.sent},
+		{"suppressed", s.suppressed},
+		{"alive", s.alive},
+		{"refreshed", s.refreshed},
+	};
+}
+
+void to_json(json& j, const MotionControl::LoopStats& stats)
+{
+	j = json {
+		{"period_us", stats.period_us},
+		{"ticks", stats.ticks},
+		{"overruns", stats.overruns},
+		{"telemetry", {
+			{"requests", stats.telemetry_requests},
+			{"replies", stats.telemetry_replies},
+			{"timeouts", stats.telemetry_timeouts},
+		}},
+		{"period", stats.period},
+		{"lateness", stats.lateness},
+		{"compute", stats.compute},
+		{"commands", {
+			{"left", stats.commands[Left]},
+			{"right", stats.commands[Right]},
+		}},
+	};
 }
 
 float MotionControl::convert_speed(float v)
@@ -310,17 +540,19 @@ void MotionControl::set_accelerate(bool on) {
 	update(std::move(lock), true);
 }
 
-void MotionControl::time_advance(state_lock& lock) {
+void MotionControl::time_advance(state_lock& lock, float dt) {
 	if (!state.moving)
 		return;
 
-	state.speed = clip(state.speed + state.d_speed, -1.0, 1.0);
-	state.omega = clip(state.omega + state.d_omega, -1.0, 1.0);
+	state.speed = clip(state.speed + state.d_speed * dt, -1.0, 1.0);
+	state.omega = clip(state.omega + state.d_omega * dt, -1.0, 1.0);
 }
 
-void MotionControl::state_notify() {
+void MotionControl::state_notify(bool verbose) {
 	ESP_LOGD(TAG, "changed");
-	state.print();
+	// Ramping changes state every tick, too often to log
+	if (verbose)
+		state.print();
 	events.set(Event::StateUpdate);
 	if (state_update_callback)
 		state_update_callback();
@@ -347,6 +579,8 @@ bool MotionControl::update(MotionControl::state_lock&& lock, bool notify) {
 			m_l.brake();
 			m_r.brake();
 		}
+		if (notify)
+			record_state(lock);
 		return false;
 	}
 	else {
@@ -374,23 +608,27 @@ bool MotionControl::update(MotionControl::state_lock&& lock, bool notify) {
 		if (v_l != state.throttle_l || v_r != state.throttle_r)
 			changed = true;
 
-		if (state.speed == 0) {
-			m_l.setCurrent(0);
-			m_r.setCurrent(0);
-		}
-
+		// go_l/go_r let a wheel with zero throttle coast themselves, turning
+		// in place keeps the other one on its RPM setpoint
 		if (changed || state.moving) {
 			go_l(v_l);
 			go_r(v_r);
 		}
+		else if ((v_l == 0) && (v_r == 0)) {
+			m_l.setCurrent(0);
+			m_r.setCurrent(0);
+		}
 	}
 
 	state.timestamp = xTaskGetTickCount();
 
+	// Commands as they come in, with the throttle they resulted in
+	if (notify)
+		record_state(lock);
 	lock.unlock();
 
 	if (changed || notify) {
-		state_notify();
+		state_notify(notify);
 	}
 
 	return changed;
@@ -1,9 +1,14 @@
 #pragma once
 
+#include <memory>
+#include <mutex>
 #include <shared_mutex>
 #include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
 #include "util_task.hpp"
 #include "util_event.hpp"
+#include "util_histogram.hpp"
+#include "util_history.hpp"
 #include "vesc.hpp"
 
 #include "nlohmann/json.hpp"
@@ -19,10 +24,20 @@ public:
 	MotionControl(Vesc& _m_l, Vesc& _m_r);
 
 	struct Param {
-		int dt = 50;
+		/** Control period, ms, from MIN_DT (200 Hz) up */
+		int dt = 10;
+		/** Motor values are requested this often, ms, regardless of control rate */
+		int telemetry_dt = 50;
+		/** Use COMM_GET_VALUES_SELECTIVE, needs VESC firmware 3.40 or later */
+		bool telemetry_selective = true;
+		/** Fields requested on every telemetry_dt */
+		uint32_t telemetry_fields = Vesc::MotorCurrent | Vesc::InputCurrent |
+			Vesc::Duty | Vesc::Rpm | Vesc::InputVoltage;
+		/** All fields are requested this often, ms */
+		int telemetry_slow_dt = 1000;
 		float speed_start = 0.2,
 			  speed_turn = 0.2,
-			  acceleration = 0.05;
+			  acceleration = 1.0;	// per second
 		float speed_max = 10000;
 
 		int acceleration_current = 40000;
@@ -39,8 +54,8 @@ public:
 		float speed = 0;	// how fast we go, positive is forward
 		float omega = 0;	// how hard we turn, positive is right. if |ω| > 0.5 - turn with both sides
 	
-		float d_speed = 0;	// delta for speed
-		float d_omega = 0;	// delta for omega
+		float d_speed = 0;	// change of speed per second
+		float d_omega = 0;	// change of omega per second
 	
 		float throttle_l = 0;
 		float throttle_r = 0;
@@ -66,12 +81,78 @@ public:
 		MotorValues_Right = (1 << 1),
 		MotorValues = MotorValues_Left  | MotorValues_Right,
 
+		Tick = (1 << 2),
+
 		StateUpdate = (1 << 8),
 
 		Any = 0xff,
 	};
 	const EventGroup<Event>& get_events();
 
+	static constexpr int MIN_DT = 5;
+
+	/** Control loop timing, all times in microseconds */
+	struct LoopStats {
+		struct Summary {
+			uint32_t min, p50, p99, max, mean;
+		};
+
+		uint32_t period_us;
+		uint32_t ticks;
+		/** Deadlines passed without a control step */
+		uint32_t overruns;
+		uint32_t telemetry_requests;
+		uint32_t telemetry_replies;
+		uint32_t telemetry_timeouts;
+		/** Time between control steps */
+		Summary period;
+		/** Step start after its deadline */
+		Summary lateness;
+		/** Step duration */
+		Summary compute;
+		/** Per motor, by MotorId */
+		Vesc::CommandStats commands[2];
+	};
+	LoopStats get_loop_stats() const;
+	void reset_loop_stats();
+
+	/** Motor values as they arrive, kept for looking at a run afterwards */
+	struct MotorSample {
+		uint32_t time_ms;
+		int32_t rpm;
+		float motor_current;
+		float input_current;
+		float duty;
+		float voltage;
+		float temp_fet;
+		float temp_motor;
+		int32_t tachometer;
+		uint8_t fault;
+	} __attribute__((packed));
+
+	/** State on every command and every telemetry request */
+	struct StateSample {
+		enum Flags : uint8_t {
+			Moving = (1 << 0),
+			Braking = (1 << 1),
+			Accelerating = (1 << 2),
+		};
+
+		uint32_t time_ms;
+		float speed;
+		float omega;
+		float throttle_l;
+		float throttle_r;
+		uint8_t flags;
+	} __attribute__((packed));
+
+	/** 25 s of motor values at the default telemetry rate */
+	static constexpr size_t HISTORY_SIZE = 512;
+	using MotorHistory = HistoryRing<MotorSample, HISTORY_SIZE>;
+	using StateHistory = HistoryRing<StateSample, HISTORY_SIZE>;
+	const MotorHistory& get_motor_history(MotorId id) const;
+	const StateHistory& get_state_history() const;
+
 	// Go straight
 	void go(bool reverse);
 
@@ -103,16 +184,49 @@ private:
 
 	EventGroup<Event> events;
 
+	esp_timer_handle_t tick_timer;
+	int64_t tick_start_us;
+	int64_t tick_period_us;
+	int64_t last_slow_request_us;
+
+	struct LoopCounters {
+		uint32_t ticks = 0;
+		uint32_t overruns = 0;
+		uint32_t telemetry_requests = 0;
+		uint32_t telemetry_replies = 0;
+		uint32_t telemetry_timeouts = 0;
+		LogHistogram<> period_us;
+		LogHistogram<> lateness_us;
+		LogHistogram<> compute_us;
+	} loop;
+	mutable std::mutex loop_mutex;
+
+	struct History {
+		MotorHistory motors[2];
+		StateHistory state;
+	};
+	/** Too big for the task's or caller's stack, lives on the heap */
+	std::unique_ptr<History> history;
+	void record_state(const state_lock& lock);
+
 	void run() override;
-	void time_advance(state_lock& lock);
-	void state_notify();
+	void tick_timer_start(int64_t period_us);
+	void request_values(int64_t now);
+	static void tick_timer_cb(void *arg);
+	void time_advance(state_lock& lock, float dt);
+	void state_notify(bool verbose);
 	bool update(state_lock&& lock, bool notify = false);
 	void idle_unlocked();
 	void reset_accel_unlocked();
 	float convert_speed(float v);
 	void go_l(float v);
 	void go_r(float v);
+
+	void register_http_handlers();
 };
 
 void to_json(json& j, const MotionControl::State& state);
 void to_json(json& j, const Vesc::vescData& data);
+void to_json(json& j, const Vesc::CommandStats& s);
+void to_json(json& j, const MotionControl::LoopStats::Summary& s);
+void to_json(json& j, const MotionControl::LoopStats& stats);
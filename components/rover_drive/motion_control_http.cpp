@@ -0,0 +1,137 @@
+#include "motion_control.hpp"
+#include "core_http.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static constexpr char URL_LOOP[] = "/api/v1/mc/loop";
+static constexpr char URL_HISTORY[] = "/api/v1/mc/history";
+
+namespace {
+
+/**
+ * History query string:
+ *   src=state|left|right   which history (default state)
+ *   format=csv|bin         bin is {uint32_t seq; sample} records, packed
+ *   step=N                 every N-th sample only
+ *   since=SEQ              start at sample SEQ, for fetching what's new
+ */
+struct HistoryQuery {
+	char src[8] = "state";
+	bool binary = false;
+	uint32_t step = 1;
+	bool has_since = false;
+	uint32_t since = 0;
+
+	explicit HistoryQuery(httpd_req_t *req)
+	{
+		char query[128];
+		if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK)
+			return;
+
+		char value[16];
+		if (httpd_query_key_value(query, "src", value, sizeof(value)) == ESP_OK)
+			strlcpy(src, value, sizeof(src));
+		if (httpd_query_key_value(query, "format", value, sizeof(value)) == ESP_OK)
+			binary = !strcmp(value, "bin");
+		if (httpd_query_key_value(query, "step", value, sizeof(value)) == ESP_OK)
+			step = std::max(1l, strtol(value, nullptr, 10));
+		if (httpd_query_key_value(query, "since", value, sizeof(value)) == ESP_OK) {
+			has_since = true;
+			since = strtoul(value, nullptr, 10);
+		}
+	}
+};
+
+int csv_row(char *buf, size_t len, uint32_t seq, const MotionControl::MotorSample& s)
+{
+	return snprintf(buf, len, "%u,%u,%d,%.2f,%.2f,%.3f,%.1f,%.1f,%.1f,%d,%u\n",
+			seq, s.time_ms, s.rpm, s.motor_current, s.input_current, s.duty,
+			s.voltage, s.temp_fet, s.temp_motor, s.tachometer, s.fault);
+}
+
+int csv_row(char *buf, size_t len, uint32_t seq, const MotionControl::StateSample& s)
+{
+	return snprintf(buf, len, "%u,%u,%.3f,%.3f,%.3f,%.3f,%u,%u,%u\n",
+			seq, s.time_ms, s.speed, s.omega, s.throttle_l, s.throttle_r,
+			!!(s.flags & MotionControl::StateSample::Moving),
+			!!(s.flags & MotionControl::StateSample::Braking),
+			!!(s.flags & MotionControl::StateSample::Accelerating));
+}
+
+constexpr char MOTOR_CSV_HEADER[] =
+	"seq,time_ms,rpm,I_motor,I_input,duty,U,T_fet,T_motor,tach,fault\n";
+constexpr char STATE_CSV_HEADER[] =
+	"seq,time_ms,speed,omega,throttle_l,throttle_r,moving,braking,accelerating\n";
+
+/** Streams samples present when the request came in, a chunk at a time */
+template <typename T, size_t N>
+esp_err_t send_history(httpd_req_t *req, const HistoryRing<T, N>& ring,
+		const HistoryQuery& q, const char *csv_header)
+{
+	// Handlers run on the server task's small stack
+	static constexpr size_t BATCH = 8;
+	static constexpr size_t CSV_ROW_MAX = 96;
+
+	httpd_resp_set_type(req, q.binary ? "application/octet-stream" : "text/csv");
+	if (!q.binary && (httpd_resp_send_chunk(req, csv_header, strlen(csv_header)) != ESP_OK))
+		return ESP_FAIL;
+
+	const uint32_t end = ring.head();
+	uint32_t seq = q.has_since ? q.since : ring.tail();
+	T batch[BATCH];
+	char chunk[BATCH * CSV_ROW_MAX];
+	while (static_cast<int32_t>(end - seq) > 0) {
+		const size_t n = ring.read(seq, batch, BATCH, q.step);
+		if (!n)
+			break;
+
+		uint32_t s = seq - n * q.step;
+		size_t len = 0;
+		for (size_t i = 0; (i < n) && (static_cast<int32_t>(end - s) > 0); i++, s += q.step) {
+			if (q.binary) {
+				memcpy(chunk + len, &s, sizeof(s));
+				memcpy(chunk + len + sizeof(s), &batch[i], sizeof(T));
+				len += sizeof(s) + sizeof(T);
+			}
+			else {
+				const int row = csv_row(chunk + len, sizeof(chunk) - len, s, batch[i]);
+				len = std::min(len + std::max(row, 0), sizeof(chunk) - 1);
+			}
+		}
+		if (httpd_resp_send_chunk(req, chunk, len) != ESP_OK)
+			return ESP_FAIL;
+	}
+	return httpd_resp_send_chunk(req, nullptr, 0);
+}
+
+}
+
+void MotionControl::register_http_handlers()
+{
+	using Core::http;
+	if (!http)
+		return;
+
+	http->on(URL_LOOP, HTTP_GET, [this](httpd_req_t *req) {
+		return Core::httpd_resp_json(req, get_loop_stats());
+	});
+
+	http->on(URL_LOOP, HTTP_DELETE, [this](httpd_req_t *req) {
+		reset_loop_stats();
+		return Core::httpd_resp_json(req, get_loop_stats());
+	});
+
+	http->on(URL_HISTORY, HTTP_GET, [this](httpd_req_t *req) {
+		const HistoryQuery q(req);
+		if (!strcmp(q.src, "left"))
+			return send_history(req, get_motor_history(Left), q, MOTOR_CSV_HEADER);
+		if (!strcmp(q.src, "right"))
+			return send_history(req, get_motor_history(Right), q, MOTOR_CSV_HEADER);
+		if (!strcmp(q.src, "state"))
+			return send_history(req, get_state_history(), q, STATE_CSV_HEADER);
+		return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Unknown history source");
+	});
+}
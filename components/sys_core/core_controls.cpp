@@ -21,9 +21,38 @@ static struct {
 	struct arg_str *action;
 	struct arg_str *ctl;
 	struct arg_str *value;
+	struct arg_str *peer;
 	struct arg_end *end;
 } cmd_ctl_args;
 
+static const char *status_str(CtlStatus status)
+{
+	switch (status) {
+		case CtlStatus::Ok:
+			return "ok";
+		case CtlStatus::NotFound:
+			return "not found";
+		case CtlStatus::ReadOnly:
+			return "readonly";
+		case CtlStatus::InvalidValue:
+			return "invalid value";
+		default:
+			return "unknown";
+	}
+}
+
+/** Copy into fixed size message field, always NUL-terminated */
+static void copy_field(char *dst, size_t size, const std::string& src)
+{
+	strncpy(dst, src.c_str(), size - 1);
+	dst[size - 1] = 0;
+}
+
+static std::string field_str(const char *src, size_t size)
+{
+	return std::string(src, strnlen(src, size));
+}
+
 int handle_cmd_ctl(int argc, char **argv)
 {
 	int ret = arg_parse(argc, argv, (void **)&cmd_ctl_args);
@@ -39,8 +68,25 @@ int handle_cmd_ctl(int argc, char **argv)
 
 	const char *action = cmd_ctl_args.action->sval[0];
 	try {
+		std::optional<esp_now::PeerAddress> peer;
+		if (cmd_ctl_args.peer->count)
+			peer = esp_now::PeerAddress(cmd_ctl_args.peer->sval[0]);
+
 		if (strcmp(action, "show") == 0) {
-			controls->show();
+			if (peer)
+				controls->remote_get_all(*peer);
+			else
+				controls->show();
+		}
+		else if (strcmp(action, "get") == 0) {
+			if (!cmd_ctl_args.ctl->count) {
+				ESP_LOGE(TAG, "Control name missing");
+				return 1;
+			}
+			if (peer)
+				controls->remote_get(*peer, cmd_ctl_args.ctl->sval[0]);
+			else
+				controls->get(cmd_ctl_args.ctl->sval[0]);
 		}
 		else if (strcmp(action, "set") == 0) {
 			if (!cmd_ctl_args.ctl->count) {
@@ -51,7 +97,10 @@ int handle_cmd_ctl(int argc, char **argv)
 				ESP_LOGE(TAG, "Value missing");
 				return 1;
 			}
-			controls->set(cmd_ctl_args.ctl->sval[0], cmd_ctl_args.value->sval[0]);
+			if (peer)
+				controls->remote_set(*peer, cmd_ctl_args.ctl->sval[0], cmd_ctl_args.value->sval[0]);
+			else
+				controls->set(cmd_ctl_args.ctl->sval[0], cmd_ctl_args.value->sval[0]);
 		}
 		else {
 			ESP_LOGD(TAG, "Invalid action");
@@ -64,7 +113,8 @@ int handle_cmd_ctl(int argc, char **argv)
 	return 0;
 }
 
-Controls::Controls()
+Controls::Controls() :
+	next_request_id(1)
 {
 	register_console_cmd();
 	http->on(std::string(URL_PREFIX) + "*", HTTP_GET, [this](httpd_req_t *req) {
@@ -73,30 +123,194 @@ Controls::Controls()
 	http->on(std::string(URL_PREFIX) + "*", HTTP_POST, [this](httpd_req_t *req) {
 		return http_post_handler(req);
 	});
-	/*
-	espnow->on_recv(static_cast<esp_now::MessageType>(MessageId::CtlGet), [this](Message&& _msg) {
-			try {
-				auto req_msg = MessageGet(_msg);
-				auto req = req_msg.content();
-
-				auto& ctl = *controls.at(req.key);
-
-				CtlKeyValue resp;
-				strncpy(resp.key, req.key, KEY_LENGTH);
-				strncpy(resp.value, ctl.to_string().c_str(), VALUE_LENGTH);
-				espnow->send(MessageUpdate(req_msg.peer(), resp));
-			}
-			catch (const std::exception& e) {
-				ESP_LOGE(TAG, "MessageGet request failed: %s", e.what());
-			}
-		});
-	*/
+	if (espnow)
+		register_espnow_handlers();
+}
+
+void Controls::register_espnow_handlers()
+{
+	espnow->set_reliable<MessageGetAll>();
+	espnow->set_reliable<MessageGet>();
+	espnow->set_reliable<MessageSet>();
+	espnow->set_reliable<MessageUpdate>();
+
+	espnow->on_recv<MessageGetAll>([this](const CtlGetAllRequest& req, const esp_now::MessageView& msg) {
+		handle_get_all(msg.peer(), req);
+	});
+	espnow->on_recv<MessageGet>([this](const CtlGetRequest& req, const esp_now::MessageView& msg) {
+		handle_get(msg.peer(), req);
+	});
+	espnow->on_recv<MessageSet>([this](const CtlSetRequest& req, const esp_now::MessageView& msg) {
+		handle_set(msg.peer(), req);
+	});
+	espnow->on_recv<MessageUpdate>([this](const CtlUpdatePayload& update, const esp_now::MessageView& msg) {
+		handle_update(msg.peer(), update);
+	});
+}
+
+CtlUpdatePayload Controls::make_update(uint16_t request_id, const std::string& name) const
+{
+	CtlUpdatePayload update = {};
+	update.request_id = request_id;
+	update.count = 1;
+	copy_field(update.kv.key, KEY_LENGTH, name);
+	const auto& found = controls.find(name);
+	if (found == controls.end()) {
+		update.status = CtlStatus::NotFound;
+		return update;
+	}
+	update.status = CtlStatus::Ok;
+	copy_field(update.kv.value, VALUE_LENGTH, found->second->to_string());
+	return update;
+}
+
+void Controls::handle_get_all(const esp_now::PeerAddress& peer, const CtlGetAllRequest& req)
+{
+	// A new request from the same peer restarts the listing
+	get_all_streams[peer] = {
+		.request_id = req.request_id,
+		.next = 0,
+		.in_flight = 0,
+	};
+	get_all_pump(peer);
+}
+
+void Controls::get_all_pump(const esp_now::PeerAddress& peer)
+{
+	const auto& found = get_all_streams.find(peer);
+	if (found == get_all_streams.end())
+		return;
+
+	auto& stream = found->second;
+	const uint16_t count = controls.size();
+	while ((stream.next < count) && (stream.in_flight < GET_ALL_WINDOW)) {
+		const auto& name = std::next(controls.begin(), stream.next)->first;
+		auto update = make_update(stream.request_id, name);
+		update.index = stream.next;
+		update.count = count;
+		const auto request_id = stream.request_id;
+		try {
+			espnow->send(peer, MessageUpdate::type, &update, sizeof(update),
+				[this, peer, request_id](esp_now::SendResult result) {
+					const auto& found = get_all_streams.find(peer);
+					if ((found == get_all_streams.end()) || (found->second.request_id != request_id))
+						return;
+					found->second.in_flight--;
+					get_all_pump(peer);
+				});
+		}
+		catch (const std::exception& e) {
+			ESP_LOGW(TAG, "GetAll to %s: %s", ::to_string(peer).c_str(), e.what());
+			break;
+		}
+		stream.next++;
+		stream.in_flight++;
+	}
+
+	// Done, or stalled with nothing in flight to resume from
+	if ((stream.next >= count) || !stream.in_flight)
+		get_all_streams.erase(found);
+}
+
+void Controls::handle_get(const esp_now::PeerAddress& peer, const CtlGetRequest& req)
+{
+	const auto update = make_update(req.request_id, field_str(req.key, KEY_LENGTH));
+	try {
+		espnow->send(peer, MessageUpdate::type, &update, sizeof(update));
+	}
+	catch (const std::exception& e) {
+		ESP_LOGE(TAG, "Get from %s failed: %s", ::to_string(peer).c_str(), e.what());
+	}
+}
+
+void Controls::handle_set(const esp_now::PeerAddress& peer, const CtlSetRequest& req)
+{
+	const auto name = field_str(req.kv.key, KEY_LENGTH);
+	auto status = CtlStatus::Ok;
+	const auto& found = controls.find(name);
+	if (found == controls.end()) {
+		status = CtlStatus::NotFound;
+	}
+	else if (found->second->readonly) {
+		status = CtlStatus::ReadOnly;
+	}
+	else {
+		try {
+			found->second->from_string(field_str(req.kv.value, VALUE_LENGTH));
+			ESP_LOGI(TAG, "%s set by %s", name.c_str(), ::to_string(peer).c_str());
+		}
+		catch (const std::exception& e) {
+			status = CtlStatus::InvalidValue;
+		}
+	}
+
+	// Answer with the value in effect now
+	auto update = make_update(req.request_id, name);
+	if (status != CtlStatus::Ok)
+		update.status = status;
+	try {
+		espnow->send(peer, MessageUpdate::type, &update, sizeof(update));
+	}
+	catch (const std::exception& e) {
+		ESP_LOGE(TAG, "Set from %s failed: %s", ::to_string(peer).c_str(), e.what());
+	}
+}
+
+void Controls::handle_update(const esp_now::PeerAddress& peer, const CtlUpdatePayload& update)
+{
+	if (remote_update_cb) {
+		remote_update_cb(peer, update);
+		return;
+	}
+
+	const auto key = field_str(update.kv.key, KEY_LENGTH);
+	const auto value = field_str(update.kv.value, VALUE_LENGTH);
+	if (update.status == CtlStatus::Ok)
+		ESP_LOGI(TAG, "%s #%u [%u/%u] %s = %s", ::to_string(peer).c_str(), update.request_id,
+				update.index + 1, update.count, key.c_str(), value.c_str());
+	else
+		ESP_LOGW(TAG, "%s #%u %s: %s", ::to_string(peer).c_str(), update.request_id,
+				key.c_str(), status_str(update.status));
+}
+
+uint16_t Controls::remote_get_all(const esp_now::PeerAddress& peer)
+{
+	const CtlGetAllRequest req = {
+		.request_id = next_request_id++,
+	};
+	espnow->send(peer, MessageGetAll::type, &req, sizeof(req));
+	return req.request_id;
+}
+
+uint16_t Controls::remote_get(const esp_now::PeerAddress& peer, const char *name)
+{
+	CtlGetRequest req = {};
+	req.request_id = next_request_id++;
+	copy_field(req.key, KEY_LENGTH, name);
+	espnow->send(peer, MessageGet::type, &req, sizeof(req));
+	return req.request_id;
+}
+
+uint16_t Controls::remote_set(const esp_now::PeerAddress& peer, const char *name, const char *value)
+{
+	CtlSetRequest req = {};
+	req.request_id = next_request_id++;
+	copy_field(req.kv.key, KEY_LENGTH, name);
+	copy_field(req.kv.value, VALUE_LENGTH, value);
+	espnow->send(peer, MessageSet::type, &req, sizeof(req));
+	return req.request_id;
+}
+
+void Controls::on_remote_update(RemoteUpdateCallback&& cb)
+{
+	remote_update_cb = std::move(cb);
 }
 
 void Controls::register_console_cmd() {
-	cmd_ctl_args.action = arg_str0(NULL, NULL, "<show|set>", "Action");
+	cmd_ctl_args.action = arg_str0(NULL, NULL, "<show|get|set>", "Action");
 	cmd_ctl_args.ctl = arg_str0(NULL, NULL, "<ctl>", "Control name");
 	cmd_ctl_args.value = arg_str0(NULL, NULL, "<value>", "Value to set");
+	cmd_ctl_args.peer = arg_str0("p", "peer", "<mac>", "Act on controls of ESP-NOW peer");
 	cmd_ctl_args.end = arg_end(1);
 	static const esp_console_cmd_t cmd_ctl = {
 		.command = "ctl",
@@ -130,6 +344,11 @@ void Controls::set(const char *name, const char *value)
 	controls.at(name)->from_string(value);
 }
 
+void Controls::get(const char *name)
+{
+	std::cout << name << " = " << controls.at(name)->to_string() << std::endl;
+}
+
 esp_err_t Controls::http_get_handler(httpd_req_t *req)
 {
 	auto path = req->uri + strlen(URL_PREFIX);
@@ -1,9 +1,13 @@
 #pragma once
 
+#include <atomic>
 #include <functional>
 #include <memory>
 #include <map>
+#include <unordered_map>
 #include "AbstractControl.hpp"
+#include "core_messages.hpp"
+#include "cxx_espnow_peer.hpp"
 
 namespace Core {
 
@@ -14,11 +18,45 @@ public:
 	void add(const std::string& name, std::shared_ptr<AbstractControl> control);
 	void show();
 	void set(const char *name, const char *value);
+	void get(const char *name);
+
+	using RemoteUpdateCallback = std::function<void(const esp_now::PeerAddress& peer,
+			const CtlUpdatePayload& update)>;
+
+	/**
+	 * Query or change controls of `peer` over ESP-NOW. Answers arrive as
+	 * CtlUpdate messages passed to the remote update callback, tagged with
+	 * the returned request id. Without a callback they are logged.
+	 */
+	uint16_t remote_get_all(const esp_now::PeerAddress& peer);
+	uint16_t remote_get(const esp_now::PeerAddress& peer, const char *name);
+	uint16_t remote_set(const esp_now::PeerAddress& peer, const char *name, const char *value);
+	void on_remote_update(RemoteUpdateCallback&& cb);
 
 private:
 	static constexpr char URL_PREFIX[] = "/api/v1/ctl/";
+	/** CtlUpdates of a GetAll listing in flight at once, per requesting peer */
+	static constexpr uint16_t GET_ALL_WINDOW = 4;
 	std::map<std::string, std::shared_ptr<AbstractControl>> controls;
 
+	/** GetAll listing being streamed to a peer, only touched from the ESP-NOW task */
+	struct GetAllStream {
+		uint16_t request_id;
+		uint16_t next;
+		uint16_t in_flight;
+	};
+	std::unordered_map<esp_now::PeerAddress, GetAllStream, esp_now::PeerAddressHasher> get_all_streams;
+	std::atomic<uint16_t> next_request_id;
+	RemoteUpdateCallback remote_update_cb;
+
+	void register_espnow_handlers();
+	void handle_get_all(const esp_now::PeerAddress& peer, const CtlGetAllRequest& req);
+	void handle_get(const esp_now::PeerAddress& peer, const CtlGetRequest& req);
+	void handle_set(const esp_now::PeerAddress& peer, const CtlSetRequest& req);
+	void handle_update(const esp_now::PeerAddress& peer, const CtlUpdatePayload& update);
+	void get_all_pump(const esp_now::PeerAddress& peer);
+	CtlUpdatePayload make_update(uint16_t request_id, const std::string& name) const;
+
 	void register_console_cmd();
 	esp_err_t http_get_handler(httpd_req_t *req);
 	esp_err_t http_post_handler(httpd_req_t *req);
@@ -10,6 +10,7 @@
 #include "core_http.hpp"
 
 #include "cxx_espnow_peer.hpp"
+#include "wifi.h"
 
 #include "esp_app_format.h"
 #include "esp_log.h"
@@ -96,6 +97,23 @@ static esp_err_t system_info_get_handler(httpd_req_t *req)
 	return httpd_resp_json(req, resp);
 }
 
+static esp_err_t wifi_coex_get_handler(httpd_req_t *req)
+{
+	wifi_coex_stats_t stats;
+	wifi_get_coex_stats(&stats);
+
+	json resp = {
+		{"channel", stats.channel},
+		{"scans", stats.scans},
+		{"scan_ms", stats.scan_us / 1000},
+		{"reconnects", stats.reconnects},
+		{"rejected", stats.rejected},
+		{"channel_switches", stats.channel_switches},
+		{"off_channel_ms", stats.off_channel_us / 1000},
+	};
+	return httpd_resp_json(req, resp);
+}
+
 } // namespace
 
 HTTPServer::HTTPServer(const char *base_path)
@@ -107,6 +125,7 @@ HTTPServer::HTTPServer(const char *base_path)
 	strlcpy(context->base_path, base_path, sizeof(context->base_path));
 
 	config.uri_match_fn = httpd_uri_match_wildcard;
+	config.max_uri_handlers = MAX_ROUTES;
 
 	ESP_LOGI(REST_TAG, "Starting HTTP Server");
 	auto err = httpd_start(&server, &config);
@@ -114,6 +133,7 @@ HTTPServer::HTTPServer(const char *base_path)
 		throw std::runtime_error("HTTP server start failed");
 
 	on("/api/v1/system/info", HTTP_GET, system_info_get_handler);
+	on("/api/v1/wifi/coex", HTTP_GET, wifi_coex_get_handler);
 
 	/* URI handler for getting web server files */
 #if 0
@@ -143,12 +163,14 @@ void HTTPServer::on(
 		.handler = handler,
 	};
 	r->uri.user_ctx = r;
-	ESP_LOGI(REST_TAG, "Route %s %s",
-			(r->uri.method == HTTP_GET) ? "GET"
-			: (r->uri.method == HTTP_POST) ? "POST"
-			: "",
-			r->uri.uri);
-	httpd_register_uri_handler(server, &r->uri);
+	const char *method_name = http_method_str(method);
+	ESP_LOGI(REST_TAG, "Route %s %s", method_name, r->uri.uri);
+	auto err = httpd_register_uri_handler(server, &r->uri);
+	if (err != ESP_OK) {
+		ESP_LOGE(REST_TAG, "Route %s %s not registered: %s",
+				method_name, r->uri.uri, esp_err_to_name(err));
+		delete r;
+	}
 }
 
 esp_err_t HTTPServer::route_handler(httpd_req_t *req)
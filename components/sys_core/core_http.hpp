@@ -27,6 +27,13 @@ class HTTPServer {
 				HTTPHandler handler);
 
 	private:
+		/**
+		 * Routes registered over all components: system info and coex here,
+		 * 4 ESP-NOW, 2 controls, 2 motion control loop and its history, with
+		 * room to spare
+		 */
+		static constexpr uint16_t MAX_ROUTES = 16;
+
 		httpd_handle_t server = NULL;
 		httpd_config_t config = HTTPD_DEFAULT_CONFIG();
 
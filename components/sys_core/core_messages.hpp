@@ -19,12 +19,43 @@ struct CtlKeyValue
 	CtlValue value;
 } __attribute__((__packed__));
 
-template <typename Type>
-struct Response
+enum class CtlStatus : uint8_t {
+	Ok,
+	NotFound,
+	ReadOnly,
+	InvalidValue,
+};
+
+/** Request payloads carry an id that is echoed back in every CtlUpdate answering it */
+struct CtlGetAllRequest
+{
+	uint16_t request_id;
+} __attribute__((__packed__));
+
+struct CtlGetRequest
+{
+	uint16_t request_id;
+	CtlKey key;
+} __attribute__((__packed__));
+
+struct CtlSetRequest
+{
+	uint16_t request_id;
+	CtlKeyValue kv;
+} __attribute__((__packed__));
+
+/**
+ * Current value of a single control. GetAll is answered with one update per
+ * control, `index` counting up to `count`, so the listing spans as many
+ * frames as it needs.
+ */
+struct CtlUpdatePayload
 {
-	uint8_t request_type;
-	uint32_t request_seq;
-	Type data;
+	uint16_t request_id;
+	CtlStatus status;
+	uint16_t index;
+	uint16_t count;
+	CtlKeyValue kv;
 } __attribute__((__packed__));
 
 enum MessageId : MessageType {
@@ -34,9 +65,9 @@ enum MessageId : MessageType {
 	CtlUpdate = 0x83,
 };
 
-using MessageGetAll = GenericMessage<MessageId::CtlGetAll, void>;
-using MessageGet = GenericMessage<MessageId::CtlGet, CtlKey>;
-using MessageSet = GenericMessage<MessageId::CtlSet, CtlKeyValue>;
-using MessageUpdate = GenericMessage<MessageId::CtlUpdate, CtlKey>;
+using MessageGetAll = GenericMessage<MessageId::CtlGetAll, CtlGetAllRequest>;
+using MessageGet = GenericMessage<MessageId::CtlGet, CtlGetRequest>;
+using MessageSet = GenericMessage<MessageId::CtlSet, CtlSetRequest>;
+using MessageUpdate = GenericMessage<MessageId::CtlUpdate, CtlUpdatePayload>;
 
 };
@@ -86,18 +86,21 @@ void init(const SystemConfig& sysconf) {
 
 	const esp_app_desc_t *app_desc = esp_ota_get_app_description();
 
-	fs_init();
 	esp_netif_init();
 	ESP_ERROR_CHECK(esp_event_loop_create_default());
+	// ESP-NOW peers live on the default channel, keep the STA there too
+	wifi_set_coex_channel(DEFAULT_WIFI_CHANNEL);
 	wifi_init();
 	wifi_set_hostname(app_desc->project_name);
 	sys_console_init();
-	wifi_register_commands();
-
-	ota_server_init();
-
 	http = std::make_unique<HTTPServer>("");
+	// Bring ESP-NOW up as early as possible, it restores known peers and
+	// announces itself without waiting for the STA to connect
 	espnow = std::make_unique<esp_now::ESPNow>();
+
+	fs_init();
+	wifi_register_commands();
+	ota_server_init();
 	controls = std::make_unique<Controls>();
 }
 
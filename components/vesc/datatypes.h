@@ -479,7 +479,52 @@ typedef enum {
 	COMM_FORWARD_CAN,
 	COMM_SET_CHUCK_DATA,
 	COMM_CUSTOM_APP_DATA,
-	COMM_NRF_START_PAIRING
+	COMM_NRF_START_PAIRING,
+	COMM_GPD_SET_FSW,
+	COMM_GPD_BUFFER_NOTIFY,
+	COMM_GPD_BUFFER_SIZE_LEFT,
+	COMM_GPD_FILL_BUFFER,
+	COMM_GPD_OUTPUT_SAMPLE,
+	COMM_GPD_SET_MODE,
+	COMM_GPD_FILL_BUFFER_INT8,
+	COMM_GPD_FILL_BUFFER_INT16,
+	COMM_GPD_SET_BUFFER_INT_SCALE,
+	COMM_GET_VALUES_SETUP,
+	COMM_SET_MCCONF_TEMP,
+	COMM_SET_MCCONF_TEMP_SETUP,
+	COMM_GET_VALUES_SELECTIVE
 } COMM_PACKET_ID;
 
+// CAN commands, the frame's extended ID is (CAN_PACKET_ID << 8) | controller_id
+typedef enum {
+	CAN_PACKET_SET_DUTY = 0,
+	CAN_PACKET_SET_CURRENT,
+	CAN_PACKET_SET_CURRENT_BRAKE,
+	CAN_PACKET_SET_RPM,
+	CAN_PACKET_SET_POS,
+	CAN_PACKET_FILL_RX_BUFFER,
+	CAN_PACKET_FILL_RX_BUFFER_LONG,
+	CAN_PACKET_PROCESS_RX_BUFFER,
+	CAN_PACKET_PROCESS_SHORT_BUFFER,
+	CAN_PACKET_STATUS,
+	CAN_PACKET_SET_CURRENT_REL,
+	CAN_PACKET_SET_CURRENT_BRAKE_REL,
+	CAN_PACKET_SET_CURRENT_HANDBRAKE,
+	CAN_PACKET_SET_CURRENT_HANDBRAKE_REL,
+	CAN_PACKET_STATUS_2,
+	CAN_PACKET_STATUS_3,
+	CAN_PACKET_STATUS_4,
+	CAN_PACKET_PING,
+	CAN_PACKET_PONG,
+	CAN_PACKET_DETECT_APPLY_ALL_FOC,
+	CAN_PACKET_DETECT_APPLY_ALL_FOC_RES,
+	CAN_PACKET_CONF_CURRENT_LIMITS,
+	CAN_PACKET_CONF_STORE_CURRENT_LIMITS,
+	CAN_PACKET_CONF_CURRENT_LIMITS_IN,
+	CAN_PACKET_CONF_STORE_CURRENT_LIMITS_IN,
+	CAN_PACKET_CONF_FOC_ERPMS,
+	CAN_PACKET_CONF_STORE_FOC_ERPMS,
+	CAN_PACKET_STATUS_5
+} CAN_PACKET_ID;
+
 #endif /* DATATYPES_H_ */
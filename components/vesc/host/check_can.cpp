@@ -0,0 +1,359 @@
+/*
+ * Host check of the VESC CAN transports: setpoint frames, short and long
+ * buffer transfers both ways and status broadcasts on a MemoryCanBus with
+ * simulated controllers, then reply routing of COMM_FORWARD_CAN over a
+ * fake UART. From the repository root:
+ *
+ *   g++ -std=gnu++17 -O2 \
+ *       -Icomponents/vesc/host -Icomponents/cxx_espnow/host \
+ *       -Icomponents/vesc -Icomponents/cxx_utils \
+ *       components/vesc/host/check_can.cpp \
+ *       components/vesc/vesc.cpp components/vesc/vesc_can.cpp \
+ *       components/vesc/vesc_can_bus.cpp components/vesc/vesc_forward_can.cpp \
+ *       -x c components/vesc/buffer.c components/vesc/crc.c \
+ *       -o check_can && ./check_can
+ */
+#include "vesc.hpp"
+#include "datatypes.h"
+#include "buffer.h"
+#include "crc.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+static unsigned failures;
+
+#define CHECK(cond) do { \
+		if (!(cond)) { \
+			printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+static bool near(float a, float b, float eps)
+{
+	return std::fabs(a - b) < eps;
+}
+
+/** Values reply for `fields` as a controller would send it */
+static std::vector<uint8_t> values_reply(const Vesc::vescData& v, uint32_t fields)
+{
+	uint8_t buf[PACKET_MAX_PL_LEN];
+	int32_t ind = 0;
+	buf[ind++] = COMM_GET_VALUES_SELECTIVE;
+	buffer_append_uint32(buf, fields, &ind);
+	ind += Vesc::encodeValues(v, fields, buf + ind);
+	return std::vector<uint8_t>(buf, buf + ind);
+}
+
+/** Length of the COMM_FW_VERSION reply, long enough for FILL_RX_BUFFER_LONG */
+static constexpr size_t FW_REPLY_LENGTH = 300;
+
+/**
+ * Controller on the bus, answering values and firmware version requests
+ * with the framing of comm_can_send_buffer() and taking RPM setpoints
+ */
+class SimVesc {
+public:
+	SimVesc(MemoryCanBus& _bus, uint8_t _id) :
+		bus(_bus),
+		id(_id)
+	{
+		bus.subscribe([this](const CanFrame& frame) { receive(frame); });
+	}
+
+	int32_t rpm = 0;
+	unsigned setpoints = 0;
+	unsigned requests = 0;
+	unsigned crc_errors = 0;
+
+	/** Broadcast CAN_PACKET_STATUS and CAN_PACKET_STATUS_4 */
+	void status(int16_t current_x10, int16_t duty_x1000, int16_t temp_fet_x10, int16_t input_current_x10)
+	{
+		uint8_t data[8];
+		int32_t ind = 0;
+		buffer_append_int32(data, rpm, &ind);
+		buffer_append_int16(data, current_x10, &ind);
+		buffer_append_int16(data, duty_x1000, &ind);
+		send(CAN_PACKET_STATUS, id, data, ind);
+
+		ind = 0;
+		buffer_append_int16(data, temp_fet_x10, &ind);
+		buffer_append_int16(data, 0, &ind);
+		buffer_append_int16(data, input_current_x10, &ind);
+		buffer_append_int16(data, 0, &ind);
+		send(CAN_PACKET_STATUS_4, id, data, ind);
+	}
+
+private:
+	MemoryCanBus& bus;
+	uint8_t id;
+	uint8_t rx_buf[PACKET_MAX_PL_LEN];
+
+	void send(uint8_t type, uint8_t target, const uint8_t *data, uint8_t len)
+	{
+		CanFrame frame = {
+			.id = static_cast<uint32_t>(type << 8) | target,
+			.extended = true,
+			.length = len,
+			.data = {},
+		};
+		memcpy(frame.data, data, len);
+		bus.send(frame);
+	}
+
+	void reply(uint8_t to, const std::vector<uint8_t>& packet)
+	{
+		const uint8_t *data = packet.data();
+		const size_t len = packet.size();
+		uint8_t buf[8];
+		if (len <= 6) {
+			buf[0] = id;
+			buf[1] = 1;
+			memcpy(buf + 2, data, len);
+			send(CAN_PACKET_PROCESS_SHORT_BUFFER, to, buf, len + 2);
+			return;
+		}
+
+		size_t i = 0;
+		for (; (i < len) && (i <= 255); i += 7) {
+			const size_t n = std::min<size_t>(7, len - i);
+			buf[0] = i;
+			memcpy(buf + 1, data + i, n);
+			send(CAN_PACKET_FILL_RX_BUFFER, to, buf, n + 1);
+		}
+		for (; i < len; i += 6) {
+			const size_t n = std::min<size_t>(6, len - i);
+			buf[0] = i >> 8;
+			buf[1] = i & 0xFF;
+			memcpy(buf + 2, data + i, n);
+			send(CAN_PACKET_FILL_RX_BUFFER_LONG, to, buf, n + 2);
+		}
+		const uint16_t crc = crc16(const_cast<uint8_t *>(data), len);
+		buf[0] = id;
+		buf[1] = 1;
+		buf[2] = len >> 8;
+		buf[3] = len & 0xFF;
+		buf[4] = crc >> 8;
+		buf[5] = crc & 0xFF;
+		send(CAN_PACKET_PROCESS_RX_BUFFER, to, buf, 6);
+	}
+
+	void process(uint8_t from, const uint8_t *packet, size_t len)
+	{
+		requests++;
+		if ((packet[0] == COMM_GET_VALUES_SELECTIVE) && (len >= 5)) {
+			int32_t ind = 1;
+			const uint32_t fields = buffer_get_uint32(packet, &ind);
+			Vesc::vescData v = {};
+			v.rpm = rpm;
+			v.tempFet = 33.3;
+			v.controllerId = id;
+			reply(from, values_reply(v, fields));
+		}
+		else if (packet[0] == COMM_FW_VERSION) {
+			std::vector<uint8_t> out(FW_REPLY_LENGTH);
+			for (size_t i = 0; i < out.size(); i++)
+				out[i] = i * 3;
+			out[0] = COMM_FW_VERSION;
+			reply(from, out);
+		}
+	}
+
+	void receive(const CanFrame& frame)
+	{
+		const uint8_t type = frame.id >> 8;
+		if ((frame.id & 0xFF) != id)
+			return;
+
+		int32_t ind = 0;
+		switch (type) {
+			case CAN_PACKET_SET_RPM:
+				rpm = buffer_get_int32(frame.data, &ind);
+				setpoints++;
+				break;
+
+			case CAN_PACKET_FILL_RX_BUFFER:
+				memcpy(rx_buf + frame.data[0], frame.data + 1, frame.length - 1);
+				break;
+
+			case CAN_PACKET_FILL_RX_BUFFER_LONG:
+				memcpy(rx_buf + ((frame.data[0] << 8) | frame.data[1]), frame.data + 2, frame.length - 2);
+				break;
+
+			case CAN_PACKET_PROCESS_RX_BUFFER: {
+				const size_t len = (frame.data[2] << 8) | frame.data[3];
+				if (crc16(rx_buf, len) != ((frame.data[4] << 8) | frame.data[5])) {
+					crc_errors++;
+					break;
+				}
+				process(frame.data[0], rx_buf, len);
+				break;
+			}
+
+			case CAN_PACKET_PROCESS_SHORT_BUFFER:
+				process(frame.data[0], frame.data + 2, frame.length - 2);
+				break;
+		}
+	}
+};
+
+/**
+ * UART link to controller 1 with more behind it on CAN. Replies are held
+ * back until deliver(), so they can come in any order.
+ */
+class FakeUart : public VescInterface {
+public:
+	FakeUart() : VescInterface("uart") {}
+
+	std::vector<std::vector<uint8_t>> replies;
+
+	virtual void onPacketCallback(ReceivePacketCb&& cb) { rx_callback = std::move(cb); }
+
+	virtual int sendPacket(uint8_t *packet, int len)
+	{
+		sentPacket(packet, len);
+
+		uint8_t source = 1;
+		if (packet[0] == COMM_FORWARD_CAN) {
+			source = packet[1];
+			packet += 2;
+		}
+
+		if (packet[0] == COMM_GET_VALUES_SELECTIVE) {
+			int32_t ind = 1;
+			const uint32_t fields = buffer_get_uint32(packet, &ind);
+			Vesc::vescData v = {};
+			v.rpm = source * 1000;
+			v.controllerId = source;
+			replies.push_back(values_reply(v, fields));
+		}
+		else if (packet[0] == COMM_FW_VERSION) {
+			replies.push_back({COMM_FW_VERSION, source});
+		}
+		return len;
+	}
+
+	void deliver(size_t i) { receivePacket(replies[i].data(), replies[i].size()); }
+};
+
+static void check_can_bus()
+{
+	MemoryCanBus bus;
+	SimVesc sim5(bus, 5), sim6(bus, 6);
+	VescCanInterface if5("can5", bus, 5), if6("can6", bus, 6);
+	Vesc vesc5(if5), vesc6(if6);
+	unsigned values5 = 0, values6 = 0;
+	vesc5.onValues([&](Vesc&) { values5++; });
+	vesc6.onValues([&](Vesc&) { values6++; });
+
+	// Setpoints go out as single CAN_PACKET_SET_* frames to their controller
+	const uint32_t frames = bus.frames();
+	vesc5.setRPM(1234);
+	vesc6.setRPM(-99);
+	CHECK(bus.frames() == frames + 2);
+	CHECK((sim5.rpm == 1234) && (sim5.setpoints == 1));
+	CHECK((sim6.rpm == -99) && (sim6.setpoints == 1));
+
+	// Short request, reply in FILL_RX_BUFFER frames
+	vesc5.getValues(Vesc::Rpm | Vesc::TempFet);
+	CHECK((sim5.requests == 1) && (sim6.requests == 0));
+	CHECK((values5 == 1) && (values6 == 0));
+	CHECK(vesc5.data.rpm == 1234);
+	CHECK(near(vesc5.data.tempFet, 33.3, 0.1));
+	CHECK(vesc5.data.fields == (Vesc::Rpm | Vesc::TempFet));
+
+	vesc6.getValues(Vesc::AllFields);
+	CHECK((values6 == 1) && (vesc6.data.rpm == -99) && (vesc6.data.controllerId == 6));
+
+	// Status broadcasts arrive as values without a request
+	sim6.status(123, 500, 456, 55);
+	CHECK(values6 == 3);
+	CHECK(near(vesc6.data.avgMotorCurrent, 12.3, 0.01));
+	CHECK(near(vesc6.data.dutyCycleNow, 0.5, 0.001));
+	CHECK(near(vesc6.data.tempFet, 45.6, 0.01));
+	CHECK(near(vesc6.data.avgInputCurrent, 5.5, 0.01));
+	CHECK(vesc6.data.fields == (Vesc::TempFet | Vesc::TempMotor | Vesc::InputCurrent | Vesc::PidPos));
+	sim6.status(-77, -250, 0, 0);
+	CHECK(values6 == 5);
+	CHECK(near(vesc6.data.avgMotorCurrent, -7.7, 0.01));
+	CHECK(near(vesc6.data.dutyCycleNow, -0.25, 0.001));
+	CHECK(values5 == 1);
+
+	// Long request out, long reply back through FILL_RX_BUFFER_LONG
+	std::vector<uint8_t> reply;
+	if5.onPacketCallback([&](uint8_t *packet, size_t len) { reply.assign(packet, packet + len); });
+	std::vector<uint8_t> request(400);
+	request[0] = COMM_FW_VERSION;
+	CHECK(if5.sendPacket(request.data(), request.size()) == static_cast<int>(request.size()));
+	CHECK(sim5.crc_errors == 0);
+	CHECK(reply.size() == FW_REPLY_LENGTH);
+	bool intact = (reply.size() == FW_REPLY_LENGTH) && (reply[0] == COMM_FW_VERSION);
+	for (size_t i = 1; intact && (i < reply.size()); i++)
+		intact = (reply[i] == static_cast<uint8_t>(i * 3));
+	CHECK(intact);
+
+	printf("can bus: %u frames\n", bus.frames());
+}
+
+static void check_forwarding()
+{
+	FakeUart uart;
+	VescForwardCANInterface fwd2("fwd2", uart, 2), fwd3("fwd3", uart, 3);
+	Vesc local(uart), vesc2(fwd2), vesc3(fwd3);
+	unsigned values[4] = {};
+	local.onValues([&](Vesc&) { values[1]++; });
+	vesc2.onValues([&](Vesc&) { values[2]++; });
+	vesc3.onValues([&](Vesc&) { values[3]++; });
+
+	// Values replies name their controller, whatever order they come in
+	vesc3.getValues(Vesc::Rpm);
+	vesc2.getValues(Vesc::Rpm);
+	local.getValues(Vesc::Rpm);
+	CHECK(uart.replies.size() == 3);
+	uart.deliver(2);
+	uart.deliver(0);
+	uart.deliver(1);
+	CHECK((values[1] == 1) && (local.data.rpm == 1000));
+	CHECK((values[2] == 1) && (vesc2.data.rpm == 2000));
+	CHECK((values[3] == 1) && (vesc3.data.rpm == 3000));
+
+	// A truncated values reply is dropped whole
+	Vesc::vescData v = {};
+	v.rpm = 9999;
+	v.tempFet = 99;
+	uart.replies.push_back(values_reply(v, Vesc::Rpm | Vesc::TempFet));
+	uart.replies.back().pop_back();
+	uart.deliver(3);
+	CHECK((values[1] == 1) && (local.data.rpm == 1000) && (local.data.tempFet == 0));
+
+	// Other replies are matched to requests in order
+	int source[4] = {-1, -1, -1, -1};
+	uart.onPacketCallback([&](uint8_t *packet, size_t) { source[1] = packet[1]; });
+	fwd2.onPacketCallback([&](uint8_t *packet, size_t) { source[2] = packet[1]; });
+	fwd3.onPacketCallback([&](uint8_t *packet, size_t) { source[3] = packet[1]; });
+	uint8_t fw = COMM_FW_VERSION;
+	fwd3.sendPacket(&fw, 1);
+	uart.sendPacket(&fw, 1);
+	fwd2.sendPacket(&fw, 1);
+	uart.deliver(4);
+	uart.deliver(5);
+	uart.deliver(6);
+	CHECK((source[1] == 1) && (source[2] == 2) && (source[3] == 3));
+
+	printf("forwarding: %zu replies\n", uart.replies.size());
+}
+
+int main()
+{
+	check_can_bus();
+	check_forwarding();
+	if (failures) {
+		printf("%u checks failed\n", failures);
+		return 1;
+	}
+	printf("ok\n");
+	return 0;
+}
@@ -0,0 +1,6 @@
+/* Host stand-in for driver/uart.h, the types vesc.hpp refers to */
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+typedef int uart_port_t;
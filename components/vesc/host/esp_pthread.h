@@ -0,0 +1,16 @@
+/* Host stand-in for esp_pthread.h, declarations for util_task.hpp */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+	size_t stack_size;
+	size_t prio;
+	bool inherit_cfg;
+	const char *thread_name;
+	int pin_to_core;
+} esp_pthread_cfg_t;
+
+esp_pthread_cfg_t esp_pthread_get_default_config(void);
+int esp_pthread_set_cfg(const esp_pthread_cfg_t *cfg);
@@ -0,0 +1,4 @@
+/* Host stand-in for esp_system.h, nothing of it is used by host builds */
+#pragma once
+
+#include <stdint.h>
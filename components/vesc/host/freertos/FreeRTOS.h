@@ -0,0 +1,14 @@
+/* Host stand-in for FreeRTOS.h, types and tick rate */
+#pragma once
+
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef struct QueueDefinition *QueueHandle_t;
+typedef struct tskTaskControlBlock *TaskHandle_t;
+
+#define portTICK_PERIOD_MS 1
+
+BaseType_t xPortGetCoreID(void);
@@ -0,0 +1,15 @@
+/* Host stand-in for freertos/task.h, the tick count runs off the monotonic clock */
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+
+static inline TickType_t xTaskGetTickCount(void)
+{
+	return esp_timer_get_time() / 1000 / portTICK_PERIOD_MS;
+}
+
+void vTaskDelay(TickType_t ticks);
+char *pcTaskGetName(TaskHandle_t task);
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task);
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
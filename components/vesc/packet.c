@@ -40,7 +40,7 @@ void packet_send_packet(bldc_packet_state_t *state, unsigned char *data, unsigne
 
 	int b_ind = 0;
 
-	if (len <= 256) {
+	if (len <= 255) {
 		state->tx_buffer[b_ind++] = 2;
 		state->tx_buffer[b_ind++] = len;
 	} else {
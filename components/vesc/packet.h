@@ -27,6 +27,10 @@
 
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 // Settings
 #define PACKET_RX_TIMEOUT		2
 #define PACKET_MAX_PL_LEN		512
@@ -52,4 +56,8 @@ void packet_process_byte(bldc_packet_state_t *state, uint8_t rx_data);
 void packet_timerfunc(bldc_packet_state_t *state);
 void packet_send_packet(bldc_packet_state_t *state, unsigned char *data, unsigned int len);
 
+#ifdef __cplusplus
+};
+#endif
+
 #endif /* PACKET_H_ */
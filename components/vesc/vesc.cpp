@@ -1,5 +1,7 @@
 //#define LOG_LOCAL_LEVEL ESP_LOG_VERBOSE
+#include <cassert>
 #include <functional>
+#include <stddef.h>
 #include <string.h>
 #include "vesc.hpp"
 #include "datatypes.h"
@@ -7,65 +9,259 @@
 
 #define TAG (this->interface.name)
 
-Vesc::Vesc(VescInterface& _interface) : interface(_interface) {
+Vesc::Vesc(VescInterface& _interface) :
+	data(),
+	interface(_interface),
+	setpoint(),
+	alive_us(DEFAULT_ALIVE_MS * 1000LL),
+	refresh_us(DEFAULT_REFRESH_MS * 1000LL),
+	command_stats(),
+	command_mutex()
+{
 	ESP_LOGI(TAG, "initializing");
-	interface.onPacketCallback(std::move(std::bind(&Vesc::processReadPacket, this, std::placeholders::_1)));
+	interface.onPacketCallback(std::move(std::bind(&Vesc::processReadPacket, this,
+				std::placeholders::_1, std::placeholders::_2)));
 };
 
 void Vesc::printValues() {
-	ESP_LOGI(TAG, "Im %f, duty %f, rpm %ld, U %f, ∑ %ld",
+	ESP_LOGI(TAG, "Im %f, duty %f, rpm %ld, U %f, ∑ %ld, T %.1f/%.1f, fault %u",
 			data.avgMotorCurrent,
 			data.dutyCycleNow,
 			data.rpm,
 			data.inpVoltage,
-			data.tachometerAbs);
+			data.tachometerAbs,
+			data.tempFet,
+			data.tempMotor,
+			data.faultCode);
 }
 
-bool Vesc::processReadPacket(uint8_t * message) {
+namespace {
+
+enum class Encoding {
+	Float16,
+	Float32,
+	Int32,
+	Uint8,
+};
+
+struct ValueField {
+	uint32_t field;
+	Encoding encoding;
+	float scale;
+	size_t offset;
+};
+
+#define VALUE(_field, _encoding, _scale, _member) \
+	{ Vesc::_field, Encoding::_encoding, _scale, offsetof(Vesc::vescData, _member) }
+
+// Payload layout of COMM_GET_VALUES, see commands.c in VESC firmware. Fields
+// are optional in COMM_GET_VALUES_SELECTIVE, one entry may span several table
+// rows (TempMos).
+const ValueField value_fields[] = {
+	VALUE(TempFet,			Float16,	10,			tempFet),
+	VALUE(TempMotor,		Float16,	10,			tempMotor),
+	VALUE(MotorCurrent,		Float32,	100,		avgMotorCurrent),
+	VALUE(InputCurrent,		Float32,	100,		avgInputCurrent),
+	VALUE(CurrentD,			Float32,	100,		avgId),
+	VALUE(CurrentQ,			Float32,	100,		avgIq),
+	VALUE(Duty,				Float16,	1000,		dutyCycleNow),
+	VALUE(Rpm,				Int32,		1,			rpm),
+	VALUE(InputVoltage,		Float16,	10,			inpVoltage),
+	VALUE(AmpHours,			Float32,	10000,		ampHours),
+	VALUE(AmpHoursCharged,	Float32,	10000,		ampHoursCharged),
+	VALUE(WattHours,		Float32,	10000,		wattHours),
+	VALUE(WattHoursCharged,	Float32,	10000,		wattHoursCharged),
+	VALUE(Tachometer,		Int32,		1,			tachometer),
+	VALUE(TachometerAbs,	Int32,		1,			tachometerAbs),
+	VALUE(FaultCode,		Uint8,		1,			faultCode),
+	VALUE(PidPos,			Float32,	1000000,	pidPos),
+	VALUE(ControllerId,		Uint8,		1,			controllerId),
+	VALUE(TempMos,			Float16,	10,			tempMos[0]),
+	VALUE(TempMos,			Float16,	10,			tempMos[1]),
+	VALUE(TempMos,			Float16,	10,			tempMos[2]),
+	VALUE(VoltageD,			Float32,	1000,		vd),
+	VALUE(VoltageQ,			Float32,	1000,		vq),
+};
+
+#undef VALUE
+
+size_t encoded_size(Encoding encoding)
+{
+	switch (encoding) {
+		case Encoding::Float16:
+			return 2;
+		case Encoding::Uint8:
+			return 1;
+		default:
+			return 4;
+	}
+}
+
+}
+
+uint32_t Vesc::decodeValues(const uint8_t *message, size_t len, uint32_t fields, vescData& values) {
+	uint32_t decoded = 0;
+	int32_t ind = 0;
+	auto base = reinterpret_cast<uint8_t *>(&values);
+
+	for (const auto& f : value_fields) {
+		if (!(fields & f.field))
+			continue;
+		// Older firmware sends fewer fields, keep what is there
+		if (ind + encoded_size(f.encoding) > len) {
+			decoded &= ~f.field;
+			break;
+		}
+
+		auto dst = base + f.offset;
+		switch (f.encoding) {
+			case Encoding::Float16:
+				*reinterpret_cast<float *>(dst) = buffer_get_float16(message, f.scale, &ind);
+				break;
+			case Encoding::Float32:
+				*reinterpret_cast<float *>(dst) = buffer_get_float32(message, f.scale, &ind);
+				break;
+			case Encoding::Int32:
+				*reinterpret_cast<long *>(dst) = buffer_get_int32(message, &ind);
+				break;
+			case Encoding::Uint8:
+				*dst = message[ind++];
+				break;
+		}
+		decoded |= f.field;
+	}
+	return decoded;
+}
+
+size_t Vesc::encodeValues(const vescData& values, uint32_t fields, uint8_t *buf) {
+	int32_t ind = 0;
+	auto base = reinterpret_cast<const uint8_t *>(&values);
+
+	for (const auto& f : value_fields) {
+		if (!(fields & f.field))
+			continue;
+
+		auto src = base + f.offset;
+		switch (f.encoding) {
+			case Encoding::Float16:
+				buffer_append_float16(buf, *reinterpret_cast<const float *>(src), f.scale, &ind);
+				break;
+			case Encoding::Float32:
+				buffer_append_float32(buf, *reinterpret_cast<const float *>(src), f.scale, &ind);
+				break;
+			case Encoding::Int32:
+				buffer_append_int32(buf, *reinterpret_cast<const long *>(src), &ind);
+				break;
+			case Encoding::Uint8:
+				buf[ind++] = *src;
+				break;
+		}
+	}
+	return ind;
+}
+
+int Vesc::valuesControllerId(const uint8_t *packet, size_t len) {
+	uint32_t fields;
+	size_t ind = 1;
+
+	if (len < 1)
+		return -1;
+
+	switch (packet[0]) {
+		case COMM_GET_VALUES:
+			fields = AllFields;
+			break;
+
+		case COMM_GET_VALUES_SELECTIVE: {
+			if (len < 5)
+				return -1;
+			int32_t mask_ind = 1;
+			fields = buffer_get_uint32(packet, &mask_ind);
+			ind = mask_ind;
+			break;
+		}
+
+		default:
+			return -1;
+	}
+	if (!(fields & ControllerId))
+		return -1;
+
+	for (const auto& f : value_fields) {
+		if (f.field == ControllerId)
+			return (ind < len) ? packet[ind] : -1;
+		if (fields & f.field)
+			ind += encoded_size(f.encoding);
+	}
+	return -1;
+}
+
+bool Vesc::processReadPacket(uint8_t *message, size_t len) {
 	ESP_LOGD(TAG, "processReadPacket, this = %p, this->interface = %p", this, &this->interface);
 
 	COMM_PACKET_ID packetId;
+	uint32_t fields;
 	int32_t ind = 0;
+	// Fields the reply doesn't carry keep their last values, a short reply changes nothing
+	vescData values = data;
+
+	if (len < 1)
+		return false;
 
 	packetId = (COMM_PACKET_ID)message[0];
 	message++; // Removes the packetId from the actual message (payload)
+	len--;
 
 	switch (packetId){
 		case COMM_GET_VALUES: // Structure defined here: https://github.com/vedderb/bldc/blob/43c3bbaf91f5052a35b75c2ff17b5fe99fad94d1/commands.c#L164
-			ind = 4; // Skip the first 4 bytes 
-			data.avgMotorCurrent 	= buffer_get_float32(message, 100.0, &ind);
-			data.avgInputCurrent 	= buffer_get_float32(message, 100.0, &ind);
-			ind += 8; // Skip the next 8 bytes
-			data.dutyCycleNow 		= buffer_get_float16(message, 1000.0, &ind);
-			data.rpm 				= buffer_get_int32(message, &ind);
-			data.inpVoltage 		= buffer_get_float16(message, 10.0, &ind);
-			data.ampHours 			= buffer_get_float32(message, 10000.0, &ind);
-			data.ampHoursCharged 	= buffer_get_float32(message, 10000.0, &ind);
-			ind += 8; // Skip the next 8 bytes 
-			data.tachometer 		= buffer_get_int32(message, &ind);
-			data.tachometerAbs 		= buffer_get_int32(message, &ind);
-
-			data.timestamp = xTaskGetTickCount();
-			if (cb_values) {
-				cb_values(*this);
+			fields = decodeValues(message, len, AllFields, values);
+			if (!(fields & TachometerAbs)) {
+				ESP_LOGW(TAG, "short COMM_GET_VALUES reply: %u bytes", static_cast<unsigned>(len));
+				return false;
+			}
+			break;
+
+		case COMM_GET_VALUES_SELECTIVE:
+			if (len < 4)
+				return false;
+			fields = buffer_get_uint32(message, &ind);
+			if (decodeValues(message + ind, len - ind, fields, values) != fields) {
+				ESP_LOGW(TAG, "short COMM_GET_VALUES_SELECTIVE reply: %u bytes for fields 0x%x",
+						static_cast<unsigned>(len), fields);
+				return false;
 			}
-			return true;
 			break;
 
 		default:
 			ESP_LOGW(TAG, "received unexpected packet type: 0x%x", packetId);
 			return false;
-			break;
 	}
+
+	values.fields = fields;
+	values.timestamp = xTaskGetTickCount();
+	data = values;
+	if (cb_values) {
+		cb_values(*this);
+	}
+	return true;
 }
 
 void Vesc::getValues(void) {
 	uint8_t command[1] = { COMM_GET_VALUES };
 
-	interface.rxStart();
 	interface.sendPacket(command, 1);
 }
 
+void Vesc::getValues(uint32_t fields) {
+	int32_t index = 0;
+	uint8_t payload[5];
+
+	payload[index++] = COMM_GET_VALUES_SELECTIVE;
+	buffer_append_uint32(payload, fields, &index);
+
+	interface.sendPacket(payload, 5);
+}
+
 void Vesc::onValues(CallbackFn&& cb) {
 	ESP_LOGD(TAG, "set onValues cb, this = %p", this);
 	cb_values = cb;
@@ -77,44 +273,76 @@ void Vesc::sendMsg(uint8_t *msg, uint16_t len) {
 	last_message_len = len;
 }
 
-void Vesc::setCurrent(float current) {
+void Vesc::sendCommand(const std::unique_lock<std::mutex>& lock, uint8_t command, int32_t value) {
+	// Only there to prove command_mutex is held
+	assert(lock.owns_lock());
+	(void)lock;
+
 	int32_t index = 0;
 	uint8_t payload[5];
 
-	payload[index++] = COMM_SET_CURRENT;
-	buffer_append_int32(payload, (int32_t)(current * 1000), &index);
+	payload[index++] = command;
+	buffer_append_int32(payload, value, &index);
 
 	interface.sendPacket(payload, 5);
 }
 
-void Vesc::setBrakeCurrent(float brakeCurrent) {
-	int32_t index = 0;
-	uint8_t payload[5];
+void Vesc::sendSetpoint(uint8_t command, int32_t value) {
+	std::unique_lock<std::mutex> lock(command_mutex);
+	if (setpoint.valid && (setpoint.command == command) && (setpoint.value == value)) {
+		command_stats.suppressed++;
+		return;
+	}
+
+	sendCommand(lock, command, value);
+	const auto now = esp_timer_get_time();
+	setpoint = { true, command, value, now, now };
+	command_stats.sent++;
+}
 
-	payload[index++] = COMM_SET_CURRENT_BRAKE;
-	buffer_append_int32(payload, (int32_t)(brakeCurrent * 1000), &index);
+void Vesc::keepAlive(int64_t now_us) {
+	std::unique_lock<std::mutex> lock(command_mutex);
+	if (!setpoint.valid)
+		return;
 
-	interface.sendPacket(payload, 5);
+	if (now_us - setpoint.refreshed_us >= refresh_us) {
+		sendCommand(lock, setpoint.command, setpoint.value);
+		setpoint.sent_us = setpoint.refreshed_us = now_us;
+		command_stats.refreshed++;
+	}
+	else if (now_us - setpoint.sent_us >= alive_us) {
+		uint8_t command[1] = { COMM_ALIVE };
+		interface.sendPacket(command, 1);
+		setpoint.sent_us = now_us;
+		command_stats.alive++;
+	}
 }
 
-void Vesc::setRPM(float rpm) {
-	int32_t index = 0;
-	uint8_t payload[5];
+void Vesc::setKeepAlive(int alive_ms, int refresh_ms) {
+	std::unique_lock<std::mutex> lock(command_mutex);
+	alive_us = alive_ms * 1000LL;
+	refresh_us = refresh_ms * 1000LL;
+}
 
-	payload[index++] = COMM_SET_RPM ;
-	buffer_append_int32(payload, (int32_t)(rpm), &index);
+Vesc::CommandStats Vesc::commandStats() {
+	std::unique_lock<std::mutex> lock(command_mutex);
+	return command_stats;
+}
 
-	interface.sendPacket(payload, 5);
+void Vesc::setCurrent(float current) {
+	sendSetpoint(COMM_SET_CURRENT, (int32_t)(current * 1000));
 }
 
-void Vesc::setDuty(float duty) {
-	int32_t index = 0;
-	uint8_t payload[5];
+void Vesc::setBrakeCurrent(float brakeCurrent) {
+	sendSetpoint(COMM_SET_CURRENT_BRAKE, (int32_t)(brakeCurrent * 1000));
+}
 
-	payload[index++] = COMM_SET_DUTY;
-	buffer_append_int32(payload, (int32_t)(duty * 100000), &index);
+void Vesc::setRPM(float rpm) {
+	sendSetpoint(COMM_SET_RPM, (int32_t)(rpm));
+}
 
-	interface.sendPacket(payload, 5);
+void Vesc::setDuty(float duty) {
+	sendSetpoint(COMM_SET_DUTY, (int32_t)(duty * 100000));
 }
 
 void Vesc::kill() {
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <deque>
 #include <functional>
+#include <mutex>
+#include <vector>
 #include "esp_system.h"
 #include "esp_log.h"
 #include "driver/uart.h"
@@ -8,18 +11,44 @@
 #include "util_task.hpp"
 
 #include "packet.h"
+#include "vesc_can_bus.hpp"
+
+class VescForwardCANInterface;
 
 class VescInterface {
 public:
-	using ReceivePacketCb = std::function<void(uint8_t *packet)>;
+	using ReceivePacketCb = std::function<void(uint8_t *packet, size_t len)>;
 
 	VescInterface(const char *_name) : name(_name) {}
 	const char *name;
 	ReceivePacketCb rx_callback;
 	virtual int sendPacket(uint8_t *packet, int len) = 0;
 	virtual void onPacketCallback(ReceivePacketCb&& cb) = 0;
-	virtual void rxStart() = 0;
+
+	/** Route replies from a controller reached through this one */
+	void addForwarded(VescForwardCANInterface& iface);
+
+protected:
+	/** Hand a received packet to whoever it is a reply for */
+	void receivePacket(uint8_t *packet, size_t len);
+	/** Note an outgoing packet, to route its reply when forwarding */
+	void sentPacket(const uint8_t *packet, size_t len);
+
 private:
+	/**
+	 * Replies forwarded from CAN carry no source address. Values replies
+	 * name their controller, anything else is matched to requests in order.
+	 */
+	struct PendingReply {
+		uint8_t command;
+		/** CAN ID, or -1 for the controller attached directly */
+		int source;
+	};
+	static constexpr size_t MAX_PENDING_REPLIES = 16;
+
+	std::vector<VescForwardCANInterface *> forwarded;
+	std::deque<PendingReply> pending;
+	std::mutex pending_mutex;
 };
 
 class VescUartInterface :
@@ -27,48 +56,92 @@ class VescUartInterface :
 	protected Task
 {
 public:
+	struct RxStats {
+		uint32_t bytes;
+		uint32_t frames;
+		/** Frames abandoned because the next byte didn't come in time */
+		uint32_t timeouts;
+		uint32_t overflows;
+	};
+
 	VescUartInterface(const char *name, uart_port_t uart_port);
 	virtual int sendPacket(uint8_t *packet, int len);
 	virtual void onPacketCallback(VescInterface::ReceivePacketCb&& cb);
-	virtual void rxStart();
+
+	RxStats rxStats() const { return rx_stats; }
 
 protected:
 	void run() override;
 private: 
+	/** Gap within a frame after which the partial frame is dropped */
+	static constexpr int64_t RX_BYTE_TIMEOUT_US = 10000;
+
 	TaskHandle_t task;
 
 	uart_port_t uart_port;
-	esp_timer_handle_t timer;
-
-	struct {
-		bool receiving;
-		uint8_t buf[256];
-		uint16_t len;
-		uint32_t deadline;
-
-		uint16_t end_message;
-		uint8_t *payload;
-		uint16_t payload_len;
-		
-	} rx_state;
-
 	QueueHandle_t uart_queue;
 
-	void receive(int len);
-	void rxStop();
+	/**
+	 * Byte-at-a-time framer from packet.c, frames may arrive split across
+	 * or packed several into one UART event
+	 */
+	bldc_packet_state_t framer;
+	int64_t last_rx_us;
+	RxStats rx_stats;
+
+	void receive();
+	void rxReset();
+	static void rxPacket(unsigned char *data, unsigned int len, void *arg);
 };
 
+/**
+ * Controller behind another one on CAN, reached with COMM_FORWARD_CAN over
+ * its interface. One UART drives any number of controllers this way.
+ */
 class VescForwardCANInterface : public VescInterface {
 public:
 	VescForwardCANInterface(const char *_name, VescInterface& _interface, uint8_t _id);
 	virtual int sendPacket(uint8_t *packet, int len);
-	virtual void onPacketCallback(VescInterface::ReceivePacketCb cb);
+	virtual void onPacketCallback(VescInterface::ReceivePacketCb&& cb);
+
+	uint8_t canId() const { return id; }
 
 private:
 	VescInterface& interface;
 	uint8_t id;
 };
 
+/**
+ * Controller on a CAN bus spoken to directly. Commands with a CAN
+ * equivalent go out as a single frame, others in the VESC buffer transfer
+ * format. Status broadcasts (CAN_PACKET_STATUS to STATUS_5, enabled in the
+ * controller's app configuration) are passed on as COMM_GET_VALUES_SELECTIVE
+ * replies, so values arrive at the broadcast rate without polling.
+ */
+class VescCanInterface : public VescInterface {
+public:
+	/** Our address on the bus, replies to buffer commands are sent to it */
+	static constexpr uint8_t DEFAULT_OWN_ID = 253;
+
+	VescCanInterface(const char *name, CanBus& _bus, uint8_t _controller_id,
+			uint8_t _own_id = DEFAULT_OWN_ID);
+	virtual int sendPacket(uint8_t *packet, int len);
+	virtual void onPacketCallback(VescInterface::ReceivePacketCb&& cb);
+
+private:
+	CanBus& bus;
+	uint8_t controller_id;
+	uint8_t own_id;
+
+	/** Reassembly of buffer transfers addressed to own_id */
+	uint8_t rx_buf[PACKET_MAX_PL_LEN];
+
+	bool sendFrame(uint8_t type, const uint8_t *data, uint8_t len);
+	void sendBuffer(const uint8_t *data, size_t len);
+	void receiveFrame(const CanFrame& frame);
+	void receiveStatus(uint8_t type, const uint8_t *data, uint8_t len);
+};
+
 
 class Vesc {
 public:
@@ -77,26 +150,83 @@ public:
 	Vesc(Vesc&) = delete;
 	Vesc() = delete;
 
+	/**
+	 * COMM_GET_VALUES fields in payload order, each is one bit of the
+	 * COMM_GET_VALUES_SELECTIVE mask
+	 */
+	enum Field : uint32_t {
+		TempFet				= (1 << 0),
+		TempMotor			= (1 << 1),
+		MotorCurrent		= (1 << 2),
+		InputCurrent		= (1 << 3),
+		CurrentD			= (1 << 4),
+		CurrentQ			= (1 << 5),
+		Duty				= (1 << 6),
+		Rpm					= (1 << 7),
+		InputVoltage		= (1 << 8),
+		AmpHours			= (1 << 9),
+		AmpHoursCharged		= (1 << 10),
+		WattHours			= (1 << 11),
+		WattHoursCharged	= (1 << 12),
+		Tachometer			= (1 << 13),
+		TachometerAbs		= (1 << 14),
+		FaultCode			= (1 << 15),
+		PidPos				= (1 << 16),
+		ControllerId		= (1 << 17),
+		TempMos				= (1 << 18),
+		VoltageD			= (1 << 19),
+		VoltageQ			= (1 << 20),
+
+		AllFields			= (1 << 21) - 1,
+	};
+
 	struct vescData {
 		TickType_t timestamp;
+		/** Fields updated by the last reply */
+		uint32_t fields;
+
+		float tempFet;
+		float tempMotor;
 		float avgMotorCurrent;
 		float avgInputCurrent;
+		float avgId;
+		float avgIq;
 		float dutyCycleNow;
 		long rpm;
 		float inpVoltage;
 		float ampHours;
 		float ampHoursCharged;
+		float wattHours;
+		float wattHoursCharged;
 		long tachometer;
 		long tachometerAbs;
-
+		uint8_t faultCode;
+		float pidPos;
+		uint8_t controllerId;
+		float tempMos[3];
+		float vd;
+		float vq;
 	} data;
 
 	using CallbackFn = std::function<void(Vesc& vesc)>;
 	void onValues(CallbackFn&& cb);
+	/** Request all values */
 	void getValues(void);
+	/** Request only `fields`, reply is as short as they allow */
+	void getValues(uint32_t fields);
 	void printValues();
 
+	/** Encode `fields` of `values` as in a COMM_GET_VALUES reply, returns length */
+	static size_t encodeValues(const vescData& values, uint32_t fields, uint8_t *buf);
+	/** Controller ID in a values reply, -1 if it isn't one or doesn't carry it */
+	static int valuesControllerId(const uint8_t *packet, size_t len);
+
 	void sendMsg(uint8_t *payload, uint16_t payload_len);
+
+	/*
+	 * Setpoints: one is active at a time, setting the same one again sends
+	 * nothing. keepAlive() keeps the controller from timing out meanwhile.
+	 */
 	void setCurrent(float current);
 	void setBrakeCurrent(float brakeCurrent);
 	void setRPM(float rpm);
@@ -105,9 +235,46 @@ public:
 	void kill();
 	void brake();
 
+	/** Well inside the controller's default 1 s timeout */
+	static constexpr int DEFAULT_ALIVE_MS = 100;
+	static constexpr int DEFAULT_REFRESH_MS = 1000;
+
+	struct CommandStats {
+		uint32_t sent;
+		uint32_t suppressed;
+		uint32_t alive;
+		uint32_t refreshed;
+	};
+
+	/**
+	 * Call every control step. Sends COMM_ALIVE after `alive_ms` without a
+	 * setpoint, which resets the controller's timeout, and repeats the
+	 * setpoint every `refresh_ms` in case it was lost or the controller
+	 * restarted.
+	 */
+	void keepAlive(int64_t now_us);
+	void setKeepAlive(int alive_ms, int refresh_ms);
+	CommandStats commandStats();
+
 private:
 	VescInterface& interface;
-	bool processReadPacket(uint8_t * message);
+
+	struct {
+		bool valid;
+		uint8_t command;
+		int32_t value;
+		int64_t sent_us;
+		int64_t refreshed_us;
+	} setpoint;
+	int64_t alive_us;
+	int64_t refresh_us;
+	CommandStats command_stats;
+	std::mutex command_mutex;
+
+	void sendSetpoint(uint8_t command, int32_t value);
+	void sendCommand(const std::unique_lock<std::mutex>& lock, uint8_t command, int32_t value);
+	bool processReadPacket(uint8_t *message, size_t len);
+	static uint32_t decodeValues(const uint8_t *message, size_t len, uint32_t fields, vescData& values);
 	CallbackFn cb_values;
 
 	uint8_t last_message[256];
@@ -0,0 +1,226 @@
+//#define LOG_LOCAL_LEVEL ESP_LOG_VERBOSE
+#include <algorithm>
+#include <string.h>
+#include "vesc.hpp"
+#include "datatypes.h"
+#include "buffer.h"
+#include "crc.h"
+
+#define TAG (this->name)
+
+/** Buffer transfer flag: process the command and send replies back over CAN */
+static const uint8_t SEND_PROCESS_REPLY = 0;
+
+VescCanInterface::VescCanInterface(const char *name, CanBus& _bus, uint8_t _controller_id, uint8_t _own_id) :
+	VescInterface(name),
+	bus(_bus),
+	controller_id(_controller_id),
+	own_id(_own_id),
+	rx_buf()
+{
+	ESP_LOGI(TAG, "CAN controller %u, own id %u", controller_id, own_id);
+	bus.subscribe([this](const CanFrame& frame) {
+			receiveFrame(frame);
+			});
+}
+
+bool VescCanInterface::sendFrame(uint8_t type, const uint8_t *data, uint8_t len) {
+	CanFrame frame = {
+		.id = static_cast<uint32_t>(type << 8) | controller_id,
+		.extended = true,
+		.length = len,
+		.data = {},
+	};
+	memcpy(frame.data, data, len);
+	if (!bus.send(frame)) {
+		ESP_LOGW(TAG, "TX: frame 0x%x dropped", frame.id);
+		return false;
+	}
+	return true;
+}
+
+// Same framing as comm_can_send_buffer() in VESC firmware
+void VescCanInterface::sendBuffer(const uint8_t *data, size_t len) {
+	uint8_t buf[8];
+
+	if (len <= 6) {
+		buf[0] = own_id;
+		buf[1] = SEND_PROCESS_REPLY;
+		memcpy(buf + 2, data, len);
+		sendFrame(CAN_PACKET_PROCESS_SHORT_BUFFER, buf, len + 2);
+		return;
+	}
+
+	size_t i = 0;
+	for (; (i < len) && (i <= 255); i += 7) {
+		const size_t n = std::min<size_t>(7, len - i);
+		buf[0] = i;
+		memcpy(buf + 1, data + i, n);
+		sendFrame(CAN_PACKET_FILL_RX_BUFFER, buf, n + 1);
+	}
+	for (; i < len; i += 6) {
+		const size_t n = std::min<size_t>(6, len - i);
+		buf[0] = i >> 8;
+		buf[1] = i & 0xFF;
+		memcpy(buf + 2, data + i, n);
+		sendFrame(CAN_PACKET_FILL_RX_BUFFER_LONG, buf, n + 2);
+	}
+
+	const uint16_t crc = crc16(const_cast<uint8_t *>(data), len);
+	buf[0] = own_id;
+	buf[1] = SEND_PROCESS_REPLY;
+	buf[2] = len >> 8;
+	buf[3] = len & 0xFF;
+	buf[4] = crc >> 8;
+	buf[5] = crc & 0xFF;
+	sendFrame(CAN_PACKET_PROCESS_RX_BUFFER, buf, 6);
+}
+
+int VescCanInterface::sendPacket(uint8_t *packet, int len) {
+	if ((len < 1) || (len > PACKET_MAX_PL_LEN)) {
+		ESP_LOGE(TAG, "TX: bad payload length (%d)", len);
+		return 0;
+	}
+
+	// Setpoints have their own frames with the same int32 argument
+	if (len == 5) {
+		int type = -1;
+		switch (packet[0]) {
+			case COMM_SET_DUTY:			type = CAN_PACKET_SET_DUTY; break;
+			case COMM_SET_CURRENT:		type = CAN_PACKET_SET_CURRENT; break;
+			case COMM_SET_CURRENT_BRAKE:	type = CAN_PACKET_SET_CURRENT_BRAKE; break;
+			case COMM_SET_RPM:			type = CAN_PACKET_SET_RPM; break;
+			case COMM_SET_POS:			type = CAN_PACKET_SET_POS; break;
+		}
+		if (type >= 0)
+			return sendFrame(type, packet + 1, 4) ? len : 0;
+	}
+
+	sendBuffer(packet, len);
+	return len;
+}
+
+void VescCanInterface::onPacketCallback(VescInterface::ReceivePacketCb&& cb) {
+	rx_callback = std::move(cb);
+}
+
+void VescCanInterface::receiveFrame(const CanFrame& frame) {
+	if (!frame.extended)
+		return;
+
+	const uint8_t type = frame.id >> 8;
+	const uint8_t target = frame.id & 0xFF;
+	const uint8_t *data = frame.data;
+	const uint8_t len = frame.length;
+
+	switch (type) {
+		case CAN_PACKET_STATUS:
+		case CAN_PACKET_STATUS_2:
+		case CAN_PACKET_STATUS_3:
+		case CAN_PACKET_STATUS_4:
+		case CAN_PACKET_STATUS_5:
+			// Broadcasts carry the sender's ID
+			if (target == controller_id)
+				receiveStatus(type, data, len);
+			return;
+	}
+
+	if (target != own_id)
+		return;
+
+	switch (type) {
+		case CAN_PACKET_FILL_RX_BUFFER:
+			if (len >= 1)
+				memcpy(rx_buf + data[0], data + 1, len - 1);
+			break;
+
+		case CAN_PACKET_FILL_RX_BUFFER_LONG: {
+			if (len < 2)
+				break;
+			const size_t offset = (data[0] << 8) | data[1];
+			if (offset + len - 2 <= sizeof(rx_buf))
+				memcpy(rx_buf + offset, data + 2, len - 2);
+			break;
+		}
+
+		case CAN_PACKET_PROCESS_RX_BUFFER: {
+			if ((len < 6) || (data[0] != controller_id))
+				break;
+			const size_t length = (data[2] << 8) | data[3];
+			const uint16_t crc = (data[4] << 8) | data[5];
+			if (length > sizeof(rx_buf))
+				break;
+			if (crc16(rx_buf, length) != crc) {
+				ESP_LOGW(TAG, "RX: CRC check failed");
+				break;
+			}
+			receivePacket(rx_buf, length);
+			break;
+		}
+
+		case CAN_PACKET_PROCESS_SHORT_BUFFER: {
+			if ((len < 3) || (data[0] != controller_id))
+				break;
+			uint8_t packet[6];
+			memcpy(packet, data + 2, len - 2);
+			receivePacket(packet, len - 2);
+			break;
+		}
+	}
+}
+
+void VescCanInterface::receiveStatus(uint8_t type, const uint8_t *data, uint8_t len) {
+	Vesc::vescData values = {};
+	uint32_t fields = 0;
+	int32_t ind = 0;
+
+	if (len < 8)
+		return;
+
+	switch (type) {
+		case CAN_PACKET_STATUS:
+			values.rpm = buffer_get_int32(data, &ind);
+			values.avgMotorCurrent = buffer_get_float16(data, 10, &ind);
+			values.dutyCycleNow = buffer_get_float16(data, 1000, &ind);
+			fields = Vesc::Rpm | Vesc::MotorCurrent | Vesc::Duty;
+			break;
+
+		case CAN_PACKET_STATUS_2:
+			values.ampHours = buffer_get_float32(data, 10000, &ind);
+			values.ampHoursCharged = buffer_get_float32(data, 10000, &ind);
+			fields = Vesc::AmpHours | Vesc::AmpHoursCharged;
+			break;
+
+		case CAN_PACKET_STATUS_3:
+			values.wattHours = buffer_get_float32(data, 10000, &ind);
+			values.wattHoursCharged = buffer_get_float32(data, 10000, &ind);
+			fields = Vesc::WattHours | Vesc::WattHoursCharged;
+			break;
+
+		case CAN_PACKET_STATUS_4:
+			values.tempFet = buffer_get_float16(data, 10, &ind);
+			values.tempMotor = buffer_get_float16(data, 10, &ind);
+			values.avgInputCurrent = buffer_get_float16(data, 10, &ind);
+			values.pidPos = buffer_get_float16(data, 50, &ind);
+			fields = Vesc::TempFet | Vesc::TempMotor | Vesc::InputCurrent | Vesc::PidPos;
+			break;
+
+		case CAN_PACKET_STATUS_5:
+			values.tachometer = buffer_get_int32(data, &ind);
+			values.inpVoltage = buffer_get_float16(data, 10, &ind);
+			fields = Vesc::Tachometer | Vesc::InputVoltage;
+			break;
+
+		default:
+			return;
+	}
+
+	// Status fields fit well within one selective reply
+	uint8_t packet[64];
+	ind = 0;
+	packet[ind++] = COMM_GET_VALUES_SELECTIVE;
+	buffer_append_uint32(packet, fields, &ind);
+	const size_t length = ind + Vesc::encodeValues(values, fields, packet + ind);
+	ESP_LOGV(TAG, "RX: status %u", type);
+	receivePacket(packet, length);
+}
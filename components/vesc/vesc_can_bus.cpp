@@ -0,0 +1,38 @@
+#include "vesc_can_bus.hpp"
+
+void CanBus::subscribe(ReceiveCb&& cb)
+{
+	listeners.push_back(std::move(cb));
+}
+
+void CanBus::receive(const CanFrame& frame)
+{
+	for (auto& cb : listeners)
+		cb(frame);
+}
+
+bool MemoryCanBus::send(const CanFrame& frame)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	queue.push_back(frame);
+	if (delivering)
+		return true;
+
+	delivering = true;
+	while (!queue.empty()) {
+		const auto f = queue.front();
+		queue.pop_front();
+		delivered++;
+		lock.unlock();
+		receive(f);
+		lock.lock();
+	}
+	delivering = false;
+	return true;
+}
+
+uint32_t MemoryCanBus::frames() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return delivered;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+struct CanFrame {
+	uint32_t id;
+	bool extended;
+	uint8_t length;
+	uint8_t data[8];
+};
+
+/**
+ * CAN controller as seen by VescCanInterface. Listeners are called from the
+ * bus's receive context and must be subscribed before traffic starts.
+ */
+class CanBus {
+public:
+	using ReceiveCb = std::function<void(const CanFrame& frame)>;
+
+	virtual ~CanBus() = default;
+
+	/** Queue `frame` for transmission, false if it couldn't be */
+	virtual bool send(const CanFrame& frame) = 0;
+	void subscribe(ReceiveCb&& cb);
+
+protected:
+	void receive(const CanFrame& frame);
+
+private:
+	std::vector<ReceiveCb> listeners;
+};
+
+/**
+ * Bus that exists only in memory, for running VESC transports on the host.
+ * Every sent frame is delivered to every listener, the sender included,
+ * before send() returns. Frames sent from within a listener are delivered
+ * after the current one instead of recursing.
+ */
+class MemoryCanBus : public CanBus {
+public:
+	virtual bool send(const CanFrame& frame);
+
+	/** Frames delivered so far */
+	uint32_t frames() const;
+
+private:
+	mutable std::mutex mutex;
+	std::deque<CanFrame> queue;
+	bool delivering = false;
+	uint32_t delivered = 0;
+};
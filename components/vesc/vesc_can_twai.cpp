@@ -0,0 +1,96 @@
+#include "vesc_can_twai.hpp"
+
+#include "driver/twai.h"
+#include "esp_log.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#define TAG "twai"
+
+static twai_timing_config_t timing_config(uint32_t bitrate)
+{
+	switch (bitrate) {
+		case 125000:
+			return TWAI_TIMING_CONFIG_125KBITS();
+		case 250000:
+			return TWAI_TIMING_CONFIG_250KBITS();
+		case 500000:
+			return TWAI_TIMING_CONFIG_500KBITS();
+		case 1000000:
+			return TWAI_TIMING_CONFIG_1MBITS();
+		default:
+			throw std::invalid_argument("Unsupported CAN bitrate");
+	}
+}
+
+TwaiCanBus::TwaiCanBus(gpio_num_t tx, gpio_num_t rx, uint32_t bitrate) :
+	Task::Task(TAG, 4*1024, 20)
+{
+	twai_general_config_t g_config = TWAI_GENERAL_CONFIG_DEFAULT(tx, rx, TWAI_MODE_NORMAL);
+	// Status broadcasts from several controllers arrive back to back
+	g_config.rx_queue_len = 32;
+	g_config.tx_queue_len = 16;
+	const twai_timing_config_t t_config = timing_config(bitrate);
+	const twai_filter_config_t f_config = TWAI_FILTER_CONFIG_ACCEPT_ALL();
+
+	ESP_LOGI(TAG, "Initializing, %u bit/s", bitrate);
+	auto err = twai_driver_install(&g_config, &t_config, &f_config);
+	if (err == ESP_OK)
+		err = twai_start();
+	if (err != ESP_OK)
+		throw std::runtime_error(std::string("TWAI init failed: ") + esp_err_to_name(err));
+
+	Task::start();
+}
+
+bool TwaiCanBus::send(const CanFrame& frame)
+{
+	twai_message_t msg = {};
+	msg.extd = frame.extended;
+	msg.identifier = frame.id;
+	msg.data_length_code = frame.length;
+	memcpy(msg.data, frame.data, frame.length);
+
+	const auto err = twai_transmit(&msg, 10 / portTICK_PERIOD_MS);
+	if (err != ESP_OK) {
+		ESP_LOGD(TAG, "transmit: %s", esp_err_to_name(err));
+		return false;
+	}
+	return true;
+}
+
+void TwaiCanBus::run()
+{
+	twai_message_t msg;
+	while (1) {
+		if (twai_receive(&msg, 100 / portTICK_PERIOD_MS) != ESP_OK) {
+			twai_status_info_t status;
+			if (twai_get_status_info(&status) != ESP_OK)
+				continue;
+			// Bus-off needs recovery, after which the controller is stopped
+			if (status.state == TWAI_STATE_BUS_OFF) {
+				ESP_LOGW(TAG, "bus off, recovering");
+				twai_initiate_recovery();
+			}
+			else if (status.state == TWAI_STATE_STOPPED) {
+				ESP_LOGI(TAG, "recovered");
+				twai_start();
+			}
+			continue;
+		}
+		if (msg.rtr)
+			continue;
+
+		CanFrame frame = {
+			.id = msg.identifier,
+			.extended = static_cast<bool>(msg.extd),
+			.length = std::min<uint8_t>(msg.data_length_code, sizeof(CanFrame::data)),
+			.data = {},
+		};
+		memcpy(frame.data, msg.data, frame.length);
+		receive(frame);
+	}
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "driver/gpio.h"
+#include "util_task.hpp"
+#include "vesc_can_bus.hpp"
+
+/** CanBus on the ESP32's own TWAI controller, needs an external transceiver */
+class TwaiCanBus :
+	public CanBus,
+	protected Task
+{
+public:
+	TwaiCanBus(gpio_num_t tx, gpio_num_t rx, uint32_t bitrate = 500000);
+
+	virtual bool send(const CanFrame& frame);
+
+protected:
+	void run() override;
+};
@@ -1,6 +1,125 @@
+#include <string.h>
 #include "vesc.hpp"
+#include "datatypes.h"
+#include "buffer.h"
+
+#define TAG (this->name)
+
+static bool is_values(uint8_t command)
+{
+	return (command == COMM_GET_VALUES) || (command == COMM_GET_VALUES_SELECTIVE);
+}
+
+/** Commands other than values requests that are answered */
+static bool expects_reply(uint8_t command)
+{
+	switch (command) {
+		case COMM_FW_VERSION:
+		case COMM_GET_MCCONF:
+		case COMM_GET_MCCONF_DEFAULT:
+		case COMM_GET_APPCONF:
+		case COMM_GET_APPCONF_DEFAULT:
+		case COMM_GET_DECODED_PPM:
+		case COMM_GET_DECODED_ADC:
+		case COMM_GET_DECODED_CHUK:
+		case COMM_GET_VALUES_SETUP:
+			return true;
+		default:
+			return false;
+	}
+}
+
+void VescInterface::addForwarded(VescForwardCANInterface& iface)
+{
+	std::lock_guard<std::mutex> lock(pending_mutex);
+	forwarded.push_back(&iface);
+}
+
+void VescInterface::sentPacket(const uint8_t *packet, size_t len)
+{
+	if (len < 1)
+		return;
+
+	std::lock_guard<std::mutex> lock(pending_mutex);
+	if (forwarded.empty())
+		return;
+
+	PendingReply p = { packet[0], -1 };
+	if ((packet[0] == COMM_FORWARD_CAN) && (len >= 3))
+		p = { packet[2], packet[1] };
+	if (!expects_reply(p.command))
+		return;
+
+	// Requests that never got a reply would otherwise pile up
+	if (pending.size() >= MAX_PENDING_REPLIES)
+		pending.pop_front();
+	pending.push_back(p);
+}
+
+void VescInterface::receivePacket(uint8_t *packet, size_t len)
+{
+	VescInterface *target = this;
+	{
+		std::lock_guard<std::mutex> lock(pending_mutex);
+		if (!forwarded.empty() && (len >= 1)) {
+			int source = -1;
+			if (is_values(packet[0])) {
+				// Forwarded values requests always ask for the controller ID
+				source = Vesc::valuesControllerId(packet, len);
+			}
+			else {
+				for (auto it = pending.begin(); it != pending.end(); it++) {
+					if (it->command == packet[0]) {
+						source = it->source;
+						pending.erase(it);
+						break;
+					}
+				}
+			}
+
+			for (auto iface : forwarded) {
+				if (iface->canId() == source)
+					target = iface;
+			}
+		}
+	}
+
+	if (target != this)
+		target->receivePacket(packet, len);
+	else if (rx_callback)
+		rx_callback(packet, len);
+}
 
 VescForwardCANInterface::VescForwardCANInterface(const char *_name, VescInterface& _interface, uint8_t _id) :
 		VescInterface(_name),
 		interface(_interface),
-		id(_id) {};
+		id(_id)
+{
+	interface.addForwarded(*this);
+}
+
+int VescForwardCANInterface::sendPacket(uint8_t *packet, int len) {
+	if (len + 2 > PACKET_MAX_PL_LEN) {
+		ESP_LOGE(TAG, "TX: payload too long (%d)", len);
+		return 0;
+	}
+
+	uint8_t buf[PACKET_MAX_PL_LEN];
+	buf[0] = COMM_FORWARD_CAN;
+	buf[1] = id;
+	memcpy(buf + 2, packet, len);
+
+	// Values replies then say which controller they came from
+	if ((packet[0] == COMM_GET_VALUES_SELECTIVE) && (len >= 5)) {
+		int32_t ind = 3;
+		const uint32_t fields = buffer_get_uint32(buf, &ind) | Vesc::ControllerId;
+		ind = 3;
+		buffer_append_uint32(buf, fields, &ind);
+	}
+
+	return interface.sendPacket(buf, len + 2);
+}
+
+void VescForwardCANInterface::onPacketCallback(VescInterface::ReceivePacketCb&& cb) {
+	rx_callback = std::move(cb);
+}
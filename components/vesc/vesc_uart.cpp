@@ -17,7 +17,10 @@ static const auto RX_BUF_SIZE = 512;
 VescUartInterface::VescUartInterface(const char *name, uart_port_t _uart_port) :
 	VescInterface(name),
 	Task::Task(name, 16*1024, 20),
-	uart_port(_uart_port)
+	uart_port(_uart_port),
+	framer(),
+	last_rx_us(0),
+	rx_stats()
 {
 	this->uart_port = uart_port;
 
@@ -35,7 +38,7 @@ VescUartInterface::VescUartInterface(const char *name, uart_port_t _uart_port) :
 	uart_driver_install(uart_port, RX_BUF_SIZE * 2, RX_BUF_SIZE * 2, 20, &uart_queue, 0);
 	uart_param_config(uart_port, &uart_config);
 
-	rxStop();
+	packet_init(&framer, nullptr, &VescUartInterface::rxPacket, this);
 	Task::start();
 }
 
@@ -47,17 +50,24 @@ void VescUartInterface::run() {
 		
 		switch (event.type) {
 			case UART_DATA:
-				receive(event.size);
+				receive();
 				break;
 
+			// Received data is lost already, start over from a clean state
 			case UART_FIFO_OVF:
 				ESP_LOGW(TAG, "uart fifo overflow");
-				rxStart();
+				rx_stats.overflows++;
+				uart_flush_input(uart_port);
+				xQueueReset(uart_queue);
+				rxReset();
 				break;
 
 			case UART_BUFFER_FULL:
 				ESP_LOGI(TAG, "ring buffer full");
-				rxStart();
+				rx_stats.overflows++;
+				uart_flush_input(uart_port);
+				xQueueReset(uart_queue);
+				rxReset();
 				break;
 
 			case UART_BREAK:
@@ -79,98 +89,52 @@ void VescUartInterface::run() {
 	}
 }
 
-void VescUartInterface::rxStart() {
-	ESP_LOGD(TAG, "rx start");
-	rx_state.receiving = true;
-	rx_state.len = 0;
-	rx_state.end_message = 256;
-	rx_state.payload = NULL;
-	rx_state.payload_len = 0;
-	rx_state.deadline = xTaskGetTickCount() + 100 * portTICK_PERIOD_MS; // Defining the timestamp for timeout (100ms before timeout)
-
-	uart_flush(uart_port);
-	xQueueReset(uart_queue);
+void VescUartInterface::rxReset() {
+	ESP_LOGD(TAG, "rx reset");
+	framer.rx_state = 0;
 }
 
-void VescUartInterface::rxStop() {
-	ESP_LOGD(TAG, "rx stop");
-	rx_state.receiving = false;
+void VescUartInterface::rxPacket(unsigned char *data, unsigned int len, void *arg) {
+	auto self = static_cast<VescUartInterface *>(arg);
+	self->rx_stats.frames++;
+	ESP_LOGD(self->name, "RX: %u byte packet", len);
+	self->receivePacket(data, len);
 }
 
-void VescUartInterface::receive(int len) {
-	// Messages <= 255 starts with "2", 2nd byte is length
-	// Messages > 255 starts with "3" 2nd and 3rd byte is length combined with 1st >>8 and then &0xFF
-
-	int length = uart_read_bytes(uart_port, rx_state.buf + rx_state.len, len, 100 / portTICK_PERIOD_MS);
-	if (length < 0) {
-		ESP_LOGE(TAG, "RX: uart_read_bytes failed");
-		return;
-	}
-	rx_state.len += length;
-	ESP_LOGD(TAG, "rx %d bytes", length);
-
-	if (rx_state.len >= 2) {
-		switch (rx_state.buf[0]) {
-			case 2:
-				rx_state.end_message = rx_state.buf[1] + 5; //Payload size + 2 for sice + 3 for SRC and End.
-				break;
-
-			case 3:
-				// ToDo: Add Message Handling > 255 (starting with 3)
-				ESP_LOGW(TAG, "RX: Message is larger than 256 bytes - not supported");
-				rxStop();
-				break;
-
-			default:
-				ESP_LOGE(TAG, "RX: Invalid start byte 0x%x", rx_state.buf[0]);
-				rxStop();
-				break;
+void VescUartInterface::receive() {
+	// Drains everything buffered, the event's size may be behind the driver
+	uint8_t chunk[128];
+	int length;
+	while ((length = uart_read_bytes(uart_port, chunk, sizeof(chunk), 0)) > 0) {
+		const auto now = esp_timer_get_time();
+		if (framer.rx_state && (now - last_rx_us > RX_BYTE_TIMEOUT_US)) {
+			ESP_LOGW(TAG, "RX: frame timed out");
+			rx_stats.timeouts++;
+			rxReset();
 		}
-	}
+		last_rx_us = now;
+		rx_stats.bytes += length;
+		ESP_LOGV(TAG, "rx %d bytes", length);
 
-	if (rx_state.len >= sizeof(rx_state.buf)) {
-		ESP_LOGW(TAG, "RX: buffer overflow");
-		rxStop();
-		return;
-	}
-
-	if (rx_state.len == rx_state.end_message && rx_state.buf[rx_state.end_message - 1] == 3) {
-		rx_state.buf[rx_state.end_message] = 0;
-		ESP_LOGD(TAG, "RX: End of message reached!");
-
-		/* Unpack payload */
-		int len_msg = rx_state.end_message;
-
-		// Rebuild crc:
-		uint16_t crc_msg = (rx_state.buf[len_msg - 3] << 8) | 
-			(rx_state.buf[len_msg - 2]);
-		
-		uint16_t crc_calc = crc16(rx_state.buf + 2, rx_state.buf[1]);
-
-		ESP_LOGD(TAG, "RX: CRC rcvd %04x, calc %04x", crc_msg, crc_calc);
-
-		if (crc_msg == crc_calc) {
-			rx_state.payload = rx_state.buf + 2;
-			rx_state.payload_len = rx_state.buf[1];
-			//ESP_LOGD(name, "RX: ");
-			//ESP_LOG_BUFFER_HEXDUMP(name, rx_state.payload, rx_state.payload_len, ESP_LOG_DEBUG);
-			if (rx_callback) {
-				rx_callback(rx_state.payload);
-				//rx_callback = NULL;
-			}
-		}
-		else {
-			ESP_LOGW(TAG, "RX: CRC check failed: rcvd %04x != calc %04x", crc_msg, crc_calc);
-		}
+		// Garbage and frames failing CRC are skipped until the next start byte
+		for (int i = 0; i < length; i++)
+			packet_process_byte(&framer, chunk[i]);
 	}
+	if (length < 0)
+		ESP_LOGE(TAG, "RX: uart_read_bytes failed");
 }
 
 int VescUartInterface::sendPacket(uint8_t * payload, int payload_len) {
+	if (payload_len > PACKET_MAX_PL_LEN) {
+		ESP_LOGE(TAG, "TX: payload too long (%d)", payload_len);
+		return 0;
+	}
+
 	uint16_t crc = crc16(payload, payload_len);
 	int count = 0;
-	uint8_t buf[256];
+	uint8_t buf[PACKET_MAX_PL_LEN + 6];
 
-	if (payload_len <= 256) {
+	if (payload_len <= 255) {
 		buf[count++] = 2;
 		buf[count++] = payload_len;
 	}
@@ -186,12 +150,13 @@ int VescUartInterface::sendPacket(uint8_t * payload, int payload_len) {
 	buf[count++] = (uint8_t)(crc >> 8);
 	buf[count++] = (uint8_t)(crc & 0xFF);
 	buf[count++] = 3;
-	buf[count] = '\0';
 /*
 	ESP_LOGD(TAG, "TX: ");
 	ESP_LOG_BUFFER_HEXDUMP(name, buf, count, ESP_LOG_DEBUG);
 */
 
+	sentPacket(payload, payload_len);
+
 	// Sending package
 	int ret = uart_write_bytes(uart_port, (const char *)buf, count);
 	if (ret < 0) {
@@ -9,6 +9,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <sys/param.h>
 #include "esp_log.h"
 #include "esp_console.h"
 #include "esp_ota_ops.h"
@@ -18,10 +19,15 @@
 #include "esp_wifi.h"
 #include "esp_netif.h"
 #include "esp_event.h"
+#include "esp_timer.h"
 //#include "esp_event_loop.h"
 #include "wifi.h"
 
 #define JOIN_TIMEOUT_MS (10000)
+#define COEX_BACKOFF_MIN_MS (1000)
+#define COEX_BACKOFF_MAX_MS (30000)
+#define COEX_SCAN_MIN_MS (20)
+#define COEX_SCAN_MAX_MS (40)
 
 typedef struct {
 	struct arg_str *ssid;
@@ -34,9 +40,15 @@ typedef struct {
 	struct arg_end *end;
 } wifi_scan_arg_t;
 
+typedef struct {
+	struct arg_int *channel;
+	struct arg_end *end;
+} wifi_coex_args_t;
+
 static wifi_args_t sta_args;
 static wifi_scan_arg_t scan_args;
 static wifi_args_t ap_args;
+static wifi_coex_args_t coex_args;
 static bool reconnect = true;
 static const char *TAG="cmd_wifi";
 
@@ -50,6 +62,141 @@ static esp_netif_t *netif_ap = NULL;
 static esp_ip4_addr_t s_ip_addr;
 static char s_ssid[32];
 
+/*
+ * Coexistence of the STA with ESP-NOW. The radio has a single channel, so a
+ * full scan or an AP on another channel takes it away from ESP-NOW peers.
+ * With a pinned channel the STA reconnects by scanning that channel only and
+ * joining the AP found there by BSSID, which never leaves the channel.
+ */
+static portMUX_TYPE coex_mux = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t coex_channel = 0;
+static wifi_coex_stats_t coex_stats;
+static esp_timer_handle_t coex_timer = NULL;
+static uint32_t coex_backoff_ms = COEX_BACKOFF_MIN_MS;
+static bool coex_scan_pending = false;
+static int64_t coex_scan_since = 0;
+static int64_t coex_off_channel_since = 0;
+
+static uint8_t home_channel()
+{
+	return coex_channel ? coex_channel : DEFAULT_WIFI_CHANNEL;
+}
+
+static void coex_off_channel_begin()
+{
+	portENTER_CRITICAL(&coex_mux);
+	if (!coex_off_channel_since) {
+		coex_off_channel_since = esp_timer_get_time();
+		coex_stats.channel_switches++;
+	}
+	portEXIT_CRITICAL(&coex_mux);
+}
+
+static void coex_off_channel_end()
+{
+	portENTER_CRITICAL(&coex_mux);
+	if (coex_off_channel_since) {
+		coex_stats.off_channel_us += esp_timer_get_time() - coex_off_channel_since;
+		coex_off_channel_since = 0;
+	}
+	portEXIT_CRITICAL(&coex_mux);
+}
+
+static esp_err_t scan_start(wifi_scan_config_t *scan_config)
+{
+	if (coex_channel) {
+		scan_config->channel = coex_channel;
+	}
+	esp_err_t err = esp_wifi_scan_start(scan_config, false);
+	if (err != ESP_OK) {
+		return err;
+	}
+	portENTER_CRITICAL(&coex_mux);
+	coex_scan_since = esp_timer_get_time();
+	portEXIT_CRITICAL(&coex_mux);
+	if (scan_config->channel != home_channel()) {
+		coex_off_channel_begin();
+	}
+	return ESP_OK;
+}
+
+static void coex_schedule_reconnect()
+{
+	ESP_LOGI(TAG, "Reconnecting in %d ms", coex_backoff_ms);
+	esp_timer_stop(coex_timer);
+	esp_timer_start_once(coex_timer, coex_backoff_ms * 1000ULL);
+	coex_backoff_ms = MIN(coex_backoff_ms * 2, COEX_BACKOFF_MAX_MS);
+}
+
+static void coex_reconnect_scan()
+{
+	static uint8_t ssid[33];
+	wifi_config_t cfg;
+	wifi_scan_config_t scan_config = {
+		.ssid = ssid,
+		.scan_type = WIFI_SCAN_TYPE_ACTIVE,
+		.scan_time.active = {
+			.min = COEX_SCAN_MIN_MS,
+			.max = COEX_SCAN_MAX_MS,
+		},
+	};
+
+	esp_wifi_get_config(ESP_IF_WIFI_STA, &cfg);
+	strlcpy((char *)ssid, (char *)cfg.sta.ssid, sizeof(ssid));
+	coex_scan_pending = true;
+	if (scan_start(&scan_config) != ESP_OK) {
+		coex_scan_pending = false;
+		coex_schedule_reconnect();
+		return;
+	}
+	portENTER_CRITICAL(&coex_mux);
+	coex_stats.scans++;
+	portEXIT_CRITICAL(&coex_mux);
+}
+
+static void coex_timer_cb(void *arg)
+{
+	if (reconnect && coex_channel) {
+		coex_reconnect_scan();
+	}
+}
+
+/*
+ * The pinned BSSID and channel only hold while coexistence is on, keep them
+ * out of NVS so that the next boot starts from the stored SSID alone.
+ */
+static void coex_set_sta_config(wifi_config_t *cfg)
+{
+	esp_wifi_set_storage(WIFI_STORAGE_RAM);
+	esp_wifi_set_config(ESP_IF_WIFI_STA, cfg);
+	esp_wifi_set_storage(WIFI_STORAGE_FLASH);
+}
+
+static void coex_connect(const wifi_ap_record_t *aps, uint16_t count)
+{
+	wifi_config_t cfg;
+	esp_wifi_get_config(ESP_IF_WIFI_STA, &cfg);
+	for (uint16_t i = 0; i < count; i++) {
+		if ((aps[i].primary != coex_channel) ||
+				strncmp((char *)aps[i].ssid, (char *)cfg.sta.ssid, sizeof(cfg.sta.ssid))) {
+			continue;
+		}
+		memcpy(cfg.sta.bssid, aps[i].bssid, sizeof(cfg.sta.bssid));
+		cfg.sta.bssid_set = true;
+		cfg.sta.channel = coex_channel;
+		coex_set_sta_config(&cfg);
+		portENTER_CRITICAL(&coex_mux);
+		coex_stats.reconnects++;
+		portEXIT_CRITICAL(&coex_mux);
+		if (esp_wifi_connect() != ESP_OK) {
+			coex_schedule_reconnect();
+		}
+		return;
+	}
+	ESP_LOGI(TAG, "%s not found on channel %d", cfg.sta.ssid, coex_channel);
+	coex_schedule_reconnect();
+}
+
 static void on_scan_done(void* arg, esp_event_base_t event_base,
                       int32_t event_id, void* event_data)
 {
@@ -57,6 +204,14 @@ static void on_scan_done(void* arg, esp_event_base_t event_base,
 	uint8_t i;
 	wifi_ap_record_t *ap_list_buffer;
 
+	portENTER_CRITICAL(&coex_mux);
+	if (coex_scan_since) {
+		coex_stats.scan_us += esp_timer_get_time() - coex_scan_since;
+		coex_scan_since = 0;
+	}
+	portEXIT_CRITICAL(&coex_mux);
+	coex_off_channel_end();
+
 	esp_wifi_scan_get_ap_num(&sta_number);
 	ap_list_buffer = malloc(sta_number * sizeof(wifi_ap_record_t));
 	if (ap_list_buffer == NULL) {
@@ -65,8 +220,15 @@ static void on_scan_done(void* arg, esp_event_base_t event_base,
 	}
 
 	if (esp_wifi_scan_get_ap_records(&sta_number,(wifi_ap_record_t *)ap_list_buffer) == ESP_OK) {
-		for(i=0; i<sta_number; i++) {
-			ESP_LOGI(TAG, "[%s][rssi=%d]", ap_list_buffer[i].ssid, ap_list_buffer[i].rssi);
+		if (coex_scan_pending) {
+			coex_scan_pending = false;
+			coex_connect(ap_list_buffer, sta_number);
+		}
+		else {
+			for(i=0; i<sta_number; i++) {
+				ESP_LOGI(TAG, "[%s][ch=%d][rssi=%d]", ap_list_buffer[i].ssid,
+						ap_list_buffer[i].primary, ap_list_buffer[i].rssi);
+			}
 		}
 	}
 	free(ap_list_buffer);
@@ -78,6 +240,7 @@ static void on_got_ip(void* arg, esp_event_base_t event_base,
 	ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
 	memcpy(&s_ip_addr, &event->ip_info.ip, sizeof(s_ip_addr));
 	ESP_LOGI(TAG, "IPv4 address: " IPSTR, IP2STR(&s_ip_addr));
+	coex_backoff_ms = COEX_BACKOFF_MIN_MS;
 	xEventGroupSetBits(wifi_event_group, CONNECTED_BIT);
 	xEventGroupClearBits(wifi_event_group, DISCONNECTED_BIT);
 }
@@ -87,7 +250,21 @@ static void on_wifi_connect(void *arg, esp_event_base_t event_base,
 {
 	wifi_event_sta_connected_t *event = (wifi_event_sta_connected_t *)event_data;
 	memcpy(s_ssid, &event->ssid, event->ssid_len);
-	ESP_LOGI(TAG, "Connected to %s", s_ssid);
+	ESP_LOGI(TAG, "Connected to %s, channel %d", s_ssid, event->channel);
+	if (event->channel == home_channel()) {
+		coex_off_channel_end();
+		return;
+	}
+	if (coex_channel) {
+		ESP_LOGW(TAG, "AP is on channel %d, ESP-NOW on %d, disconnecting",
+				event->channel, coex_channel);
+		portENTER_CRITICAL(&coex_mux);
+		coex_stats.rejected++;
+		portEXIT_CRITICAL(&coex_mux);
+		esp_wifi_disconnect();
+		return;
+	}
+	coex_off_channel_begin();
 }
 static void on_wifi_disconnect(void* arg, esp_event_base_t event_base,
                                int32_t event_id, void* event_data)
@@ -96,8 +273,18 @@ static void on_wifi_disconnect(void* arg, esp_event_base_t event_base,
 	s_ssid[0] = 0;
 	xEventGroupClearBits(wifi_event_group, CONNECTED_BIT);
 	xEventGroupSetBits(wifi_event_group, DISCONNECTED_BIT);
+	coex_off_channel_end();
+	if (coex_channel) {
+		esp_wifi_set_channel(coex_channel, WIFI_SECOND_CHAN_NONE);
+		if (reconnect) {
+			coex_schedule_reconnect();
+		}
+		return;
+	}
 	if (reconnect) {
 		ESP_LOGI(TAG, "Trying to reconnect...");
+		// Connecting scans all channels
+		coex_off_channel_begin();
 		ESP_ERROR_CHECK( esp_wifi_connect() );
 	}
 }
@@ -109,7 +296,13 @@ esp_err_t wifi_connect(wifi_config_t *config) {
 		ESP_ERROR_CHECK( esp_wifi_set_config(ESP_IF_WIFI_STA, config));
 	}
 	ESP_ERROR_CHECK(esp_wifi_start());
-	esp_wifi_set_channel(DEFAULT_WIFI_CHANNEL, WIFI_SECOND_CHAN_NONE);
+	esp_wifi_set_channel(home_channel(), WIFI_SECOND_CHAN_NONE);
+	if (coex_channel) {
+		coex_backoff_ms = COEX_BACKOFF_MIN_MS;
+		coex_reconnect_scan();
+		return ESP_OK;
+	}
+	coex_off_channel_begin();
 	ESP_ERROR_CHECK(esp_wifi_connect());
 
 	return ESP_OK;
@@ -124,6 +317,12 @@ esp_err_t wifi_init(void)
 
 	wifi_event_group = xEventGroupCreate();
 
+	const esp_timer_create_args_t coex_timer_args = {
+		.callback = &coex_timer_cb,
+		.name = "wifi_coex",
+	};
+	ESP_ERROR_CHECK(esp_timer_create(&coex_timer_args, &coex_timer));
+
 	netif_sta = esp_netif_create_default_wifi_sta();
 	assert(netif_sta);
 	netif_ap = esp_netif_create_default_wifi_ap();
@@ -160,6 +359,41 @@ void wifi_set_hostname(const char *hostname)
 void wifi_set_reconnect(bool val)
 {
 	reconnect = val;
+	if (!reconnect && coex_timer) {
+		esp_timer_stop(coex_timer);
+	}
+}
+
+void wifi_set_coex_channel(uint8_t channel)
+{
+	coex_channel = channel;
+	if (!wifi_event_group) {
+		return;
+	}
+	if (channel) {
+		esp_wifi_set_channel(channel, WIFI_SECOND_CHAN_NONE);
+		return;
+	}
+
+	// Back to joining by SSID on any channel
+	wifi_config_t cfg;
+	if ((esp_wifi_get_config(ESP_IF_WIFI_STA, &cfg) == ESP_OK) &&
+			(cfg.sta.bssid_set || cfg.sta.channel)) {
+		cfg.sta.bssid_set = false;
+		cfg.sta.channel = 0;
+		coex_set_sta_config(&cfg);
+	}
+}
+
+void wifi_get_coex_stats(wifi_coex_stats_t *stats)
+{
+	portENTER_CRITICAL(&coex_mux);
+	*stats = coex_stats;
+	stats->channel = coex_channel;
+	if (coex_off_channel_since) {
+		stats->off_channel_us += esp_timer_get_time() - coex_off_channel_since;
+	}
+	portEXIT_CRITICAL(&coex_mux);
 }
 
 void wifi_wait_for_ip()
@@ -181,7 +415,7 @@ static bool wifi_cmd_sta_join(const char* ssid, const char* pass)
 	}
 
 	if (bits & CONNECTED_BIT) {
-		reconnect = false;
+		wifi_set_reconnect(false);
 		xEventGroupClearBits(wifi_event_group, CONNECTED_BIT);
 		ESP_ERROR_CHECK( esp_wifi_disconnect() );
 		xEventGroupWaitBits(wifi_event_group, DISCONNECTED_BIT, 0, 1, portTICK_PERIOD_MS);
@@ -218,7 +452,10 @@ static bool wifi_cmd_sta_scan(const char* ssid)
 	esp_wifi_get_mode(&mode);
 	ESP_ERROR_CHECK( esp_wifi_set_mode((mode == WIFI_MODE_AP) ? WIFI_MODE_APSTA : WIFI_MODE_STA));
 	ESP_ERROR_CHECK( esp_wifi_start() );
-	ESP_ERROR_CHECK( esp_wifi_scan_start(&scan_config, false) );
+	if (coex_channel) {
+		ESP_LOGI(TAG, "Scanning channel %d only", coex_channel);
+	}
+	ESP_ERROR_CHECK( scan_start(&scan_config) );
 
 	return true;
 }
@@ -253,7 +490,7 @@ bool wifi_cmd_ap_set(const char* ssid, const char* pass)
 		},
 	};
 
-	reconnect = false;
+	wifi_set_reconnect(false);
 	strncpy((char*) wifi_config.ap.ssid, ssid, sizeof(wifi_config.ap.ssid));
 	if (pass) {
 		if (strlen(pass) != 0 && strlen(pass) < 8) {
@@ -270,7 +507,7 @@ bool wifi_cmd_ap_set(const char* ssid, const char* pass)
 
 	ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_AP));
 	ESP_ERROR_CHECK(esp_wifi_start());
-	esp_wifi_set_channel(DEFAULT_WIFI_CHANNEL, WIFI_SECOND_CHAN_NONE);
+	esp_wifi_set_channel(home_channel(), WIFI_SECOND_CHAN_NONE);
 	ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_AP, &wifi_config));
 	return true;
 }
@@ -314,6 +551,35 @@ static int wifi_cmd_query(int argc, char** argv)
 	return 0;
 }
 
+static int wifi_cmd_coex(int argc, char** argv)
+{
+	int nerrors = arg_parse(argc, argv, (void**) &coex_args);
+	wifi_coex_stats_t stats;
+
+	if (nerrors != 0) {
+		arg_print_errors(stderr, coex_args.end, argv[0]);
+		return 1;
+	}
+
+	if (coex_args.channel->count) {
+		const int channel = coex_args.channel->ival[0];
+		if (channel < 0 || channel > 13) {
+			ESP_LOGE(TAG, "invalid channel %d", channel);
+			return 1;
+		}
+		wifi_set_coex_channel(channel);
+	}
+
+	wifi_get_coex_stats(&stats);
+	printf("channel          : %d%s\n", stats.channel, stats.channel ? "" : " (off)");
+	printf("scans            : %u, %llu ms\n", stats.scans, stats.scan_us / 1000);
+	printf("reconnects       : %u\n", stats.reconnects);
+	printf("rejected         : %u\n", stats.rejected);
+	printf("channel switches : %u\n", stats.channel_switches);
+	printf("off channel      : %llu ms\n", stats.off_channel_us / 1000);
+	return 0;
+}
+
 static uint32_t wifi_get_local_ip(void)
 {
 	int bits = xEventGroupWaitBits(wifi_event_group, CONNECTED_BIT, 0, 1, 0);
@@ -387,4 +653,16 @@ void wifi_register_commands()
 		.func = &wifi_cmd_query,
 	};
 	ESP_ERROR_CHECK( esp_console_cmd_register(&query_cmd) );
+
+	coex_args.channel = arg_int0(NULL, NULL, "<channel>", "channel to pin ESP-NOW to, 0 to disable");
+	coex_args.end = arg_end(1);
+
+	const esp_console_cmd_t coex_cmd = {
+		.command = "wifi_coex",
+		.help = "STA and ESP-NOW coexistence: pin channel, show time lost to channel switches",
+		.hint = NULL,
+		.func = &wifi_cmd_coex,
+		.argtable = &coex_args
+	};
+	ESP_ERROR_CHECK( esp_console_cmd_register(&coex_cmd) );
 }
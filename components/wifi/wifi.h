@@ -15,9 +15,36 @@ extern "C" {
 #endif
 
 #define DEFAULT_WIFI_CHANNEL 1
+
+typedef struct {
+	/** Channel ESP-NOW is pinned to, 0 if coexistence mode is off */
+	uint8_t channel;
+	/** Channel-limited scans for the STA network */
+	uint32_t scans;
+	/** Connection attempts made after such a scan */
+	uint32_t reconnects;
+	/** Connections dropped because the AP moved to another channel */
+	uint32_t rejected;
+	/** Times the radio left the ESP-NOW channel */
+	uint32_t channel_switches;
+	/** Total time spent off the ESP-NOW channel */
+	uint64_t off_channel_us;
+	/** Total time spent scanning, on or off channel */
+	uint64_t scan_us;
+} wifi_coex_stats_t;
+
 esp_err_t wifi_init();
 void wifi_set_hostname(const char *hostname);
 void wifi_set_reconnect(bool reconnect);
+
+/**
+ * Pin the radio to `channel` so that ESP-NOW keeps working while the STA is
+ * connected. Scans only cover that channel, the STA only joins an AP found
+ * there and reconnects with exponential backoff. Pass 0 to disable. Should be
+ * called before wifi_init().
+ */
+void wifi_set_coex_channel(uint8_t channel);
+void wifi_get_coex_stats(wifi_coex_stats_t *stats);
 bool wifi_cmd_ap_set(const char* ssid, const char* pass);
 void wifi_register_commands();
 void wifi_wait_for_ip();
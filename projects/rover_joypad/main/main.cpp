@@ -92,8 +92,7 @@ private:
 	std::array<InputGPIO, to_underlying(JoypadButton::_CountGpio)> buttons_gpio;
 	Joystick joy_left, joy_right;
 	
-	time_point last_send_announce;
-	time_point last_send_state;
+	esp_now::StateHistoryChannel<MessageRoverJoypadStateHistory> *state_channel;
 	time_point last_receive;
 
 	void run() override;
@@ -116,16 +115,17 @@ Application::Application() :
 	},
 	joy_left(ADC_UNIT_1, ADC_CHANNEL_0, ADC_UNIT_1, ADC_CHANNEL_3, 64, 100),
 	joy_right(ADC_UNIT_1, ADC_CHANNEL_4, ADC_UNIT_1, ADC_CHANNEL_5, 64, -100),
-	last_send_announce(),
-	last_send_state(),
+	state_channel(nullptr),
 	last_receive()
 {
 	espnow->set_led(led_blue);
-	espnow->add_peer(PeerBroadcast, std::nullopt, DEFAULT_WIFI_CHANNEL);
 	espnow->add_peer(PeerRoverBody, std::nullopt, DEFAULT_WIFI_CHANNEL);
-	espnow->on_recv(static_cast<MessageType>(RoverBodyState),
-		[this](const Message& msg) {
-			auto& info = msg.payload_as<const BodyPackedState>();
+	espnow->set_clock_reference(PeerRoverBody);
+	state_channel = &espnow->state_history_channel<MessageRoverJoypadStateHistory>(PeerRoverBody, 20ms, 200ms);
+	state_channel->set(state);
+	espnow->set_lane<MessageRoverBodyState>(ESPNow::Lane::Control);
+	espnow->on_recv<MessageRoverBodyState>(
+		[this](const BodyPackedState& info, const MessageView&) {
 			ESP_LOGI(TAG, "BodyState lockout %d, outputs 0x%04x", info.lockout, info.outputs);
 			led_red->set(info.lockout);
 			led_red->blink_once(50);
@@ -138,18 +138,10 @@ void Application::run()
 {
 	ESP_LOGI(TAG, "started");
 	while (1) {
-		const auto now = time_now();
 		try {
-			if (now - last_send_announce > 1s) {
-				last_send_announce = now;
-				espnow->send(Message(PeerBroadcast, esp_now::MessageId::Announce));
-			}
-			bool changed = poll_inputs();
-			auto since_last = now - last_send_state;
-			if ((changed && since_last > 20ms) || (since_last > 200ms)) {
+			if (poll_inputs()) {
 				ESP_LOGI(TAG, "%s", to_string(state).c_str());
-				espnow->send(MessageRoverJoypadState(PeerRoverBody, state));
-				last_send_state = now;
+				state_channel->set(state);
 			}
 		}
 		catch (const std::exception& e) {
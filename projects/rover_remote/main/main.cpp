@@ -42,8 +42,7 @@ private:
 	Leds::Output pixels;
 	std::array<InputGPIO, RemoteButton::_Count> buttons;
 	
-	time_point last_send_announce;
-	time_point last_send_state;
+	esp_now::StateHistoryChannel<MessageRoverRemoteStateHistory> *state_channel;
 	time_point last_receive;
 
 	void run() override;
@@ -67,16 +66,17 @@ Application::Application() :
 		InputGPIO {"sw_red",	GPIO_NUM_27,	false, GPIO_PULLDOWN_ONLY},
 		InputGPIO {"sw_blue",	GPIO_NUM_14,	false, GPIO_PULLDOWN_ONLY},
 	},
-	last_send_announce(),
-	last_send_state(),
+	state_channel(nullptr),
 	last_receive()
 {
 	espnow->set_led(led_blue);
-	espnow->add_peer(PeerBroadcast, std::nullopt, DEFAULT_WIFI_CHANNEL);
 	espnow->add_peer(PeerRoverBody, std::nullopt, DEFAULT_WIFI_CHANNEL);
-	espnow->on_recv(static_cast<MessageType>(RoverBodyState),
-		[this](const Message& msg) {
-			auto& info = msg.payload_as<const BodyPackedState>();
+	espnow->set_clock_reference(PeerRoverBody);
+	state_channel = &espnow->state_history_channel<MessageRoverRemoteStateHistory>(PeerRoverBody, 10ms, 200ms);
+	state_channel->set(state);
+	espnow->set_lane<MessageRoverBodyState>(ESPNow::Lane::Control);
+	espnow->on_recv<MessageRoverBodyState>(
+		[this](const BodyPackedState& info, const MessageView&) {
 			ESP_LOGI(TAG, "BodyState lockout %d, outputs 0x%04x", info.lockout, info.outputs);
 			led_red->set(info.lockout);
 			led_red->blink_once(100);
@@ -94,18 +94,10 @@ void Application::run()
 {
 	ESP_LOGI(TAG, "started");
 	while (1) {
-		const auto now = time_now();
 		try {
-			if (now - last_send_announce > 1s) {
-				last_send_announce = now;
-				espnow->send(Message(PeerBroadcast, esp_now::MessageId::Announce));
-			}
-			bool changed = poll_inputs();
-			auto since_last = now - last_send_state;
-			if ((changed && since_last > 10ms) || (since_last > 200ms)) {
+			if (poll_inputs()) {
 				ESP_LOGI(TAG, "%s", to_string(state).c_str());
-				espnow->send(MessageRoverRemoteState(PeerRoverBody, state));
-				last_send_state = now;
+				state_channel->set(state);
 			}
 		}
 		catch (const std::exception& e) {